@@ -7,6 +7,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
 };
 
 class Multiply : public Operation {
@@ -14,6 +15,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     enum Mode {Elementwise = 0, Inner, Outer};
     static Image apply(Image a, Image b, Mode m);
 };
@@ -22,6 +24,7 @@ class Subtract : public Operation {
 public:
     void help();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     bool test();
 };
 
@@ -30,6 +33,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
 };
 
 class Maximum : public Operation {
@@ -37,6 +41,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static void apply(Image a, Image b);
 };
 
@@ -45,6 +50,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static void apply(Image a, Image b);
 };
 
@@ -53,6 +59,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static void apply(Image a);
 };
 
@@ -61,6 +68,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static void apply(Image a, float base = E);
 };
 
@@ -69,6 +77,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static void apply(Image a);
 };
 
@@ -77,6 +86,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
 };
 
 class Scale : public Operation {
@@ -84,6 +94,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
 };
 
 class Gamma : public Operation {
@@ -91,6 +102,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static void apply(Image a, float);
 };
 
@@ -99,6 +111,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static void apply(Image a, float);
 };
 
@@ -107,6 +120,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static void apply(Image a, float lower = 0, float upper = 1);
 };
 
@@ -115,6 +129,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static void apply(Image a, float replacement = 0);
 };
 
@@ -123,6 +138,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static void apply(Image a, float val);
 };
 
@@ -139,6 +155,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static void apply(Image a, float increment);
 };
 
@@ -0,0 +1,195 @@
+#include "main.h"
+#include "BufferPool.h"
+
+#include <mutex>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#include "header.h"
+
+namespace {
+
+// Buffers smaller than this go straight to malloc, which already
+// handles small sizes well.
+const size_t MIN_POOLED_BYTES = 1 << 16;
+
+// Buffers at least this large are mapped directly from the OS
+const size_t MAPPED_BYTES = 1 << 22;
+
+// The default cap on idle bytes held by the pool
+const size_t DEFAULT_LIMIT = (size_t)1 << 30;
+
+struct PoolState {
+    std::mutex mutex;
+    map<size_t, vector<void *> > freeLists;
+    BufferPool::Stats stats;
+    size_t limit;
+
+    PoolState() : limit(DEFAULT_LIMIT) {
+        memset(&stats, 0, sizeof(stats));
+        const char *env = getenv("IMAGESTACK_POOL_LIMIT");
+        if (env) {
+            limit = (size_t)atol(env) << 20;
+        }
+    }
+};
+
+// The state is deliberately never destroyed, because images living in
+// globals (e.g. the stack) are released after static destructors run.
+PoolState &state() {
+    static PoolState *s = new PoolState();
+    return *s;
+}
+
+// Round a request up to its size class. There are four size classes
+// per power of two, so at most a quarter of a buffer is wasted.
+size_t sizeClass(size_t bytes) {
+    size_t p = MIN_POOLED_BYTES;
+    while (p <= bytes/2) { p *= 2; }
+    size_t step = p / 4;
+    return ((bytes + step - 1) / step) * step;
+}
+
+void *systemAllocate(size_t size, bool clear) {
+#ifndef WIN32
+    if (size >= MAPPED_BYTES) {
+        // Anonymous mappings come back zeroed, so clear is free
+        void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) { return NULL; }
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+        return ptr;
+    }
+#endif
+    return clear ? calloc(size, 1) : malloc(size);
+}
+
+void systemFree(void *ptr, size_t size) {
+#ifndef WIN32
+    if (size >= MAPPED_BYTES) {
+        munmap(ptr, size);
+        return;
+    }
+#endif
+    free(ptr);
+}
+
+void trackAllocation(PoolState &s, size_t size) {
+    s.stats.bytesInUse += size;
+    if (s.stats.bytesInUse > s.stats.peakBytes) {
+        s.stats.peakBytes = s.stats.bytesInUse;
+    }
+}
+
+}
+
+void *BufferPool::allocate(size_t bytes, bool clear) {
+    PoolState &s = state();
+
+    if (bytes < MIN_POOLED_BYTES) {
+        void *ptr = clear ? calloc(bytes, 1) : malloc(bytes);
+        if (!ptr) {
+            panic("Could not allocate %lu bytes for image data\n", (unsigned long)bytes);
+        }
+        std::lock_guard<std::mutex> guard(s.mutex);
+        trackAllocation(s, bytes);
+        return ptr;
+    }
+
+    size_t size = sizeClass(bytes);
+    void *ptr = NULL;
+
+    {
+        std::lock_guard<std::mutex> guard(s.mutex);
+        map<size_t, vector<void *> >::iterator it = s.freeLists.find(size);
+        if (it != s.freeLists.end() && !it->second.empty()) {
+            ptr = it->second.back();
+            it->second.pop_back();
+            s.stats.bytesCached -= size;
+            s.stats.hits++;
+            if (clear) { s.stats.bytesCleared += bytes; }
+        } else {
+            s.stats.misses++;
+        }
+        trackAllocation(s, size);
+    }
+
+    if (ptr) {
+        // A recycled buffer holds whatever its last owner left there
+        if (clear) { memset(ptr, 0, bytes); }
+        return ptr;
+    }
+
+    ptr = systemAllocate(size, clear);
+    if (!ptr) {
+        // Give back anything idle and try once more
+        flush();
+        ptr = systemAllocate(size, clear);
+    }
+    if (!ptr) {
+        panic("Could not allocate %lu bytes for image data\n", (unsigned long)bytes);
+    }
+    return ptr;
+}
+
+void BufferPool::release(void *ptr, size_t bytes) {
+    if (!ptr) { return; }
+    PoolState &s = state();
+
+    if (bytes < MIN_POOLED_BYTES) {
+        free(ptr);
+        std::lock_guard<std::mutex> guard(s.mutex);
+        s.stats.bytesInUse -= bytes;
+        return;
+    }
+
+    size_t size = sizeClass(bytes);
+    {
+        std::lock_guard<std::mutex> guard(s.mutex);
+        s.stats.bytesInUse -= size;
+        if (s.stats.bytesCached + size <= s.limit) {
+            s.freeLists[size].push_back(ptr);
+            s.stats.bytesCached += size;
+            return;
+        }
+    }
+
+    systemFree(ptr, size);
+}
+
+void BufferPool::setLimit(size_t bytes) {
+    {
+        std::lock_guard<std::mutex> guard(state().mutex);
+        state().limit = bytes;
+    }
+    flush();
+}
+
+void BufferPool::flush() {
+    PoolState &s = state();
+    map<size_t, vector<void *> > lists;
+    {
+        std::lock_guard<std::mutex> guard(s.mutex);
+        lists.swap(s.freeLists);
+        s.stats.bytesCached = 0;
+    }
+    for (map<size_t, vector<void *> >::iterator it = lists.begin(); it != lists.end(); ++it) {
+        for (size_t i = 0; i < it->second.size(); i++) {
+            systemFree(it->second[i], it->first);
+        }
+    }
+}
+
+BufferPool::Stats BufferPool::stats() {
+    std::lock_guard<std::mutex> guard(state().mutex);
+    return state().stats;
+}
+
+#include "footer.h"
@@ -0,0 +1,61 @@
+#ifndef IMAGESTACK_BUFFER_POOL_H
+#define IMAGESTACK_BUFFER_POOL_H
+
+#include <stddef.h>
+
+#include "header.h"
+
+// A size-bucketed pool of raw buffers that backs image data. Long
+// command lines allocate and release images of the same few sizes
+// over and over (e.g. the temporaries inside GaussianBlur or the
+// pyramids in LocalLaplacian). Rather than returning those buffers to
+// the system and paying for fresh page faults and zeroing each time,
+// released buffers are kept on a free list keyed by their size class
+// and handed back out to the next allocation of a similar size.
+//
+// Large buffers are mapped directly from the OS (and marked as
+// candidates for transparent huge pages where supported), which means
+// a fresh large buffer is already zero and never needs clearing.
+
+class BufferPool {
+public:
+
+    struct Stats {
+        // Allocations satisfied from the free lists
+        size_t hits;
+        // Allocations that had to go to the system
+        size_t misses;
+        // Bytes currently handed out to images
+        size_t bytesInUse;
+        // High water mark of bytesInUse
+        size_t peakBytes;
+        // Bytes sitting on the free lists
+        size_t bytesCached;
+        // Bytes explicitly zeroed because the caller asked for a
+        // cleared buffer that was not already known to be zero
+        size_t bytesCleared;
+    };
+
+    // Get a buffer of at least the given number of bytes. If clear is
+    // true, the buffer is filled with zeros. Panics if the memory
+    // can't be found.
+    static void *allocate(size_t bytes, bool clear);
+
+    // Return a buffer obtained from allocate. The size must match the
+    // size that was requested.
+    static void release(void *ptr, size_t bytes);
+
+    // Set the maximum number of bytes that may sit idle on the free
+    // lists. Setting it to zero disables pooling. The initial value
+    // can be set with the environment variable
+    // IMAGESTACK_POOL_LIMIT, in megabytes.
+    static void setLimit(size_t bytes);
+
+    // Return all cached buffers to the system
+    static void flush();
+
+    static Stats stats();
+};
+
+#include "footer.h"
+#endif
@@ -23,6 +23,15 @@ bool ColorMatrix::test() {
                         2*a.channel(0),
                         -4*a.channel(0) + 2*a.channel(1));
     Image result = ColorMatrix::apply(a, matrix, 3);
+    if (!nearlyEqual(result, correct)) return false;
+
+    // Check it works the same with channels interleaved
+    Image interleaved(123, 234, 3, 3, Image::INTERLEAVED);
+    interleaved.setChannels(a.channel(0) + 4*a.channel(1),
+                            2*a.channel(0),
+                            -4*a.channel(0) + 2*a.channel(1));
+    if (!nearlyEqual(interleaved, correct)) return false;
+    result = ColorMatrix::apply(a.toLayout(Image::INTERLEAVED), matrix, 3);
     return nearlyEqual(result, correct);
 }
 
@@ -7,6 +7,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static Image apply(Image im, const vector<float> &matrix);
     static Image apply(Image im, const float *matrix, int outChannels);
 };
@@ -16,6 +17,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static Image apply(Image im, string from, string to);
     static Image rgb2hsv(Image im);
     static Image hsv2rgb(Image im);
@@ -1,5 +1,11 @@
 #include "main.h"
 #include "Control.h"
+#include "File.h"
+#include "Arithmetic.h"
+#include "Filter.h"
+#include "Geometry.h"
+#include "Statistics.h"
+#include <deque>
 #include "header.h"
 
 void Loop::help() {
@@ -89,6 +95,255 @@ void Time::parse(vector<string> args) {
     printf("%3.3f s\n", t2 - t1);
 }
 
+void Stream::help() {
+    pprintf("-stream runs a sequence of commands over a long sequence of frames"
+            " a few frames at a time, so that the whole volume never has to fit in"
+            " memory. The commands that form the argument must be prefixed with an"
+            " extra dash, as with -loop. The first command is the source, which"
+            " must be -loadframes, or -load of a .tmp or .tiles file. The last"
+            " command is the sink, which must be -saveframes, or -save to a .tmp or"
+            " .tiles file. The commands in between are run on each frame in turn,"
+            " on a stack of their own. Operations that look at neighbouring frames,"
+            " such as -rectfilter or -gaussianblur given a number of frames, are run"
+            " on a block of frames at a time, along with enough frames on either"
+            " side of it to give the same result as running them on the whole"
+            " volume. Blocks are four times as long as the commands reach. Operations that need the"
+            " whole volume at once, such as -normalize or -resample in time, are an"
+            " error. Run those without -stream instead.\n"
+            "\n"
+            "Usage: ImageStack -stream --loadframes in*.jpg --gamma 0.8 --rectfilter 1 1 5\n"
+            "                  --saveframes out%04d.jpg 90\n"
+            "       ImageStack -stream --load in.tmp --gaussianblur 2 2 1 --save out.tiles\n\n");
+}
+
+bool Stream::test() {
+    Image a(37, 23, 9, 3);
+    Noise::apply(a, 0, 1);
+    TempFile tin("_test_stream_in.tmp"), tout("_test_stream_out.tiles");
+    const char *in = tin.name.c_str(), *out = tout.name.c_str();
+    Save::apply(a, in);
+
+    // A sliding window should match running on the whole volume
+    Image expected = a * 2;
+    RectFilter::apply(expected, 3, 1, 3, 2);
+    expected = GaussianBlur::apply(expected, 1, 1, 0.7f);
+    Abs::apply(expected);
+
+    Image marker(1, 1, 1, 1);
+    push(marker);
+    const char *args[] = {"--load", in, "--scale", "2", "--rectfilter", "3", "1", "3", "2",
+                          "--gaussianblur", "1", "1", "0.7", "--abs", "--save", out
+                         };
+    parse(vector<string>(args, args + sizeof(args)/sizeof(args[0])));
+    // The stack outside should be untouched
+    bool ok = stack(0).baseAddress() == marker.baseAddress();
+    pop();
+    ok = ok && nearlyEqual(Load::apply(out), expected);
+
+    // Operations on the whole volume should be refused
+    if (ok) {
+        const char *whole[] = {"--load", in, "--normalize", "--save", out};
+        try {
+            parse(vector<string>(whole, whole + 5));
+            ok = false;
+        } catch (Exception &) {
+        }
+    }
+
+    return ok;
+}
+
+void Stream::parse(vector<string> args) {
+    // Strip a dash and split the commands apart
+    vector<vector<string> > commands;
+    for (size_t i = 0; i < args.size(); i++) {
+        string arg = args[i];
+        if (arg.size() > 1 && arg[0] == '-' && arg[1] == '-') {
+            arg = arg.substr(1, arg.size() - 1);
+            if (isalpha(arg[1])) { commands.push_back(vector<string>()); }
+        }
+        assert(commands.size(), "-stream takes a sequence of commands prefixed with an extra dash\n");
+        commands.back().push_back(arg);
+    }
+    assert(commands.size() >= 2, "-stream needs at least a source and a sink\n");
+
+    const vector<string> &source = commands.front(), &sink = commands.back();
+
+    // The files to read, or the volume to read them from
+    vector<string> files;
+    string volume;
+    int frames;
+    if (source[0] == "-loadframes") {
+        files.assign(source.begin() + 1, source.end());
+        frames = (int)files.size();
+        assert(frames > 0, "-loadframes requires at least one file argument.\n");
+    } else if (source[0] == "-load" && source.size() == 2 &&
+               (suffixMatch(source[1], ".tmp") || suffixMatch(source[1], ".tiles"))) {
+        volume = source[1];
+        // Reading a single pixel of every frame gives the length
+        frames = LoadBlock::apply(volume, 0, 0, 0, 0, 1, 1, 0, 1).frames;
+    } else {
+        panic("-stream must start with -loadframes, or -load of a .tmp or .tiles file\n");
+        return;
+    }
+
+    bool toFrames = sink[0] == "-saveframes";
+    assert((toFrames && (sink.size() == 2 || sink.size() == 3)) ||
+           (sink[0] == "-save" && (sink.size() == 2 || sink.size() == 3) &&
+            (suffixMatch(sink[1], ".tmp") || suffixMatch(sink[1], ".tiles"))),
+           "-stream must end with -saveframes, or -save to a .tmp or .tiles file\n");
+    string outArg = sink.size() == 3 ? sink[2] : "";
+    assert(toFrames || suffixMatch(sink[1], ".tiles") || outArg == "" ||
+           outArg == "float" || outArg == "float32",
+           "-stream can only save floating point .tmp files\n");
+
+    // Each output frame depends on the frames within the sum of the
+    // radii of the commands around it
+    vector<string> middle;
+    int radius = 0;
+    for (size_t i = 1; i + 1 < commands.size(); i++) {
+        OperationMapIterator op = operationMap.find(commands[i][0]);
+        assert(op != operationMap.end(), "Unknown operation \"%s\"\n", commands[i][0].c_str());
+        vector<string> opArgs(commands[i].begin() + 1, commands[i].end());
+        int r = op->second->footprint(opArgs);
+        assert(r != WHOLE_VOLUME,
+               "%s needs the whole volume at once, so it can't be used with -stream\n",
+               commands[i][0].c_str());
+        radius += r;
+        middle.insert(middle.end(), commands[i].begin(), commands[i].end());
+    }
+
+    // Output frames are made a block at a time, from a window of the
+    // input reaching radius frames beyond the block on either side.
+    // Frames near the ends of the window are computed and discarded,
+    // so blocks several times the radius keep that extra work down
+    // to a fraction of the useful work.
+    const int block = radius == 0 ? 1 : 4 * radius;
+
+    // The input frames currently held, starting at frame first
+    std::deque<Image> window;
+    int first = 0;
+    shared_ptr<FileTiles::TiledFile> tiles;
+
+    for (int t0 = 0; t0 < frames; t0 += block) {
+        int t1 = min(frames, t0 + block);
+        int lo = max(0, t0 - radius), hi = min(frames, t1 + radius);
+        while (first < lo) {
+            window.pop_front();
+            first++;
+        }
+        while (first + (int)window.size() < hi) {
+            int f = first + (int)window.size();
+            window.push_back(files.size() ? Load::apply(files[f]) :
+                             LoadBlock::apply(volume, 0, 0, f, 0, 0, 0, 1, 0));
+            assert(window.back().frames == 1 &&
+                   window.back().width == window.front().width &&
+                   window.back().height == window.front().height &&
+                   window.back().channels == window.front().channels,
+                   "-stream can only load many single frame images of the same size\n");
+        }
+
+        // The commands may modify their input, so frames that are
+        // needed again are copied in
+        Image in;
+        if (hi - lo == 1) {
+            in = window.front();
+        } else {
+            in = Image(window[0].width, window[0].height, hi - lo, window[0].channels,
+                       Image::UNINITIALIZED);
+            for (int i = 0; i < hi - lo; i++) {
+                in.frame(i).set(window[i]);
+            }
+        }
+
+        vector<Image> outside;
+        swapStack(outside);
+        Image out;
+        try {
+            push(in);
+            parseCommands(middle);
+            out = stack(0);
+        } catch (Exception &) {
+            swapStack(outside);
+            throw;
+        }
+        swapStack(outside);
+
+        assert(out.frames == in.frames,
+               "The commands given to -stream must not change the number of frames\n");
+
+        for (int t = t0; t < t1; t++) {
+            Image frame = out.frame(t - lo);
+            if (toFrames) {
+                char filename[4096];
+                snprintf(filename, 4096, sink[1].c_str(), t);
+                Save::apply(frame, filename, outArg);
+            } else if (suffixMatch(sink[1], ".tiles")) {
+                if (!tiles) {
+                    tiles.reset(new FileTiles::TiledFile(sink[1], frame.width, frame.height, frames,
+                                                         frame.channels,
+                                                         outArg == "" ? "float32" : outArg));
+                }
+                tiles->write(frame, 0, 0, t, 0);
+            } else {
+                if (t == 0) {
+                    CreateTmp::apply(sink[1], frame.width, frame.height, frames, frame.channels);
+                }
+                SaveBlock::apply(frame, sink[1], 0, 0, t, 0);
+            }
+        }
+    }
+}
+
+void PoolStats::help() {
+    pprintf("-poolstats reports on the pool of recycled buffers that backs image"
+            " data: how many allocations were satisfied from the pool (hits), how"
+            " many had to go to the system (misses), the current and peak number of"
+            " bytes in use by images, the number of idle bytes held by the pool, and"
+            " the number of bytes that had to be cleared when recycling a buffer."
+            " With the argument \"flush\", it also returns all idle buffers to the"
+            " system. The pool's idle memory is capped by the environment variable"
+            " IMAGESTACK_POOL_LIMIT, in megabytes (the default is 1024).\n"
+            "\n"
+            "Usage: ImageStack -load a.jpg -loop 50 --gaussianblur 4 -poolstats\n");
+}
+
+bool PoolStats::test() {
+    // Releasing an image and allocating another of the same size
+    // should reuse the buffer.
+    BufferPool::Stats before = BufferPool::stats();
+    float *addr;
+    {
+        Image a(1000, 1000, 1, 1);
+        addr = a.baseAddress();
+        a(10, 10) = 1;
+    }
+    Image b(1000, 1000, 1, 1);
+    BufferPool::Stats after = BufferPool::stats();
+    if (after.hits <= before.hits) { return false; }
+    if (b.baseAddress() != addr) { return false; }
+    // It should have been cleared on the way back out
+    return b(10, 10) == 0;
+}
+
+void PoolStats::parse(vector<string> args) {
+    assert(args.size() < 2, "-poolstats takes zero or one arguments\n");
+    if (args.size() == 1) {
+        assert(args[0] == "flush", "Unknown argument to -poolstats: %s\n", args[0].c_str());
+        BufferPool::flush();
+    }
+    BufferPool::Stats s = BufferPool::stats();
+    printf("Pool hits:     %lu\n"
+           "Pool misses:   %lu\n"
+           "Bytes in use:  %lu\n"
+           "Peak bytes:    %lu\n"
+           "Bytes cached:  %lu\n"
+           "Bytes cleared: %lu\n",
+           (unsigned long)s.hits, (unsigned long)s.misses,
+           (unsigned long)s.bytesInUse, (unsigned long)s.peakBytes,
+           (unsigned long)s.bytesCached, (unsigned long)s.bytesCleared);
+}
+
 #include "footer.h"
 
 
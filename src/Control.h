@@ -23,5 +23,19 @@ public:
     void parse(vector<string> args);
 };
 
+class Stream : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+};
+
+class PoolStats : public Operation {
+public:
+    void help();
+    bool test();
+    void parse(vector<string> args);
+};
+
 #include "footer.h"
 #endif
@@ -7,6 +7,8 @@
 #include "Statistics.h"
 #include "header.h"
 
+using namespace Expr;
+
 void Convolve::help() {
     pprintf("-convolve takes a width, height, and frames and a single-channel 3D"
             " kernel specified across the rows, then down the columns, then over"
@@ -37,10 +39,32 @@ void Convolve::help() {
             " default method is \"outer\" if the channel counts are different, and "
             "\"elementwise\" if they are the same.\n"
             "\n"
+            "Filters that are separable are applied as a sequence of 1D passes. A"
+            " numeric argument after the filter gives a tolerance: filters whose"
+            " difference from a sum of a few separable filters is at most that"
+            " fraction of the filter (in the Frobenius norm) are applied as that"
+            " sum. Which decomposition was used is printed for each channel of the"
+            " filter. Homogeneous boundaries can only use a single separable"
+            " term.\n"
+            "\n"
+            "The argument \"direct\" disables separable decomposition, and \"fft\""
+            " convolves in Fourier space like -fftconvolve. The argument \"auto\""
+            " picks whichever of separable, direct, or Fourier convolution a model"
+            " of the speed of this machine predicts to be fastest, and prints which"
+            " it chose. The model is measured the first time it is needed, and saved"
+            " in ~/.imagestack_convolve_costs, or the file named by the environment"
+            " variable IMAGESTACK_CONVOLVE_COSTS.\n"
+            "\n"
+            "The options after the filter may be given in any order.\n"
+            "\n"
             "Taking a horizontal gradient with zero boundary condition: \n"
             " ImageStack -load a.tga -convolve 2 1 1  -1 1 zero -save dx.tga\n"
             "Convolving by a bank of filters: \n"
-            " ImageStack -load bank.tmp -load a.tga -convolve homogeneous outer\n");
+            " ImageStack -load bank.tmp -load a.tga -convolve homogeneous outer\n"
+            "Convolving by a low rank approximation of a filter, to within 1%%: \n"
+            " ImageStack -load filter.tmp -load a.tga -convolve zero outer 0.01\n"
+            "Convolving by whichever method is fastest: \n"
+            " ImageStack -load filter.tmp -load a.tga -convolve clamp auto\n");
 }
 
 bool Convolve::test() {
@@ -57,16 +81,72 @@ bool Convolve::test() {
     .region(13, 13, 13, 1, 5, 5, 5, 1)
     .set(1*kernel.channel(2) + 2*kernel.channel(3));
     Image result = Convolve::apply(impulse, kernel, Zero, Multiply::Inner);
-    return nearlyEqual(result, correct);
+    if (!nearlyEqual(result, correct)) return false;
+
+    // Every boundary condition except zero should preserve a constant
+    // image when the filter sums to one, including near the edges and
+    // when the filter is larger than the image.
+    Image flat(37, 5, 3, 1);
+    flat.set(3);
+    Image box(9, 7, 1, 1);
+    box.set(1.0f / (9 * 7));
+    BoundaryCondition conditions[] = {Homogeneous, Clamp, Wrap};
+    for (int i = 0; i < 3; i++) {
+        if (!nearlyEqual(Convolve::apply(flat, box, conditions[i]), flat)) return false;
+    }
+
+    // Separable and rank two filters should be found, and give the
+    // same result as applying the filter directly
+    Image columns(1, 11, 1, 2), rows(15, 1, 1, 2);
+    Noise::apply(columns, 0, 1);
+    Noise::apply(rows, 0, 1);
+    Image separable(15, 11, 1, 1), rankTwo(15, 11, 1, 1);
+    for (int y = 0; y < 11; y++) {
+        for (int x = 0; x < 15; x++) {
+            separable(x, y) = columns(0, y, 0, 0) * rows(x, 0, 0, 0);
+            rankTwo(x, y) = separable(x, y) + columns(0, y, 0, 1) * rows(x, 0, 0, 1);
+        }
+    }
+    Image im(61, 43, 2, 1);
+    Noise::apply(im, 0, 1);
+    for (int i = 0; i < 4; i++) {
+        BoundaryCondition b = (BoundaryCondition)i;
+        Image filters[] = {separable, rankTwo};
+        for (int j = 0; j < 2; j++) {
+            Decomposition d;
+            bool separated = separate(filters[j], b, 0, d);
+            if (b == Homogeneous && j == 1) {
+                if (separated) return false;
+                continue;
+            }
+            if (!separated || (int)d.x.size() != j+1) return false;
+            Image direct(im.width, im.height, im.frames, 1);
+            convolveSingle(im, filters[j], direct, b);
+            if (!nearlyEqual(Convolve::apply(im, filters[j], b), direct)) return false;
+        }
+    }
+
+    return true;
 }
 
-void Convolve::parse(vector<string> args) {
-    string boundaryCondition = "homogeneous";
-    string channelMode = "outer";
+// The arguments to -convolve after the filter are options,
+// recognized by name
+static bool isConvolveOption(const string &arg) {
+    const char *options[] = {"zero", "homogeneous", "clamp", "wrap",
+                             "inner", "outer", "elementwise",
+                             "separable", "direct", "fft", "auto"
+                            };
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+        if (arg == options[i]) return true;
+    }
+    return false;
+}
 
+void Convolve::parse(vector<string> args) {
     Image filter;
+    size_t firstOption = 0;
 
-    if (args.size() > 3) {
+    if (args.size() > 3 && !isConvolveOption(args[0])) {
         int frames, width, height;
         size_t size;
         width = readInt(args[0]);
@@ -78,10 +158,6 @@ void Convolve::parse(vector<string> args) {
                width, height, frames, size, (int)args.size() - 3);
         assert(size % 2 == 1, "filter must have odd size\n");
 
-        assert(args.size() <= size+4,
-               "a size of %ix%ix%i requires at most %i more arguments. %i were given.",
-               width, height, frames, size, (int)args.size() - 2);
-
         filter = Image(width, height, frames, 1);
 
         size_t i = 3;
@@ -92,50 +168,81 @@ void Convolve::parse(vector<string> args) {
                 }
             }
         }
-
-        if (args.size() == size+4) {
-            boundaryCondition = args[size+3];
-        }
-
-    } else if (args.size() < 3) {
-        filter = stack(1);
-        if (args.size() >= 1) {
-            boundaryCondition = args[0];
-        }
-        if (args.size() == 2) {
-            channelMode = args[1];
-        } else if (stack(0).channels == filter.channels) {
-            channelMode = "elementwise";
-        }
+        firstOption = i;
     } else {
-        panic("-convolve needs either zero, one, two, or at least four arguments\n");
+        filter = stack(1);
     }
 
-    Multiply::Mode m = Multiply::Outer;
     BoundaryCondition b = Homogeneous;
+    Multiply::Mode m = Multiply::Outer;
+    if (stack(0).channels == filter.channels) {
+        m = Multiply::Elementwise;
+    }
+    Method method = Separable;
+    float tolerance = 0;
 
-    if (boundaryCondition == "zero") { b = Zero; }
-    else if (boundaryCondition == "homogeneous") { b = Homogeneous; }
-    else if (boundaryCondition == "clamp") { b = Clamp; }
-    else if (boundaryCondition == "wrap") { b = Wrap; }
-    else {
-        panic("Unknown boundary condition: %s\n", boundaryCondition.c_str());
+    for (size_t i = firstOption; i < args.size(); i++) {
+        if (args[i] == "zero") { b = Zero; }
+        else if (args[i] == "homogeneous") { b = Homogeneous; }
+        else if (args[i] == "clamp") { b = Clamp; }
+        else if (args[i] == "wrap") { b = Wrap; }
+        else if (args[i] == "inner") { m = Multiply::Inner; }
+        else if (args[i] == "outer") { m = Multiply::Outer; }
+        else if (args[i] == "elementwise") { m = Multiply::Elementwise; }
+        else if (args[i] == "separable") { method = Separable; }
+        else if (args[i] == "direct") { method = Direct; }
+        else if (args[i] == "fft") { method = FFT; }
+        else if (args[i] == "auto") { method = Auto; }
+        else { tolerance = readFloat(args[i]); }
     }
 
-    if (channelMode == "inner") { m = Multiply::Inner; }
-    else if (channelMode == "outer") { m = Multiply::Outer; }
-    else if (channelMode == "elementwise") { m = Multiply::Elementwise; }
-    else {
-        panic("Unknown vector-vector multiplication: %s\n", channelMode.c_str());
+    if (method == Auto) {
+        double estimates[3];
+        method = choose(stack(0), filter, b, m, tolerance, estimates);
+        const char *names[] = {"separable", "direct", "fft"};
+        printf("Using %s convolution. Predicted times: separable %.3g s, direct %.3g s",
+               names[method], estimates[Separable], estimates[Direct]);
+        if (estimates[FFT] < HUGE_VAL) {
+            printf(", fft %.3g s\n", estimates[FFT]);
+        } else {
+            printf(", fft unavailable\n");
+        }
     }
 
-    Image im = apply(stack(0), filter, b, m);
+    Image im;
+    if (method == FFT) {
+        im = apply(stack(0), filter, b, m, tolerance, method);
+    } else {
+        vector<Decomposition> terms = decompose(filter, b, tolerance, method);
+        if (method == Separable) {
+            for (int c = 0; c < filter.channels; c++) {
+                const Decomposition &d = terms[c];
+                int taps = filter.width * filter.height * filter.frames;
+                if (d.x.size()) {
+                    int separated = (int)d.x.size() * (filter.width + filter.height * filter.frames);
+                    printf("Filter channel %d: %d separable term%s, %d taps instead of %d, relative error %g\n",
+                           c, (int)d.x.size(), d.x.size() == 1 ? "" : "s", separated, taps, d.error);
+                } else {
+                    printf("Filter channel %d: applied directly, %d taps\n", c, taps);
+                }
+            }
+        }
+        im = applyDecomposed(stack(0), filter, b, m, terms);
+    }
     pop();
     push(im);
 
 }
 
 // For a single channel, out += in * filter
+//
+// Each output scanline is the sum over the rows of the filter of a 1D
+// convolution of the corresponding input scanline. Boundary
+// conditions in y and t just pick which input scanlines are used. In
+// x, the interior of the scanline, where the filter lies entirely
+// within the image, is computed a vector at a time with no boundary
+// checks. Only the few pixels within the filter radius of either end
+// of the scanline are handled per boundary condition.
 void Convolve::convolveSingle(Image in, Image filter, Image out,
                               BoundaryCondition b) {
     assert(in.channels == 1 && filter.channels == 1 && out.channels == 1,
@@ -144,108 +251,354 @@ void Convolve::convolveSingle(Image in, Image filter, Image out,
     int filterSize = filter.frames * filter.width * filter.height;
     assert(filterSize % 2 == 1, "filter must have odd size (%d %d %d)\n", filter.width, filter.height, filter.frames);
 
-    int xoff = (filter.width - 1)/2;
-    int yoff = (filter.height - 1)/2;
-    int toff = (filter.frames - 1)/2;
-
-    if (b == Zero) {
-        for (int t = 0; t < in.frames; t++) {
-            for (int y = 0; y < in.height; y++) {
-                for (int x = 0; x < in.width; x++) {
-                    float v = 0;
-                    for (int dt = -toff; dt <= toff; dt++) {
-                        if (t + dt < 0) continue;
-                        if (t + dt >= in.frames) break;
-                        for (int dy = -yoff; dy <= yoff; dy++) {
-                            if (y + dy < 0) continue;
-                            if (y + dy >= in.height) break;
-                            for (int dx = -xoff; dx <= xoff; dx++) {
-                                if (x + dx < 0) continue;
-                                if (x + dx >= in.width) break;
-                                float w = filter(xoff-dx, yoff-dy, toff-dt, 0);
-                                v += in(x+dx, y+dy, t+dt, 0) * w;
-                            }
-                        }
-                    }
-                    out(x, y, t, 0) += v;
+    assert(b == Zero || b == Homogeneous || b == Clamp || b == Wrap,
+           "Unknown boundary condition");
+
+    const int xoff = (filter.width - 1)/2;
+    const int yoff = (filter.height - 1)/2;
+    const int toff = (filter.frames - 1)/2;
+
+    // The filter taps, flipped, one row of the filter after another,
+    // and the sum of each row
+    const int taps = filter.width;
+    const int filterRows = filter.height * filter.frames;
+    vector<float> flipped(taps * filterRows);
+    vector<float> rowSums(filterRows, 0);
+    for (int dt = -toff; dt <= toff; dt++) {
+        for (int dy = -yoff; dy <= yoff; dy++) {
+            int r = (dt + toff) * filter.height + dy + yoff;
+            for (int i = 0; i < taps; i++) {
+                float w = filter(taps - 1 - i, yoff-dy, toff-dt, 0);
+                flipped[r * taps + i] = w;
+                rowSums[r] += w;
+            }
+        }
+    }
+
+    float filterSum = 0;
+    if (b == Homogeneous) {
+        filterSum = Stats(filter).sum();
+    }
+
+    // Scanlines need to be dense
+    in = in.toLayout(Image::PLANAR);
+
+    const int width = in.width, height = in.height, frames = in.frames;
+
+    // The output pixels whose inputs are all within the scanline
+    const int minX = std::min(xoff, width);
+    const int maxX = std::max(width - xoff, minX);
+
+    // Working space for each thread
+    struct Scratch {
+        vector<float> sum, weight;
+        vector<const float *> rows, rowTaps;
+        vector<float> rowWeights;
+    };
+    int threads = 1;
+    #ifdef _OPENMP
+    threads = omp_get_max_threads();
+    #endif
+    vector<Scratch> scratch(threads);
+
+    forEachScanline(0, height, 0, frames, 0, 1, width, [&](int y, int t, int) {
+        int thread = 0;
+        #ifdef _OPENMP
+        thread = omp_get_thread_num();
+        #endif
+        Scratch &s = scratch[thread];
+        s.sum.resize(width);
+        s.rows.clear();
+        s.rowTaps.clear();
+        s.rowWeights.clear();
+
+        // Find the input scanline for each filter row. With zero or
+        // homogeneous boundaries, rows outside the image are skipped.
+        for (int dt = -toff; dt <= toff; dt++) {
+            int tc = t + dt;
+            if (b == Clamp) {
+                tc = clamp(tc, 0, frames-1);
+            } else if (b == Wrap) {
+                tc = ((tc % frames) + frames) % frames;
+            } else if (tc < 0 || tc >= frames) {
+                continue;
+            }
+            for (int dy = -yoff; dy <= yoff; dy++) {
+                int yc = y + dy;
+                if (b == Clamp) {
+                    yc = clamp(yc, 0, height-1);
+                } else if (b == Wrap) {
+                    yc = ((yc % height) + height) % height;
+                } else if (yc < 0 || yc >= height) {
+                    continue;
                 }
+                int r = (dt + toff) * filter.height + dy + yoff;
+                s.rows.push_back(&in(0, yc, tc, 0));
+                s.rowTaps.push_back(&flipped[r * taps]);
+                s.rowWeights.push_back(rowSums[r]);
             }
         }
-    } else if (b == Homogeneous) {
-        float filterSum = Stats(filter).sum();
-        for (int t = 0; t < in.frames; t++) {
-            for (int y = 0; y < in.height; y++) {
-                for (int x = 0; x < in.width; x++) {
-                    float weightSum = 0;
-                    float v = 0;
-                    for (int dt = -toff; dt <= toff; dt++) {
-                        if (t + dt < 0) continue;
-                        if (t + dt >= in.frames) break;
-                        for (int dy = -yoff; dy <= yoff; dy++) {
-                            if (y + dy < 0) continue;
-                            if (y + dy >= in.height) break;
-                            for (int dx = -xoff; dx <= xoff; dx++) {
-                                if (x + dx < 0) continue;
-                                if (x + dx >= in.width) break;
-                                float w = filter(xoff-dx, yoff-dy, toff-dt, 0);
-                                v += in(x+dx, y+dy, t+dt, 0) * w;
-                                weightSum += w;
-                            }
-                        }
+        const int rows = (int)s.rows.size();
+        float *const sum = &s.sum[0];
+
+        // The interior, four vectors at a time, then one at a time
+        {
+            int x = minX;
+            for (; x + Vec::width*4 <= maxX; x += Vec::width*4) {
+                Vec::type a0 = Vec::zero(), a1 = Vec::zero(), a2 = Vec::zero(), a3 = Vec::zero();
+                for (int r = 0; r < rows; r++) {
+                    const float *src = s.rows[r] + x - xoff;
+                    const float *w = s.rowTaps[r];
+                    for (int i = 0; i < taps; i++) {
+                        const Vec::type wi = Vec::broadcast(w[i]);
+                        a0 = Vec::mulAdd(wi, Vec::load(src + i), a0);
+                        a1 = Vec::mulAdd(wi, Vec::load(src + i + Vec::width), a1);
+                        a2 = Vec::mulAdd(wi, Vec::load(src + i + Vec::width*2), a2);
+                        a3 = Vec::mulAdd(wi, Vec::load(src + i + Vec::width*3), a3);
                     }
-                    if (filterSum != weightSum) {
-                        v *= filterSum / weightSum;
+                }
+                Vec::store(a0, sum + x);
+                Vec::store(a1, sum + x + Vec::width);
+                Vec::store(a2, sum + x + Vec::width*2);
+                Vec::store(a3, sum + x + Vec::width*3);
+            }
+            for (; x + Vec::width <= maxX; x += Vec::width) {
+                Vec::type a = Vec::zero();
+                for (int r = 0; r < rows; r++) {
+                    const float *src = s.rows[r] + x - xoff;
+                    const float *w = s.rowTaps[r];
+                    for (int i = 0; i < taps; i++) {
+                        a = Vec::mulAdd(Vec::broadcast(w[i]), Vec::load(src + i), a);
                     }
-                    out(x, y, t, 0) += v;
                 }
+                Vec::store(a, sum + x);
+            }
+            for (; x < maxX; x++) {
+                float v = 0;
+                for (int r = 0; r < rows; r++) {
+                    const float *src = s.rows[r] + x - xoff;
+                    const float *w = s.rowTaps[r];
+                    for (int i = 0; i < taps; i++) {
+                        v += w[i] * src[i];
+                    }
+                }
+                sum[x] = v;
             }
         }
-    } else if (b == Clamp) {
-        for (int t = 0; t < in.frames; t++) {
-            for (int y = 0; y < in.height; y++) {
-                for (int x = 0; x < in.width; x++) {
-                    float v = 0;
-                    for (int dt = -toff; dt <= toff; dt++) {
-                        int tc = clamp(t+dt, 0, in.frames-1);
-                        for (int dy = -yoff; dy <= yoff; dy++) {
-                            int yc = clamp(y+dy, 0, in.height-1);
-                            for (int dx = -xoff; dx <= xoff; dx++) {
-                                int xc = clamp(x+dx, 0, in.width-1);
-                                float w = filter(xoff-dx, yoff-dy, toff-dt, 0);
-                                v += in(xc, yc, tc, 0) * w;
-                            }
-                        }
+
+        // The border, a pixel at a time
+        if (b == Homogeneous) s.weight.resize(width);
+        for (int x = 0; x < width; x++) {
+            if (x == minX) x = maxX;
+            if (x == width) break;
+            float v = 0, weight = 0;
+            for (int r = 0; r < rows; r++) {
+                const float *src = s.rows[r];
+                const float *w = s.rowTaps[r];
+                for (int i = 0; i < taps; i++) {
+                    int xc = x + i - xoff;
+                    if (b == Clamp) {
+                        xc = clamp(xc, 0, width-1);
+                    } else if (b == Wrap) {
+                        xc = ((xc % width) + width) % width;
+                    } else if (xc < 0 || xc >= width) {
+                        continue;
                     }
-                    out(x, y, t, 0) += v;
+                    v += w[i] * src[xc];
+                    weight += w[i];
                 }
             }
+            sum[x] = v;
+            if (b == Homogeneous) s.weight[x] = weight;
+        }
+
+        if (b == Homogeneous) {
+            // Reweight by the fraction of the filter that lay within
+            // the image
+            float interiorWeight = 0;
+            for (int r = 0; r < rows; r++) interiorWeight += s.rowWeights[r];
+            for (int x = 0; x < width; x++) {
+                float weight = (x >= minX && x < maxX) ? interiorWeight : s.weight[x];
+                if (filterSum != weight) {
+                    sum[x] *= filterSum / weight;
+                }
+            }
+        }
+
+        for (int x = 0; x < width; x++) {
+            out(x, y, t, 0) += sum[x];
         }
-    } else if (b == Wrap) {
-        for (int t = 0; t < in.frames; t++) {
-            for (int y = 0; y < in.height; y++) {
-                for (int x = 0; x < in.width; x++) {
-                    float v = 0;
-                    for (int dt = -toff; dt <= toff; dt++) {
-                        int tc = (t+dt+toff*in.frames)%in.frames;
-                        for (int dy = -yoff; dy <= yoff; dy++) {
-                            int yc = (y+dy+yoff*in.height)%in.height;
-                            for (int dx = -xoff; dx <= xoff; dx++) {
-                                int xc = (x+dx+xoff*in.width)%in.width;
-                                float w = filter(xoff-dx, yoff-dy, toff-dt, 0);
-                                v += in(xc, yc, tc, 0) * w;
-                            }
-                        }
+    });
+}
+
+bool Convolve::separate(Image filter, BoundaryCondition b, float tolerance, Decomposition &d) {
+    assert(filter.channels == 1, "Can only separate single-channel filters\n");
+
+    // View the filter as a matrix with a column per x, and a row per
+    // y and t, and take its singular value decomposition using
+    // one-sided Jacobi rotations: rotate pairs of columns until they
+    // are all orthogonal. The columns are then the left singular
+    // vectors scaled by the singular values, and the accumulated
+    // rotations are the right singular vectors.
+    const int rows = filter.height * filter.frames, cols = filter.width;
+    vector<vector<double> > a(cols, vector<double>(rows));
+    vector<vector<double> > v(cols, vector<double>(cols, 0));
+    for (int x = 0; x < cols; x++) {
+        for (int t = 0; t < filter.frames; t++) {
+            for (int y = 0; y < filter.height; y++) {
+                a[x][t * filter.height + y] = filter(x, y, t, 0);
+            }
+        }
+        v[x][x] = 1;
+    }
+
+    for (int sweep = 0; sweep < 50; sweep++) {
+        bool rotated = false;
+        for (int i = 0; i < cols; i++) {
+            for (int j = i+1; j < cols; j++) {
+                double alpha = 0, beta = 0, gamma = 0;
+                for (int r = 0; r < rows; r++) {
+                    alpha += a[i][r] * a[i][r];
+                    beta += a[j][r] * a[j][r];
+                    gamma += a[i][r] * a[j][r];
+                }
+                if (gamma == 0 || fabs(gamma) <= 1e-15 * ::sqrt(alpha * beta)) continue;
+                rotated = true;
+                double zeta = (beta - alpha) / (2 * gamma);
+                double tangent = (zeta >= 0 ? 1 : -1) / (fabs(zeta) + ::sqrt(1 + zeta * zeta));
+                double cosine = 1 / ::sqrt(1 + tangent * tangent), sine = cosine * tangent;
+                for (int r = 0; r < rows; r++) {
+                    double ai = a[i][r], aj = a[j][r];
+                    a[i][r] = cosine * ai - sine * aj;
+                    a[j][r] = sine * ai + cosine * aj;
+                }
+                for (int r = 0; r < cols; r++) {
+                    double vi = v[r][i], vj = v[r][j];
+                    v[r][i] = cosine * vi - sine * vj;
+                    v[r][j] = sine * vi + cosine * vj;
+                }
+            }
+        }
+        if (!rotated) break;
+    }
+
+    // Order the terms by decreasing singular value
+    vector<pair<double, int> > order(cols);
+    double total = 0;
+    for (int i = 0; i < cols; i++) {
+        double norm = 0;
+        for (int r = 0; r < rows; r++) norm += a[i][r] * a[i][r];
+        order[i] = make_pair(-norm, i);
+        total += norm;
+    }
+    if (total == 0) return false;
+    std::sort(order.begin(), order.end());
+
+    // Take terms until the residual is small enough
+    tolerance = std::max(tolerance, 1e-6f);
+    double residual = total;
+    int terms = 0;
+    while (terms < cols && (terms == 0 || ::sqrt(std::max(residual, 0.0) / total) > tolerance)) {
+        residual += order[terms].first;
+        terms++;
+    }
+
+    // Each term is two passes over the image with a temporary in
+    // between, which makes a separable tap about twice as expensive
+    // as a tap of a direct convolution
+    if (2 * terms * (cols + rows) >= cols * rows) return false;
+
+    d.x.clear();
+    d.yt.clear();
+    d.error = (float)::sqrt(std::max(residual, 0.0) / total);
+    for (int k = 0; k < terms; k++) {
+        int i = order[k].second;
+        Image x(cols, 1, 1, 1), yt(1, filter.height, filter.frames, 1);
+        for (int c = 0; c < cols; c++) {
+            x(c, 0, 0, 0) = (float)v[c][i];
+        }
+        for (int t = 0; t < filter.frames; t++) {
+            for (int y = 0; y < filter.height; y++) {
+                yt(0, y, t, 0) = (float)a[i][t * filter.height + y];
+            }
+        }
+        d.x.push_back(x);
+        d.yt.push_back(yt);
+    }
+
+    // Zero, clamp, and wrap boundaries treat each dimension
+    // independently, so any separable filter can be applied one
+    // dimension at a time. Homogeneous boundaries reweight by the
+    // part of the filter within the image. That weight only
+    // factors for a single term whose parts don't sum to zero.
+    if (b == Homogeneous) {
+        bool factors = d.x.size() == 1;
+        Image parts[] = {d.x[0], d.yt[0]};
+        for (int i = 0; factors && i < 2; i++) {
+            double sum = 0, absSum = 0;
+            for (int t = 0; t < parts[i].frames; t++) {
+                for (int y = 0; y < parts[i].height; y++) {
+                    for (int x = 0; x < parts[i].width; x++) {
+                        sum += parts[i](x, y, t, 0);
+                        absSum += fabs(parts[i](x, y, t, 0));
                     }
-                    out(x, y, t, 0) += v;
                 }
             }
+            factors = fabs(sum) > 1e-4 * absSum;
         }
-    } else {
-        panic("Unknown boundary condition");
+        if (!factors) return false;
     }
+
+    return true;
 }
 
-Image Convolve::apply(Image im, Image filter, BoundaryCondition b, Multiply::Mode m) {
+// For a single channel, out += in * filter, using the separable
+// decomposition of the filter if it has any terms
+void Convolve::convolveChannel(Image in, Image filter, Image out,
+                               BoundaryCondition b, const Decomposition &d) {
+    if (d.x.empty()) {
+        convolveSingle(in, filter, out, b);
+        return;
+    }
+
+    Image tmp(in.width, in.height, in.frames, 1);
+    for (size_t i = 0; i < d.x.size(); i++) {
+        if (i > 0) tmp.set(0);
+        convolveSingle(in, d.x[i], tmp, b);
+        convolveSingle(tmp, d.yt[i], out, b);
+    }
+}
+
+Image Convolve::apply(Image im, Image filter, BoundaryCondition b,
+                      Multiply::Mode m, float tolerance, Method method) {
+    if (method == Auto) {
+        method = choose(im, filter, b, m, tolerance);
+    }
+
+    if (method == FFT) {
+        #ifndef NO_FFTW
+        return FFTConvolve::apply(im, filter, b, m);
+        #else
+        panic("FFT convolution requires FFTW\n");
+        #endif
+    }
+
+    return applyDecomposed(im, filter, b, m, decompose(filter, b, tolerance, method));
+}
+
+vector<Convolve::Decomposition> Convolve::decompose(Image filter, BoundaryCondition b,
+                                                    float tolerance, Method method) {
+    vector<Decomposition> terms(filter.channels);
+    for (int c = 0; c < filter.channels && method != Direct; c++) {
+        if (!separate(filter.channel(c), b, tolerance, terms[c])) {
+            terms[c] = Decomposition();
+        }
+    }
+    return terms;
+}
+
+Image Convolve::applyDecomposed(Image im, Image filter, BoundaryCondition b,
+                                Multiply::Mode m, const vector<Decomposition> &terms) {
     Image out;
     if (m == Multiply::Inner) {
         assert(filter.channels % im.channels == 0 ||
@@ -256,25 +609,25 @@ Image Convolve::apply(Image im, Image filter, BoundaryCondition b, Multiply::Mod
         if (im.channels < filter.channels) {
             out = Image(im.width, im.height, im.frames, filter.channels/im.channels);
             for (int i = 0; i < filter.channels; i++) {
-                convolveSingle(im.channel(i % im.channels),
-                               filter.channel(i),
-                               out.channel(i / im.channels), b);
+                convolveChannel(im.channel(i % im.channels),
+                                filter.channel(i),
+                                out.channel(i / im.channels), b, terms[i]);
             }
         } else {
             out = Image(im.width, im.height, im.frames, im.channels/filter.channels);
             for (int i = 0; i < im.channels; i++) {
-                convolveSingle(im.channel(i),
-                               filter.channel(i % filter.channels),
-                               out.channel(i / filter.channels), b);
+                convolveChannel(im.channel(i),
+                                filter.channel(i % filter.channels),
+                                out.channel(i / filter.channels), b, terms[i % filter.channels]);
             }
         }
     } else if (m == Multiply::Outer) {
         out = Image(im.width, im.height, im.frames, im.channels * filter.channels);
         for (int i = 0; i < im.channels; i++) {
             for (int j = 0; j < filter.channels; j++) {
-                convolveSingle(im.channel(i),
-                               filter.channel(j),
-                               out.channel(i*filter.channels + j), b);
+                convolveChannel(im.channel(i),
+                                filter.channel(j),
+                                out.channel(i*filter.channels + j), b, terms[j]);
             }
         }
     } else if (m == Multiply::Elementwise) {
@@ -283,7 +636,7 @@ Image Convolve::apply(Image im, Image filter, BoundaryCondition b, Multiply::Mod
                "and filter must have the same number of channels.");
         out = Image(im.width, im.height, im.frames, im.channels);
         for (int i = 0; i < im.channels; i++) {
-            convolveSingle(im.channel(i), filter.channel(i), out.channel(i), b);
+            convolveChannel(im.channel(i), filter.channel(i), out.channel(i), b, terms[i]);
         }
 
     } else {
@@ -292,5 +645,155 @@ Image Convolve::apply(Image im, Image filter, BoundaryCondition b, Multiply::Mod
     return out;
 }
 
+// The best of a few runs of f, in seconds
+template<typename F>
+static double bestTime(F f) {
+    double best = HUGE_VAL;
+    for (int i = 0; i < 3; i++) {
+        double t1 = currentTime();
+        f();
+        best = std::min(best, currentTime() - t1);
+    }
+    return best;
+}
+
+const Convolve::Costs &Convolve::costs() {
+    static Costs c;
+    static bool known = false;
+    if (known) return c;
+
+    // The costs depend on the vector width and number of threads of
+    // this build, so those are saved with them
+    int threads = 1;
+    #ifdef _OPENMP
+    threads = omp_get_max_threads();
+    #endif
+    int fft = 0;
+    #ifndef NO_FFTW
+    fft = 1;
+    #endif
+
+    string filename;
+    if (const char *env = getenv("IMAGESTACK_CONVOLVE_COSTS")) {
+        filename = env;
+    } else if (const char *home = getenv("HOME")) {
+        filename = string(home) + "/.imagestack_convolve_costs";
+    }
+
+    if (filename.size()) {
+        if (FILE *f = fopen(filename.c_str(), "r")) {
+            int fileWidth = 0, fileThreads = 0, fileFFT = 0;
+            int matched = fscanf(f, "vector width %d threads %d fftw %d direct %lf separable %lf fftblocks %lf",
+                                 &fileWidth, &fileThreads, &fileFFT,
+                                 &c.direct, &c.separable, &c.fft);
+            fclose(f);
+            if (matched == 6 && fileWidth == Vec::width &&
+                fileThreads == threads && fileFFT == fft) {
+                known = true;
+                return c;
+            }
+        }
+    }
+
+    printf("Measuring the speed of convolution on this machine...\n");
+
+    Image im(512, 512, 1, 1);
+    Noise::apply(im, 0, 1);
+    const double pixels = (double)im.width * im.height;
+
+    Image square(9, 9, 1, 1);
+    Noise::apply(square, 0, 1);
+    c.direct = bestTime([&]() {
+        apply(im, square, Zero, Multiply::Outer, 0, Direct);
+    }) / (pixels * 81);
+
+    // A rank one filter, so that it takes one horizontal and one
+    // vertical pass
+    Image parts(31, 2, 1, 1), rankOne(31, 31, 1, 1);
+    Noise::apply(parts, 0.5, 1);
+    for (int y = 0; y < 31; y++) {
+        for (int x = 0; x < 31; x++) {
+            rankOne(x, y) = parts(x, 0) * parts(y, 1);
+        }
+    }
+    c.separable = bestTime([&]() {
+        apply(im, rankOne, Zero, Multiply::Outer, 0, Separable);
+    }) / (pixels * 62);
+
+    c.fft = 0;
+    #ifndef NO_FFTW
+    int size[3];
+    c.fft = bestTime([&]() {
+        FFTConvolve::apply(im, square, Wrap, Multiply::Outer);
+    }) / FFTConvolve::blockSize(im.width, im.height, im.frames,
+                                square.width, square.height, square.frames,
+                                Wrap, size);
+    #endif
+
+    known = true;
+
+    if (filename.size()) {
+        if (FILE *f = fopen(filename.c_str(), "w")) {
+            fprintf(f, "vector width %d\nthreads %d\nfftw %d\n"
+                    "direct %g\nseparable %g\nfftblocks %g\n",
+                    Vec::width, threads, fft, c.direct, c.separable, c.fft);
+            fclose(f);
+        }
+    }
+
+    return c;
+}
+
+Convolve::Method Convolve::choose(Image im, Image filter, BoundaryCondition b,
+                                  Multiply::Mode m, float tolerance,
+                                  double *estimates) {
+    const Costs &c = costs();
+
+    // How many times each filter channel is used
+    vector<int> uses(filter.channels, 1);
+    if (m == Multiply::Outer) {
+        uses.assign(filter.channels, im.channels);
+    } else if (m == Multiply::Inner && im.channels > filter.channels) {
+        uses.assign(filter.channels, im.channels / filter.channels);
+    }
+
+    const double pixels = (double)im.width * im.height * im.frames;
+    const int taps = filter.width * filter.height * filter.frames;
+    double direct = 0, separable = 0;
+    int pairs = 0;
+    for (int i = 0; i < filter.channels; i++) {
+        double d = uses[i] * pixels * taps * c.direct;
+        direct += d;
+        Decomposition dec;
+        if (separate(filter.channel(i), b, tolerance, dec)) {
+            int separatedTaps = (int)dec.x.size() * (filter.width + filter.height * filter.frames);
+            separable += uses[i] * pixels * separatedTaps * c.separable;
+        } else {
+            separable += d;
+        }
+        pairs += uses[i];
+    }
+
+    double fft = HUGE_VAL;
+    #ifndef NO_FFTW
+    {
+        int size[3];
+        fft = pairs * c.fft * FFTConvolve::blockSize(im.width, im.height, im.frames,
+                                                     filter.width, filter.height, filter.frames,
+                                                     b, size);
+    }
+    #endif
+
+    if (estimates) {
+        estimates[Separable] = separable;
+        estimates[Direct] = direct;
+        estimates[FFT] = fft;
+    }
+
+    if (fft < separable && fft < direct) return FFT;
+    if (direct <= separable) return Direct;
+    return Separable;
+}
+
 #include "footer.h"
 
@@ -13,10 +13,69 @@ public:
 
     enum BoundaryCondition {Zero = 0, Homogeneous, Clamp, Wrap};
 
+    // How to compute a convolution. Separable applies each filter
+    // channel that has a cheaper separable decomposition (see
+    // separate) as a sequence of 1D passes, and the rest directly.
+    // Direct never separates. FFT uses FFTConvolve, and so requires
+    // FFTW. Auto picks whichever of the three the cost model predicts
+    // to be fastest.
+    enum Method {Separable = 0, Direct, FFT, Auto};
+
+    // Filters that are separable, or within the given relative error
+    // of a sum of a few separable filters, are applied as a sequence
+    // of 1D passes. With a tolerance of zero, only filters that are
+    // separable to within rounding error are.
     static Image apply(Image im, Image filter, BoundaryCondition b = Zero,
-                       Multiply::Mode m = Multiply::Outer);
+                       Multiply::Mode m = Multiply::Outer, float tolerance = 0,
+                       Method method = Separable);
+
+    // The cost model used by Auto: the time in seconds per pixel per
+    // tap of direct convolution and of separable passes, and per unit
+    // of work of an FFT convolution as counted by
+    // FFTConvolve::blockSize. It is measured
+    // the first time it's needed and saved to the file named by the
+    // environment variable IMAGESTACK_CONVOLVE_COSTS, or
+    // ~/.imagestack_convolve_costs, so that it is only measured once
+    // per machine.
+    struct Costs {
+        double direct, separable, fft;
+    };
+    static const Costs &costs();
+
+    // Predict how long each of Direct, Separable, and FFT would take,
+    // and return the fastest. The predictions are written to
+    // estimates, if given, in that order.
+    static Method choose(Image im, Image filter, BoundaryCondition b,
+                         Multiply::Mode m, float tolerance,
+                         double *estimates = NULL);
+
+    // A single-channel filter approximated as a sum of separable
+    // terms. Term i is a convolution by x[i], which has a height and
+    // number of frames of one, followed by a convolution by yt[i],
+    // which has a width of one. The error is the Frobenius norm of
+    // the difference from the filter, relative to that of the filter.
+    struct Decomposition {
+        vector<Image> x, yt;
+        float error;
+    };
+
+    // Find the decomposition with the fewest terms whose error is at
+    // most the tolerance. Returns false if it wouldn't be faster than
+    // applying the filter directly, or if it can't be applied one
+    // dimension at a time with the given boundary condition.
+    static bool separate(Image filter, BoundaryCondition b, float tolerance,
+                         Decomposition &d);
+
 private:
+    // The decomposition of each channel of the filter, with no terms
+    // for channels that are to be applied directly
+    static vector<Decomposition> decompose(Image filter, BoundaryCondition b,
+                                           float tolerance, Method method);
+    static Image applyDecomposed(Image im, Image filter, BoundaryCondition b,
+                                 Multiply::Mode m, const vector<Decomposition> &terms);
     static void convolveSingle(Image im, Image filter, Image out, BoundaryCondition b);
+    static void convolveChannel(Image im, Image filter, Image out,
+                                BoundaryCondition b, const Decomposition &d);
 };
 
 #include "footer.h"
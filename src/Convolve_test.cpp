@@ -0,0 +1,156 @@
+#include "ImageStack.h"
+
+using namespace ImageStack;
+
+// Checks Convolve against a direct per-pixel implementation for every
+// boundary condition, then benchmarks it against the scalar loop it
+// replaced for horizontal, vertical, and square kernels of 3 to 63
+// taps. Prints the time in milliseconds for each.
+//
+// Usage: Convolve_test [width height]
+
+// The convolution as it was before, with one set of bounds checks per
+// tap. Only the zero boundary condition is used for timing.
+void convolveOld(Image in, Image filter, Image out) {
+    int xoff = (filter.width - 1)/2;
+    int yoff = (filter.height - 1)/2;
+    int toff = (filter.frames - 1)/2;
+    for (int t = 0; t < in.frames; t++) {
+        for (int y = 0; y < in.height; y++) {
+            for (int x = 0; x < in.width; x++) {
+                float v = 0;
+                for (int dt = -toff; dt <= toff; dt++) {
+                    if (t + dt < 0) continue;
+                    if (t + dt >= in.frames) break;
+                    for (int dy = -yoff; dy <= yoff; dy++) {
+                        if (y + dy < 0) continue;
+                        if (y + dy >= in.height) break;
+                        for (int dx = -xoff; dx <= xoff; dx++) {
+                            if (x + dx < 0) continue;
+                            if (x + dx >= in.width) break;
+                            float w = filter(xoff-dx, yoff-dy, toff-dt, 0);
+                            v += in(x+dx, y+dy, t+dt, 0) * w;
+                        }
+                    }
+                }
+                out(x, y, t, 0) += v;
+            }
+        }
+    }
+}
+
+// A direct implementation of every boundary condition
+float reference(Image in, Image filter, int x, int y, int t,
+                Convolve::BoundaryCondition b) {
+    int xoff = (filter.width - 1)/2;
+    int yoff = (filter.height - 1)/2;
+    int toff = (filter.frames - 1)/2;
+    double v = 0, weight = 0, total = 0;
+    for (int dt = -toff; dt <= toff; dt++) {
+        for (int dy = -yoff; dy <= yoff; dy++) {
+            for (int dx = -xoff; dx <= xoff; dx++) {
+                float w = filter(xoff-dx, yoff-dy, toff-dt, 0);
+                total += w;
+                int xc = x + dx, yc = y + dy, tc = t + dt;
+                if (b == Convolve::Clamp) {
+                    xc = clamp(xc, 0, in.width-1);
+                    yc = clamp(yc, 0, in.height-1);
+                    tc = clamp(tc, 0, in.frames-1);
+                } else if (b == Convolve::Wrap) {
+                    xc = ((xc % in.width) + in.width) % in.width;
+                    yc = ((yc % in.height) + in.height) % in.height;
+                    tc = ((tc % in.frames) + in.frames) % in.frames;
+                } else if (xc < 0 || xc >= in.width ||
+                           yc < 0 || yc >= in.height ||
+                           tc < 0 || tc >= in.frames) {
+                    continue;
+                }
+                v += in(xc, yc, tc, 0) * w;
+                weight += w;
+            }
+        }
+    }
+    if (b == Convolve::Homogeneous) v *= total / weight;
+    return v;
+}
+
+bool check(Image in, Image filter, Convolve::BoundaryCondition b) {
+    Image out = Convolve::apply(in, filter, b);
+    double worst = 0;
+    for (int c = 0; c < in.channels; c++) {
+        for (int t = 0; t < in.frames; t++) {
+            for (int y = 0; y < in.height; y++) {
+                for (int x = 0; x < in.width; x++) {
+                    double r = reference(in.channel(c), filter, x, y, t, b);
+                    worst = std::max(worst, fabs(r - out(x, y, t, c)));
+                }
+            }
+        }
+    }
+    if (worst > 1e-4) {
+        printf("Mismatch of %g for a %dx%dx%d filter on a %dx%dx%d image with boundary condition %d\n",
+               worst, filter.width, filter.height, filter.frames,
+               in.width, in.height, in.frames, (int)b);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    start();
+
+    int width = argc > 2 ? atoi(argv[1]) : 2048;
+    int height = argc > 2 ? atoi(argv[2]) : 2048;
+
+    try {
+        // Correctness, including images smaller than the filter and
+        // interleaved images
+        int sizes[][3] = {{3, 1, 1}, {1, 5, 1}, {7, 7, 1}, {3, 3, 3}, {21, 1, 1}, {65, 3, 1}};
+        for (int i = 0; i < 6; i++) {
+            Image filter(sizes[i][0], sizes[i][1], sizes[i][2], 1);
+            Noise::apply(filter, 0, 1);
+            Image in(53, 17, 4, 2, Image::INTERLEAVED);
+            Noise::apply(in, 0, 1);
+            for (int b = Convolve::Zero; b <= Convolve::Wrap; b++) {
+                if (!check(in, filter, (Convolve::BoundaryCondition)b)) return 1;
+            }
+        }
+        printf("Matches the reference for all boundary conditions\n\n");
+
+        Image in(width, height, 1, 1);
+        Noise::apply(in, 0, 1);
+        printf("%dx%d image, milliseconds\n", width, height);
+        printf("%8s %10s %10s %10s %10s %10s %10s\n", "taps",
+               "old 1xN", "new 1xN", "old Nx1", "new Nx1", "old NxN", "new NxN");
+        int taps[] = {3, 5, 7, 9, 15, 31, 63};
+        for (int i = 0; i < 7; i++) {
+            int n = taps[i];
+            Image filters[] = {Image(n, 1, 1, 1), Image(1, n, 1, 1), Image(n, n, 1, 1)};
+            printf("%8d", n);
+            for (int j = 0; j < 3; j++) {
+                Noise::apply(filters[j], 0, 1);
+                double tOld = -1;
+                // The old version takes minutes on the largest
+                // square kernels, so skip it there
+                if (j < 2 || n <= 15) {
+                    Image out(width, height, 1, 1);
+                    double t1 = currentTime();
+                    convolveOld(in, filters[j], out);
+                    tOld = currentTime() - t1;
+                }
+                double t1 = currentTime();
+                Convolve::apply(in, filters[j], Convolve::Zero);
+                double tNew = currentTime() - t1;
+                if (tOld < 0) printf(" %10s", "-");
+                else printf(" %10.1f", tOld * 1000);
+                printf(" %10.1f", tNew * 1000);
+            }
+            printf("\n");
+        }
+    } catch (Exception &e) {
+        printf("Failure: %s\n", e.message);
+        return 1;
+    }
+
+    return 0;
+}
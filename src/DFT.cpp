@@ -92,7 +92,7 @@ void DCT::apply(Image im, bool transformX, bool transformY, bool transformT) {
 
     // X
     {
-        fftwf_iodim d = {im.width, 1, 1};
+        fftwf_iodim d = {im.width, im.xstride, im.xstride};
         if (transformX) fft_dims.push_back(d);
         else loop_dims.push_back(d);
     }
@@ -226,7 +226,7 @@ void FFT::apply(Image im, bool transformX, bool transformY, bool transformT, boo
 
     // X
     {
-        fftwf_iodim d = {im.width, 1, 1};
+        fftwf_iodim d = {im.width, im.xstride, im.xstride};
         if (transformX) fft_dims.push_back(d);
         else loop_dims.push_back(d);
     }
@@ -326,7 +326,8 @@ void FFTConvolve::help() {
             " condition (zero, clamp, wrap, homogeneous) and the vector-vector"
             " multiplication used (inner, outer, elementwise). The defaults are wrap"
             " and outer respectively. See -convolve for a description of each"
-            " option.\n"
+            " option. The image is transformed in blocks, so the memory used"
+            " beyond the input and output is a few blocks per thread.\n"
             "\n"
             "Usage: ImageStack -load filter.tmp -load im.jpg -fftconvolve zero inner\n");
 }
@@ -349,6 +350,18 @@ bool FFTConvolve::test() {
         }
     }
 
+    // Check blocks smaller than the image, including ones that don't
+    // divide it evenly
+    const int sizes[][3] = {{5, 7, 3}, {7, 9, 5}, {12, 15, 4}, {16, 40, 10}};
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            Image a = Convolve::apply(im.channel(0), kernel.channel(0), b[i]);
+            Image fa(im.width, im.height, im.frames, 1);
+            convolveBlocks(im.channel(0), kernel.channel(0), fa, b[i], sizes[j]);
+            if (!nearlyEqual(a, fa)) return false;
+        }
+    }
+
     return true;
 }
 
@@ -428,92 +441,278 @@ Image FFTConvolve::apply(Image im, Image filter, Convolve::BoundaryCondition b,
     return out;
 }
 
-void FFTConvolve::convolveSingle(Image im, Image filter, Image out, Convolve::BoundaryCondition b) {
+// The sizes no smaller than lo whose only prime factors are 2, 3 and
+// 5, which FFTW transforms fastest, up to the first one no smaller
+// than hi
+static vector<int> fftSizes(int lo, int hi) {
+    vector<int> sizes;
+    const int64_t limit = 2 * (int64_t)std::max(lo, hi);
+    for (int64_t a = 1; a <= limit; a *= 2) {
+        for (int64_t b = a; b <= limit; b *= 3) {
+            for (int64_t c = b; c <= limit; c *= 5) {
+                if (c >= lo) sizes.push_back((int)c);
+            }
+        }
+    }
+    std::sort(sizes.begin(), sizes.end());
+    size_t last = 0;
+    while (sizes[last] < hi) last++;
+    sizes.resize(last + 1);
+    return sizes;
+}
 
-    // Deal with the homogeneous case recursively. This is slightly
-    // inefficient because we construct and transform the filter
-    // twice, but it makes the code much simpler
-    if (b == Convolve::Homogeneous) {
-        Image result = apply(im, filter, Convolve::Zero, Multiply::Outer);
-        Image weight(im.width, im.height, im.frames, 1);
-        weight.set(1.0f);
-        Image resultW = apply(weight, filter, Convolve::Zero, Multiply::Outer);
-        out += Stats(filter).sum() * result / resultW;
-        return;
+double FFTConvolve::blockSize(int width, int height, int frames,
+                              int filterWidth, int filterHeight, int filterFrames,
+                              Convolve::BoundaryCondition b, int size[3]) {
+    // Blocks larger than this are only used if the filter needs them
+    const double maxPixels = 1 << 20;
+
+    const int extent[3] = {width, height, frames};
+    const int taps[3] = {filterWidth, filterHeight, filterFrames};
+    vector<int> sizes[3];
+    for (int d = 0; d < 3; d++) {
+        sizes[d] = fftSizes(taps[d], extent[d] + taps[d] - 1);
     }
 
+    double best = HUGE_VAL;
+    for (size_t i = 0; i < sizes[0].size(); i++) {
+        for (size_t j = 0; j < sizes[1].size(); j++) {
+            for (size_t k = 0; k < sizes[2].size(); k++) {
+                const int s[3] = {sizes[0][i], sizes[1][j], sizes[2][k]};
+                const double pixels = (double)s[0] * s[1] * s[2];
+                if (pixels > maxPixels && (i || j || k)) continue;
+
+                double blocks = 1;
+                for (int d = 0; d < 3; d++) {
+                    const int produced = s[d] - taps[d] + 1;
+                    blocks *= (extent[d] + produced - 1) / produced;
+                }
+
+                // Each complex transform holds two blocks, one in the
+                // real part and one in the imaginary part, except with
+                // homogeneous boundaries where the imaginary part
+                // holds the weights.
+                double transforms = blocks;
+                if (b != Convolve::Homogeneous) transforms = ceil(blocks / 2);
+
+                // A forward and an inverse transform, the linear work
+                // of filling, multiplying, and writing out, and a
+                // fixed cost per block.
+                double work = transforms * (pixels * (2 * log2(pixels) + 8) + 4096);
+                if (work < best) {
+                    best = work;
+                    size[0] = s[0];
+                    size[1] = s[1];
+                    size[2] = s[2];
+                }
+            }
+        }
+    }
+    return best;
+}
+
+void FFTConvolve::convolveSingle(Image im, Image filter, Image out, Convolve::BoundaryCondition b) {
     assert(filter.width % 2 == 1 &&
            filter.height % 2 == 1 &&
            filter.frames % 2 == 1,
            "The filter must have odd dimensions\n");
 
-    int xPad = filter.width/2;
-    int yPad = filter.height/2;
-    int tPad = filter.frames/2;
+    int size[3];
+    blockSize(im.width, im.height, im.frames,
+              filter.width, filter.height, filter.frames, b, size);
+    convolveBlocks(im, filter, out, b, size);
+}
 
-    if (b == Convolve::Wrap) {
-        xPad = yPad = tPad = 0;
+void FFTConvolve::convolveBlocks(Image im, Image filter, Image out,
+                                 Convolve::BoundaryCondition b, const int size[3]) {
+    const int bw = size[0], bh = size[1], bf = size[2];
+    const int n = bw * bh * bf;
+    const int xr = filter.width/2, yr = filter.height/2, tr = filter.frames/2;
+
+    // Each block produces the output pixels whose footprint it covers
+    const int ow = bw - 2*xr, oh = bh - 2*yr, of = bf - 2*tr;
+    assert(ow > 0 && oh > 0 && of > 0, "Blocks must be larger than the filter\n");
+    const int bx = (im.width + ow - 1) / ow;
+    const int by = (im.height + oh - 1) / oh;
+    const int bt = (im.frames + of - 1) / of;
+    const int blocks = bx * by * bt;
+
+    const bool homogeneous = (b == Convolve::Homogeneous);
+    const float filterSum = homogeneous ? Stats(filter).sum() : 0;
+
+    // One in-place plan serves every block on every thread. As in
+    // FFT::apply, swapping the real and imaginary parts makes it an
+    // inverse transform.
+    float *filterRe = (float *)fftwf_malloc(n * sizeof(float));
+    float *filterIm = (float *)fftwf_malloc(n * sizeof(float));
+    vector<fftwf_iodim> dims;
+    if (bf > 1) {
+        fftwf_iodim d = {bf, bw*bh, bw*bh};
+        dims.push_back(d);
     }
-
-    Image weightT;
-
-    Image imT = Image(im.width+xPad*2, im.height+yPad*2, im.frames+tPad*2, 2);
-
-    //printf("1\n"); fflush(stdout);
-    // 1) Make the padded complex image
-    if (b == Convolve::Clamp) {
-        for (int t = 0; t < imT.frames; t++) {
-            int st = clamp(t-tPad, 0, im.frames-1);
-            for (int y = 0; y < imT.height; y++) {
-                int sy = clamp(y-yPad, 0, im.height-1);
-                for (int x = 0; x < imT.width; x++) {
-                    int sx = clamp(x-xPad, 0, im.width-1);
-                    imT(x, y, t, 0) = im(sx, sy, st, 0);
-                }
-            }
-        }
-    } else { // Zero or Wrap
-        imT.region(xPad, yPad, tPad, 0,
-                   im.width, im.height, im.frames, 1).set(im);
+    if (bh > 1) {
+        fftwf_iodim d = {bh, bw, bw};
+        dims.push_back(d);
     }
+    if (bw > 1) {
+        fftwf_iodim d = {bw, 1, 1};
+        dims.push_back(d);
+    }
+    fftwf_plan plan = fftwf_plan_guru_split_dft((int)dims.size(), dims.data(), 0, NULL,
+                                                filterRe, filterIm, filterRe, filterIm,
+                                                FFTW_ESTIMATE);
 
-    //printf("2\n"); fflush(stdout);
-    // 2) Transform the padded image
-    FFT::apply(imT);
-
-    //printf("3\n"); fflush(stdout);
-    // 3) Make a padded complex filter of the same size
-    Image filterT(imT.width, imT.height, imT.frames, 2);
+    // Transform the filter, centered on the origin, and scaled to
+    // undo the gain of the forward and inverse transforms
+    memset(filterRe, 0, n * sizeof(float));
+    memset(filterIm, 0, n * sizeof(float));
     for (int t = 0; t < filter.frames; t++) {
-        int ft = t - filter.frames/2;
-        if (ft < 0) ft += filterT.frames;
+        const int ft = (t - tr + bf) % bf;
         for (int y = 0; y < filter.height; y++) {
-            int fy = y - filter.height/2;
-            if (fy < 0) fy += filterT.height;
+            const int fy = (y - yr + bh) % bh;
             for (int x = 0; x < filter.width; x++) {
-                int fx = x - filter.width/2;
-                if (fx < 0) fx += filterT.width;
-                filterT(fx, fy, ft, 0) = filter(x, y, t, 0);
+                const int fx = (x - xr + bw) % bw;
+                filterRe[(ft * bh + fy) * bw + fx] = filter(x, y, t, 0) / n;
             }
         }
     }
+    fftwf_execute(plan);
 
-    //printf("4\n"); fflush(stdout);
-    // 4) Transform the padded filter
-    FFT::apply(filterT);
+    // Where to read each coordinate of a block from, or -1 for zero
+    auto source = [b](int c, int extent) {
+        if (b == Convolve::Clamp) return clamp(c, 0, extent-1);
+        if (b == Convolve::Wrap) return ((c % extent) + extent) % extent;
+        return (c < 0 || c >= extent) ? -1 : c;
+    };
+
+    // Copy the footprint of a block into dst, and mark which of its
+    // pixels are inside the image in weight, if given. cols is space
+    // for the source column of each of the bw pixels in a row.
+    auto fill = [&](int i, float *dst, float *weight, int *cols) {
+        const int x0 = (i % bx) * ow - xr;
+        const int y0 = ((i / bx) % by) * oh - yr;
+        const int t0 = (i / (bx * by)) * of - tr;
+        for (int x = 0; x < bw; x++) {
+            cols[x] = source(x0 + x, im.width);
+        }
+        for (int t = 0; t < bf; t++) {
+            const int st = source(t0 + t, im.frames);
+            for (int y = 0; y < bh; y++) {
+                const int sy = source(y0 + y, im.height);
+                float *d = dst + (t * bh + y) * bw;
+                float *w = weight ? weight + (t * bh + y) * bw : NULL;
+                if (st < 0 || sy < 0) {
+                    memset(d, 0, bw * sizeof(float));
+                    if (w) memset(w, 0, bw * sizeof(float));
+                    continue;
+                }
+                const float *row = &im(0, sy, st, 0);
+                for (int x = 0; x < bw; x++) {
+                    d[x] = cols[x] < 0 ? 0 : row[cols[x] * im.xstride];
+                }
+                if (w) {
+                    for (int x = 0; x < bw; x++) {
+                        w[x] = cols[x] < 0 ? 0 : 1;
+                    }
+                }
+            }
+        }
+    };
+
+    // Add the output pixels of a block to out, normalized by weight
+    // if given
+    auto write = [&](int i, const float *src, const float *weight) {
+        const int x0 = (i % bx) * ow;
+        const int y0 = ((i / bx) % by) * oh;
+        const int t0 = (i / (bx * by)) * of;
+        const int w = std::min(ow, im.width - x0);
+        const int h = std::min(oh, im.height - y0);
+        const int f = std::min(of, im.frames - t0);
+        for (int t = 0; t < f; t++) {
+            for (int y = 0; y < h; y++) {
+                const int offset = ((t + tr) * bh + y + yr) * bw + xr;
+                const float *s = src + offset;
+                float *o = &out(x0, y0 + y, t0 + t, 0);
+                if (weight) {
+                    const float *ws = weight + offset;
+                    for (int x = 0; x < w; x++) {
+                        o[x * out.xstride] += filterSum * s[x] / ws[x];
+                    }
+                } else {
+                    for (int x = 0; x < w; x++) {
+                        o[x * out.xstride] += s[x];
+                    }
+                }
+            }
+        }
+    };
+
+    // Scratch space for each thread, allocated on first use
+    int threads = 1;
+    #ifdef _OPENMP
+    threads = omp_get_max_threads();
+    #endif
+    vector<float *> scratch(threads * 2, NULL);
+    vector<vector<int> > columns(threads);
+
+    const int transforms = homogeneous ? blocks : (blocks + 1) / 2;
+
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1)
+    #endif
+    for (int i = 0; i < transforms; i++) {
+        int thread = 0;
+        #ifdef _OPENMP
+        thread = omp_get_thread_num();
+        #endif
+        float *&re = scratch[thread * 2], *&imag = scratch[thread * 2 + 1];
+        if (!re) {
+            re = (float *)fftwf_malloc(n * sizeof(float));
+            imag = (float *)fftwf_malloc(n * sizeof(float));
+        }
+        vector<int> &cols = columns[thread];
+        if (cols.empty()) {
+            cols.resize(bw);
+        }
 
-    //printf("5\n"); fflush(stdout);
-    // 5) Multiply the two into a padded complex transformed result
-    ComplexMultiply::apply(imT, filterT);
+        // Since the filter is real, the real and imaginary parts
+        // convolve independently
+        const int first = homogeneous ? i : i * 2;
+        const int second = homogeneous ? -1 : i * 2 + 1;
+        if (homogeneous) {
+            fill(first, re, imag, &cols[0]);
+        } else {
+            fill(first, re, NULL, &cols[0]);
+            if (second < blocks) {
+                fill(second, imag, NULL, &cols[0]);
+            } else {
+                memset(imag, 0, n * sizeof(float));
+            }
+        }
 
-    //printf("6\n"); fflush(stdout);
-    // 6) Inverse transorm the result
-    IFFT::apply(imT);
+        fftwf_execute_split_dft(plan, re, imag, re, imag);
+        for (int j = 0; j < n; j++) {
+            const float r = re[j] * filterRe[j] - imag[j] * filterIm[j];
+            const float c = re[j] * filterIm[j] + imag[j] * filterRe[j];
+            re[j] = r;
+            imag[j] = c;
+        }
+        fftwf_execute_split_dft(plan, imag, re, imag, re);
 
-    //printf("7\n"); fflush(stdout);
-    // 7) Remove the padding, and convert back to real numbers
-    out += imT.region(xPad, yPad, tPad, 0,
-                      im.width, im.height, im.frames, 1);
+        if (homogeneous) {
+            write(first, re, imag);
+        } else {
+            write(first, re, NULL);
+            if (second < blocks) write(second, imag, NULL);
+        }
+    }
+
+    for (size_t i = 0; i < scratch.size(); i++) {
+        if (scratch[i]) fftwf_free(scratch[i]);
+    }
+    fftwf_destroy_plan(plan);
+    fftwf_free(filterRe);
+    fftwf_free(filterIm);
 }
 
 
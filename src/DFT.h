@@ -35,8 +35,21 @@ public:
     bool test();
     void parse(vector<string> args);
     static Image apply(Image im, Image filter, Convolve::BoundaryCondition b, Multiply::Mode m);
+
+    // The image is convolved a block at a time (overlap-save), so
+    // that the scratch memory needed is a few blocks per thread rather
+    // than a padded copy of the whole image. Each block covers the
+    // output pixels it produces plus the filter's footprint around
+    // them. This picks the block size with the least total work for
+    // an image and filter of the given sizes, and returns that work,
+    // which is proportional to the time taken.
+    static double blockSize(int width, int height, int frames,
+                            int filterWidth, int filterHeight, int filterFrames,
+                            Convolve::BoundaryCondition b, int size[3]);
 private:
     static void convolveSingle(Image im, Image filter, Image out, Convolve::BoundaryCondition b);
+    static void convolveBlocks(Image im, Image filter, Image out,
+                               Convolve::BoundaryCondition b, const int size[3]);
 };
 
 class FFTPoisson : public Operation {
@@ -100,45 +100,26 @@ public:
     */
 
     DenseGrid(int d_, int vd_, int taps_ = 3) : d(d_), vd(vd_), taps(taps_) {
+        assert(d <= maxDimensions, "A dense grid can have at most %d dimensions\n", maxDimensions);
         scaleFactor = new float[d];
-        positionF = new float[d];
-        positionFInv = new float[d];
-        positionI = new int[d];
         minPosition = NULL;
         maxPosition = NULL;
         stride = NULL;
         sizes = NULL;
         grid = NULL;
-
-        for (int i = 0; i < d; i++) {
-            // The kernel for a single multi-linear interpolation is a
-            // cube convolved with itself. Therefore it's variance is
-            // twice the total variance of a d-dimensional unit cube.
-
-            // total variance of a cube = d/12
-            // total variance of splatting = d/6
-            // total variance of splatting + slicing = d/3
-
-            // total variance of the blur step is d(taps-1)/4
-
-            // so scale factor should be the std dev in each dimension
-            // = sqrt(total variance / d) = sqrt(1/3 + (taps-1)/4)
-
-            scaleFactor[i] = sqrtf(1.0/3 + (taps-1)*0.25);
-        }
-
+        setTaps(taps);
     }
 
     ~DenseGrid() {
         delete[] scaleFactor;
-        delete[] positionF;
-        delete[] positionFInv;
-        delete[] positionI;
         delete[] minPosition;
         delete[] maxPosition;
         delete[] stride;
         delete[] sizes;
         delete[] grid;
+        for (size_t i = 0; i < copies.size(); i++) {
+            delete[] copies[i];
+        }
     }
 
     void preview(float *position) {
@@ -146,39 +127,66 @@ public:
             minPosition = new float[d];
             maxPosition = new float[d];
             for (int i = 0; i < d; i++) {
-                minPosition[i] = position[i]*scaleFactor[i];
-                maxPosition[i] = position[i]*scaleFactor[i];
+                minPosition[i] = position[i];
+                maxPosition[i] = position[i];
             }
         } else {
             for (int i = 0; i < d; i++) {
-                if (position[i]*scaleFactor[i] < minPosition[i]) {
-                    minPosition[i] = position[i]*scaleFactor[i];
+                if (position[i] < minPosition[i]) {
+                    minPosition[i] = position[i];
                 }
-                if (position[i]*scaleFactor[i] > maxPosition[i]) {
-                    maxPosition[i] = position[i]*scaleFactor[i];
+                if (position[i] > maxPosition[i]) {
+                    maxPosition[i] = position[i];
                 }
             }
         }
     }
 
-    void splat(float *position, float *value) {
-        if (!grid) {
-            stride = new int[d+1];
-            sizes = new int[d];
-            stride[0] = vd;
-            for (int i = 0; i < d; i++) {
-                sizes[i] = (int)(ceil(maxPosition[i] - minPosition[i])+1);
-                stride[i+1] = stride[i]*sizes[i];
-            }
-            grid = new float[stride[d]];
-            memset(grid, 0, sizeof(float)*stride[d]);
+    // Allocate the grid once every position has been previewed, along
+    // with private copies of it for up to threads threads to splat
+    // into at once. If the grid alone would take more than maxMemory
+    // bytes, fewer blur taps are used, which allows a coarser grid for
+    // the same standard deviation. Only as many copies are made as fit
+    // within maxMemory. Returns the number of threads that may splat
+    // at once, each passing a different copy index to splat.
+    int beginSplat(int threads, size_t maxMemory = (size_t)1 << 30) {
+        while (taps > 1 && memoryNeeded() > maxMemory) {
+            setTaps(taps - 2);
+        }
+
+        stride = new int[d+1];
+        sizes = new int[d];
+        stride[0] = vd;
+        for (int i = 0; i < d; i++) {
+            // Leave room for the far neighbour of a position at the
+            // maximum, even though its weight is zero
+            sizes[i] = (int)(floor((maxPosition[i] - minPosition[i])*scaleFactor[i])+2);
+            stride[i+1] = stride[i]*sizes[i];
+        }
+        grid = new float[stride[d]];
+        memset(grid, 0, sizeof(float)*stride[d]);
+
+        int n = (int)std::max((size_t)1, std::min((size_t)threads, maxMemory / memoryUsed()));
+        for (int i = 1; i < n; i++) {
+            copies.push_back(new float[stride[d]]);
+            memset(copies.back(), 0, sizeof(float)*stride[d]);
+        }
+        return n;
+    }
 
+    void splat(float *position, float *value, int copy = 0) {
+        if (!grid) {
+            beginSplat(1);
         }
 
-        query<true>(position, value);
+        query<true>(copy ? copies[copy-1] : grid, position, value);
     }
 
+    // Sum the private copies into the grid, and blur it. Both are
+    // parallel.
     void blur() {
+        reduce();
+
         switch (taps) {
         case 3:
             blur_<3>();
@@ -192,8 +200,9 @@ public:
         }
     }
 
+    // Safe to call from several threads at once
     void slice(float *position, float *value) {
-        query<false>(position, value);
+        query<false>(grid, position, value);
     }
 
     size_t memoryUsed() {
@@ -202,92 +211,129 @@ public:
 
 private:
 
-    template <int taps_>
-    void blur_() {
-        int *rowLocation = new int[d];
-        float *tmp1 = new float[vd];
-        float *tmp2 = new float[vd];
-
-        for (int j = 0; j < d; j++) {
-
-            for (int i = 0; i < d; i++) { rowLocation[i] = 0; }
+    static const int maxDimensions = 16;
 
-            //printf("Blurring in direction %d\n", j);
-            // iterate through every dimension except for j and the value dimension
-            for (int row = 0; row < stride[d]/(vd*sizes[j]); row++) {
+    void setTaps(int taps_) {
+        taps = taps_;
+        for (int i = 0; i < d; i++) {
+            // The kernel for a single multi-linear interpolation is a
+            // cube convolved with itself. Therefore it's variance is
+            // twice the total variance of a d-dimensional unit cube.
 
-                float *startOfRow = grid;
-                for (int i = 0; i < d; i++) {
-                    startOfRow += rowLocation[i]*stride[i];
-                }
+            // total variance of a cube = d/12
+            // total variance of splatting = d/6
+            // total variance of splatting + slicing = d/3
 
-                for (int iters = 0; iters < taps_/2; iters++) {
-                    float *rowPtr = startOfRow;
+            // total variance of the blur step is d(taps-1)/4
 
-                    // now walk along the row blurring
-                    int s = stride[j];
+            // so scale factor should be the std dev in each dimension
+            // = sqrt(total variance / d) = sqrt(1/3 + (taps-1)/4)
 
-                    for (int k = 0; k < vd; k++) {
-                        tmp1[k] = rowPtr[k]/2;
-                    }
+            scaleFactor[i] = sqrtf(1.0/3 + (taps-1)*0.25);
+        }
+    }
 
-                    for (int i = 0; i < sizes[j]-1; i++) {
-                        // the average of previous + current is stored in tmp1
+    // The bytes the grid would take with the current scale factor
+    size_t memoryNeeded() {
+        double cells = vd;
+        for (int i = 0; i < d; i++) {
+            cells *= floor((maxPosition[i] - minPosition[i])*scaleFactor[i])+2;
+        }
+        return (size_t)std::min(cells*sizeof(float), 1e18);
+    }
 
-                        // save the average of current + next into tmp2
-                        for (int k = 0; k < vd; k++) {
-                            tmp2[k] = 0.5*(rowPtr[k] + rowPtr[k+s]);
-                        }
+    void reduce() {
+        if (copies.empty()) { return; }
+        const int chunk = 1 << 14;
+        const int chunks = (stride[d] + chunk - 1) / chunk;
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (int c = 0; c < chunks; c++) {
+            const int end = std::min(stride[d], (c+1)*chunk);
+            for (size_t i = 0; i < copies.size(); i++) {
+                const float *copy = copies[i];
+                for (int j = c*chunk; j < end; j++) {
+                    grid[j] += copy[j];
+                }
+            }
+        }
+        for (size_t i = 0; i < copies.size(); i++) {
+            delete[] copies[i];
+        }
+        copies.clear();
+    }
 
-                        // then clobber current with the average of tmp1 and tmp2
-                        for (int k = 0; k < vd; k++) {
-                            rowPtr[k] = 0.5*(tmp1[k] + tmp2[k]);
-                        }
+    template <int taps_>
+    void blur_() {
+        // Blurring along dimension j treats the grid as outer rows of
+        // sizes[j] blocks of stride[j] consecutive floats. Each block
+        // is blurred with its neighbours along the row with a [1 2 1]
+        // kernel, a run of consecutive floats at a time, and the runs
+        // are spread across threads.
+        const int chunk = 1 << 10;
+        int threads = 1;
+        #ifdef _OPENMP
+        threads = omp_get_max_threads();
+        #endif
+        float *scratch = new float[threads*chunk];
 
-                        // switch tmp1 and tmp2
-                        float *tmp3 = tmp1;
-                        tmp1 = tmp2;
-                        tmp2 = tmp3;
+        for (int j = 0; j < d; j++) {
+            const int s = stride[j];
+            const int n = sizes[j];
+            const int outer = stride[d]/stride[j+1];
+            const int runs = (s + chunk - 1) / chunk;
+
+            #ifdef _OPENMP
+            #pragma omp parallel for schedule(dynamic, 1)
+            #endif
+            for (int task = 0; task < outer*runs; task++) {
+                int thread = 0;
+                #ifdef _OPENMP
+                thread = omp_get_thread_num();
+                #endif
+                float *prev = scratch + thread*chunk;
+                const int start = (task % runs)*chunk;
+                const int len = std::min(chunk, s - start);
+                float *row = grid + (size_t)(task / runs)*stride[j+1] + start;
 
-                        rowPtr += s;
+                for (int iters = 0; iters < taps_/2; iters++) {
+                    // prev holds the previous block before it was
+                    // blurred, which is zero before the first one
+                    for (int k = 0; k < len; k++) {
+                        prev[k] = 0;
                     }
-
-                    // write the last one
-                    for (int k = 0; k < vd; k++) {
-                        rowPtr[k] = 0.5*(tmp1[k] + 0.5*rowPtr[k]);
+                    for (int i = 0; i < n; i++) {
+                        float *cur = row + (size_t)i*s;
+                        if (i < n-1) {
+                            const float *next = cur + s;
+                            for (int k = 0; k < len; k++) {
+                                float x = cur[k];
+                                cur[k] = 0.5f*x + 0.25f*(prev[k] + next[k]);
+                                prev[k] = x;
+                            }
+                        } else {
+                            for (int k = 0; k < len; k++) {
+                                cur[k] = 0.5f*cur[k] + 0.25f*prev[k];
+                            }
+                        }
                     }
                 }
-
-                // This is basically addition with ripple carry,
-                // ignoring the digit in the place of the current
-                // dimension (digit j)
-                int k = 0;
-                if (k == j) { k++; }
-                if (k >= d) { printf("PANIC!\n"); }
-                rowLocation[k]++;
-
-                while (rowLocation[k] == sizes[k]) {
-                    rowLocation[k] = 0;
-                    k++;
-                    if (k == j) { k++; }
-                    if (k >= d) { break; }
-                    rowLocation[k]++;
-                }
-
             }
         }
-        delete[] rowLocation;
-        delete[] tmp1;
-        delete[] tmp2;
+
+        delete[] scratch;
     }
 
     template<bool splatting>
-    void query(float *position, float *value) {
+    void query(float *target, float *position, float *value) {
+        int positionI[maxDimensions];
+        float positionF[maxDimensions], positionFInv[maxDimensions];
 
         // break the query into integral and floating point portions
         for (int i = 0; i < d; i++) {
-            float f = (position[i]*scaleFactor[i] - minPosition[i]);
-            positionI[i] = (short)floorf(f);
+            float f = (position[i] - minPosition[i])*scaleFactor[i];
+            positionI[i] = (int)floorf(f);
             positionF[i] = f - positionI[i];
             positionFInv[i] = 1 - positionF[i];
         }
@@ -299,7 +345,7 @@ private:
         }
 
         // find the position of the top left
-        float *topLeft = grid;
+        float *topLeft = target;
         for (int i = 0; i < d; i++) {
             topLeft += positionI[i]*stride[i];
         }
@@ -333,10 +379,9 @@ private:
 
     int d, vd, taps;
     float *scaleFactor;
-    float *positionF, *positionFInv;
     float *grid;
+    vector<float *> copies;
     float *minPosition, *maxPosition;
-    int *positionI;
     int *stride;
     int *sizes;
 };
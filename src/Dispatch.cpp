@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The entry point of a multi-architecture build (make MULTIARCH=1).
+// The rest of ImageStack is compiled once for each x86-64
+// microarchitecture level, each copy in a namespace of its own (see
+// header.h), so that expressions are vectorized as widely as the
+// processor allows: 4-wide SSE, 8-wide AVX2, or 16-wide
+// AVX-512. This file is compiled for the baseline, and runs the
+// widest copy the processor supports. Setting the environment
+// variable IMAGESTACK_ARCH to the name of a level runs that one
+// instead, which is useful for testing.
+
+namespace ImageStack {
+namespace x86_64 {
+int run(int argc, char **argv);
+}
+namespace x86_64_v3 {
+int run(int argc, char **argv);
+}
+namespace x86_64_v4 {
+int run(int argc, char **argv);
+}
+}
+
+int main(int argc, char **argv) {
+    __builtin_cpu_init();
+
+    struct Level {
+        const char *name;
+        int (*run)(int, char **);
+        bool supported;
+    } levels[] = {
+        {"x86-64-v4", ImageStack::x86_64_v4::run, __builtin_cpu_supports("x86-64-v4") != 0},
+        {"x86-64-v3", ImageStack::x86_64_v3::run, __builtin_cpu_supports("x86-64-v3") != 0},
+        {"x86-64", ImageStack::x86_64::run, true}
+    };
+
+    const char *wanted = getenv("IMAGESTACK_ARCH");
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        if (!levels[i].supported) { continue; }
+        if (wanted && wanted[0] && strcmp(wanted, levels[i].name)) { continue; }
+        return levels[i].run(argc, argv);
+    }
+
+    fprintf(stderr, "IMAGESTACK_ARCH is %s, which is not one of x86-64, x86-64-v3, or"
+            " x86-64-v4 that this processor supports.\n", wanted);
+    return 1;
+}
@@ -2,6 +2,9 @@
 #define IMAGESTACK_EXPR_H
 
 #include <stdint.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "Exception.h" // assert
 #include "header.h"
 
@@ -16,15 +19,61 @@
 
 class Image;
 
+// The instruction set to compile for. Normally this is whatever the
+// compiler targets. In a multi-architecture build, each copy of
+// ImageStack is instead compiled with a target pragma for one x86-64
+// microarchitecture level (see header.h). In C++ that pragma doesn't
+// define the usual feature macros, so the level implies them.
+#ifdef IMAGESTACK_ARCH
+#define IMAGESTACK_SSE 1
+#if IMAGESTACK_ARCH >= 2
+#define IMAGESTACK_SSE4_1 1
+#endif
+#if IMAGESTACK_ARCH >= 3
+#define IMAGESTACK_AVX 1
+#define IMAGESTACK_AVX2 1
+#define IMAGESTACK_FMA 1
+#define IMAGESTACK_F16C 1
+#endif
+#if IMAGESTACK_ARCH >= 4
+#define IMAGESTACK_AVX512F 1
+#endif
+#else
+#ifdef __SSE__
+#define IMAGESTACK_SSE 1
+#endif
+#ifdef __SSE4_1__
+#define IMAGESTACK_SSE4_1 1
+#endif
+#ifdef __AVX__
+#define IMAGESTACK_AVX 1
+#endif
+#ifdef __AVX2__
+#define IMAGESTACK_AVX2 1
+#endif
+#ifdef __FMA__
+#define IMAGESTACK_FMA 1
+#endif
+#ifdef __F16C__
+#define IMAGESTACK_F16C 1
+#endif
+#ifdef __AVX512F__
+#define IMAGESTACK_AVX512F 1
+#endif
+#endif
+
 // Include structures describing various primitive ops like add and floor
 
 // Scalar versions of the ops
 #include "Expr_scalar.h"
-#ifdef __AVX__
-// vectors are 8-wide floats
+#if defined(IMAGESTACK_AVX512F) && !defined(IMAGESTACK_NO_AVX512)
+// vectors are 16-wide floats
+#include "Expr_avx512.h"
+#elif defined(IMAGESTACK_AVX)
+// vectors are 8-wide floats. AVX2 and FMA are used if enabled.
 #include "Expr_avx.h"
 #else
-#ifdef __SSE__
+#ifdef IMAGESTACK_SSE
 // vectors are 4-wide floats
 #include "Expr_sse.h"
 #else
@@ -33,6 +82,12 @@ class Image;
 #endif
 #endif
 
+#if defined(IMAGESTACK_AVX) || defined(IMAGESTACK_SSE)
+// Vector exp, log, sin, etc
+#define IMAGESTACK_VECTOR_MATH
+#include "Expr_math.h"
+#endif
+
 // Used for safety when comparing bounds of things. In general we
 // don't expect things will be compared against this, but in case they
 // are, it's large enough to be bigger than any reasonable image size,
@@ -640,6 +695,78 @@ namespace Expr {
         return min(max(a, b), c);
     }
 
+    // The vector form of a scalar function, used by Lift and
+    // Lift2. Functions with a vector implementation in Expr_math.h
+    // are specialized below. Anything else is computed one lane at a
+    // time.
+    template<float(*fn)(float)>
+    struct VecFn {
+        static Vec::type vec(Vec::type a) {
+            union {
+                float f[Vec::width];
+                Vec::type v;
+            } va;
+            va.v = a;
+            for (int i = 0; i < Vec::width; i++) {
+                va.f[i] = (*fn)(va.f[i]);
+            }
+            return va.v;
+        }
+    };
+
+    template<float(*fn)(float, float)>
+    struct VecFn2 {
+        static Vec::type vec(Vec::type a, Vec::type b) {
+            union {
+                float f[Vec::width];
+                Vec::type v;
+            } va, vb;
+            va.v = a;
+            vb.v = b;
+            for (int i = 0; i < Vec::width; i++) {
+                vb.f[i] = (*fn)(va.f[i], vb.f[i]);
+            }
+            return vb.v;
+        }
+    };
+
+#ifdef IMAGESTACK_VECTOR_MATH
+    template<>
+    struct VecFn<expf> {
+        static Vec::type vec(Vec::type a) {return Vec::exp(a);}
+    };
+
+    template<>
+    struct VecFn<logf> {
+        static Vec::type vec(Vec::type a) {return Vec::log(a);}
+    };
+
+    template<>
+    struct VecFn<sinf> {
+        static Vec::type vec(Vec::type a) {return Vec::sin(a);}
+    };
+
+    template<>
+    struct VecFn<cosf> {
+        static Vec::type vec(Vec::type a) {return Vec::cos(a);}
+    };
+
+    template<>
+    struct VecFn<fabsf> {
+        static Vec::type vec(Vec::type a) {return Vec::abs(a);}
+    };
+
+    template<>
+    struct VecFn2<powf> {
+        static Vec::type vec(Vec::type a, Vec::type b) {return Vec::pow(a, b);}
+    };
+
+    template<>
+    struct VecFn2<atan2f> {
+        static Vec::type vec(Vec::type a, Vec::type b) {return Vec::atan2(a, b);}
+    };
+#endif
+
     // Lift a unary function over floats to the same function over an image (e.g. cosf)
     template<float(*fn)(float), typename A>
     struct Lift {
@@ -658,15 +785,7 @@ namespace Expr {
             Iter(const typename A::Iter &a_) : a(a_) {}
             float operator[](int x) const {return (*fn)(a[x]);}
             Vec::type vec(int x) const {
-                union {
-                    float f[Vec::width];
-                    Vec::type v;
-                } va;
-                va.v = a.vec(x);
-                for (int i = 0; i < Vec::width; i++) {
-                    va.f[i] = (*fn)(va.f[i]);
-                }
-                return va.v;
+                return VecFn<fn>::vec(a.vec(x));
             }
         };
         Iter scanline(int x, int y, int t, int c, int width) const {
@@ -754,16 +873,7 @@ namespace Expr {
                 return (*fn)(a[x], b[x]);
             }
             Vec::type vec(int x) const {
-                union {
-                    float f[Vec::width];
-                    Vec::type v;
-                } va, vb;
-                va.v = a.vec(x);
-                vb.v = b.vec(x);
-                for (int i = 0; i < Vec::width; i++) {
-                    vb.f[i] = (*fn)(va.f[i], vb.f[i]);
-                }
-                return vb.v;
+                return VecFn2<fn>::vec(a.vec(x), b.vec(x));
             }
         };
         Iter scanline(int x, int y, int t, int c, int width) const {
@@ -2158,35 +2268,59 @@ namespace Expr {
         static const bool value = true;
     };
 
-    // Evaluated an expression into an array
+    // Evaluated an expression into an array. Any run of at least
+    // Vec::width values the expression can vectorize over is done
+    // entirely with vectors: when the run isn't a multiple of the
+    // vector width, the last vector overlaps the one before it. That
+    // last vector is computed before anything else is stored, so that
+    // in-place updates (e.g. im.set(im*2)) still only see the
+    // original values. Only runs shorter than a vector, and the parts
+    // of the scanline a bounded expression can't vectorize over, are
+    // done with scalar code.
     template<typename T>
     void setScanline(const T src, float *const dst, 
                      int x, const int maxX,
                      const bool boundedVX, const int minVX, const int maxVX) {
 
-        // Is it worth vectorizing this?
-        if (Vec::width > 1 && (maxX - x) > Vec::width*2) {
-            // Scalar warm up
-            while (x < maxX &&  // Don't go past the end
-                   ((boundedVX && x < minVX) || // Walk at least until it's safe to start vectorizing
-                    ((size_t)(dst+x) & (Vec::width*sizeof(float) - 1)))) { // Walk a little further for store alignment
+        if (Vec::width > 1 && (maxX - x) >= Vec::width) {
+            // Walk up to where we're allowed to start vectorizing
+            while (boundedVX && x < std::min(minVX, maxX)) {
                 dst[x] = src[x];
                 x++;
             }
 
-            // Vectorized steady-state until we reach the end or until
-            // we're no longer allowed to vectorize
+            // Vectorize until we reach the end or until we're no
+            // longer allowed to vectorize
             int lastX = maxX - Vec::width;
             if (boundedVX) lastX = std::min(lastX, maxVX);
 
-            // Put a marker in the asm to make the important bit
-            // easier to find for checking it's doing the right thing
-            asm("# begin vector");
-            while (x <= lastX) {
-                Vec::store(src.vec(x), dst+x);
-                x += Vec::width;
+            if (x <= lastX) {
+                const Vec::type last = src.vec(lastX);
+
+                // Long runs start with one unaligned vector, then step
+                // back to an aligned store address. The aligned vector
+                // overlaps the first one, so it's also computed first.
+                const int misalignment = (int)(((size_t)(dst+x) / sizeof(float)) & (Vec::width - 1));
+                if (misalignment && lastX - x >= Vec::width*4) {
+                    const int alignedX = x + Vec::width - misalignment;
+                    const Vec::type first = src.vec(x);
+                    const Vec::type next = src.vec(alignedX);
+                    Vec::store(first, dst+x);
+                    Vec::store(next, dst+alignedX);
+                    x = alignedX + Vec::width;
+                }
+
+                // Put a marker in the asm to make the important bit
+                // easier to find for checking it's doing the right thing
+                asm("# begin vector");
+                while (x < lastX) {
+                    Vec::store(src.vec(x), dst+x);
+                    x += Vec::width;
+                }
+                asm("# end vector");
+                Vec::store(last, dst+lastX);
+                x = lastX + Vec::width;
             }
-            asm("# end vector");
         }
 
         // Scalar wind down 
@@ -2196,6 +2330,113 @@ namespace Expr {
         }        
     }    
 
+    // Call body(y, t, c) once for every scanline in the given
+    // range. Rather than forking a thread team per channel and frame,
+    // the whole (c, t, y) space is flattened and cut into chunks of
+    // consecutive scanlines which are handed out to threads
+    // dynamically. Chunks aim to fit in L2 cache, but are kept small
+    // enough that each thread gets several, so short wide images and
+    // images with many channels still keep every core busy. Jobs too
+    // small to be worth waking other threads for run serially.
+    template<typename Body>
+    void forEachScanline(int minY, int maxY, int minT, int maxT, int minC, int maxC,
+                         int scanlineWidth, const Body &body) {
+        const int h = maxY - minY, f = maxT - minT;
+        const int64_t scanlines = (int64_t)h * f * (maxC - minC);
+        if (scanlines <= 0) return;
+
+        const int64_t chunkBytes = 128 * 1024;
+        const int64_t minParallelPixels = 8192;
+
+        int threads = 1;
+        #ifdef _OPENMP
+        if (!omp_in_parallel()) threads = omp_get_max_threads();
+        #endif
+
+        if (threads == 1 || scanlines * scanlineWidth < minParallelPixels) {
+            for (int c = minC; c < maxC; c++) {
+                for (int t = minT; t < maxT; t++) {
+                    for (int y = minY; y < maxY; y++) {
+                        body(y, t, c);
+                    }
+                }
+            }
+            return;
+        }
+
+        int64_t rows = chunkBytes / (sizeof(float) * std::max(scanlineWidth, 1));
+        rows = std::min(rows, (scanlines + 4*threads - 1) / (4*threads));
+        rows = std::max(rows, (int64_t)1);
+        const int64_t chunks = (scanlines + rows - 1) / rows;
+
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 1)
+        #endif
+        for (int64_t i = 0; i < chunks; i++) {
+            const int64_t start = i * rows;
+            const int64_t end = std::min(start + rows, scanlines);
+            int y = (int)(start % h);
+            int t = (int)((start / h) % f);
+            int c = (int)(start / ((int64_t)h * f));
+            for (int64_t j = start; j < end; j++) {
+                body(y + minY, t + minT, c + minC);
+                if (++y == h) {
+                    y = 0;
+                    if (++t == f) {
+                        t = 0;
+                        c++;
+                    }
+                }
+            }
+        }
+    }
+
+    // Evaluate an expression into every stride-th element of an array
+    // (e.g. one channel of an image with interleaved channels)
+    template<typename T>
+    void setScanlineStrided(const T src, float *const dst, const int stride,
+                            int x, const int maxX,
+                            const bool boundedVX, const int minVX, const int maxVX) {
+
+        if (Vec::width > 1 && (maxX - x) >= Vec::width) {
+            // Walk up to where we're allowed to start vectorizing
+            while (boundedVX && x < std::min(minVX, maxX)) {
+                dst[x*stride] = src[x];
+                x++;
+            }
+
+            int lastX = maxX - Vec::width;
+            if (boundedVX) lastX = std::min(lastX, maxVX);
+
+            union {
+                float f[Vec::width];
+                Vec::type v;
+            } v, last;
+            if (x <= lastX) {
+                // Finish with an overlapping vector, as in setScanline
+                last.v = src.vec(lastX);
+                while (x < lastX) {
+                    v.v = src.vec(x);
+                    float *d = dst + x*stride;
+                    for (int i = 0; i < Vec::width; i++) {
+                        d[i*stride] = v.f[i];
+                    }
+                    x += Vec::width;
+                }
+                float *d = dst + lastX*stride;
+                for (int i = 0; i < Vec::width; i++) {
+                    d[i*stride] = last.f[i];
+                }
+                x = lastX + Vec::width;
+            }
+        }
+
+        while (x < maxX) {
+            dst[x*stride] = src[x];
+            x++;
+        }
+    }
+
     // Evaluate from two to four expressions in lockstep
     template<typename T1, typename T2, typename T3, typename T4>
     void setScanlineMulti(const T1 src1, const T2 src2, const T3 src3, const T4 src4,
@@ -2203,7 +2444,7 @@ namespace Expr {
                           int x, const int maxX,
                           const bool boundedVX, const int minVX, const int maxVX) {
 
-        if (Vec::width > 1 && (maxX - x) > Vec::width*2) {
+        if (Vec::width > 1 && (maxX - x) >= Vec::width) {
             //printf("Warm up...\n");
             // Walk up to where we're allowed to start vectorizing
             while (boundedVX && x < std::min(minVX, maxX-1)) {
@@ -2222,19 +2463,31 @@ namespace Expr {
             // we're no longer allowed to vectorize
             int lastX = maxX - Vec::width;
             if (boundedVX) lastX = std::min(lastX, maxVX);
-            asm("# begin vector");
-            while (x <= lastX) {                
-                const Vec::type v1 = src1.vec(x);
-                const Vec::type v2 = src2.vec(x);
-                const Vec::type v3 = src3.vec(x);
-                const Vec::type v4 = src4.vec(x);
-                Vec::store(v1, dst1+x);
-                if (dst2) Vec::store(v2, dst2+x);
-                if (dst3) Vec::store(v3, dst3+x);
-                if (dst4) Vec::store(v4, dst4+x);
-                x += Vec::width;
+            if (x <= lastX) {
+                // Finish with an overlapping vector, as in setScanline
+                const Vec::type last1 = src1.vec(lastX);
+                const Vec::type last2 = src2.vec(lastX);
+                const Vec::type last3 = src3.vec(lastX);
+                const Vec::type last4 = src4.vec(lastX);
+                asm("# begin vector");
+                while (x < lastX) {
+                    const Vec::type v1 = src1.vec(x);
+                    const Vec::type v2 = src2.vec(x);
+                    const Vec::type v3 = src3.vec(x);
+                    const Vec::type v4 = src4.vec(x);
+                    Vec::store(v1, dst1+x);
+                    if (dst2) Vec::store(v2, dst2+x);
+                    if (dst3) Vec::store(v3, dst3+x);
+                    if (dst4) Vec::store(v4, dst4+x);
+                    x += Vec::width;
+                }
+                asm("# end vector");
+                Vec::store(last1, dst1+lastX);
+                if (dst2) Vec::store(last2, dst2+lastX);
+                if (dst3) Vec::store(last3, dst3+lastX);
+                if (dst4) Vec::store(last4, dst4+lastX);
+                x = lastX + Vec::width;
             }
-            asm("# end vector");
         }
         //printf("Wind down...\n");
         // Scalar wind down
@@ -41,6 +41,15 @@ namespace Vec {
         static type vec(type a, type b) {return _mm256_max_ps(a, b);}
     };
 
+    // a*b + c
+    inline type mulAdd(type a, type b, type c) {
+#ifdef IMAGESTACK_FMA
+        return _mm256_fmadd_ps(a, b, c);
+#else
+        return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+    }
+
     // Comparisons
     struct GT : public ImageStack::Scalar::GT {
         static type vec(type a, type b) {return _mm256_cmp_ps(a, b, _CMP_GT_OQ);}
@@ -113,6 +122,129 @@ namespace Vec {
     inline void store(type a, float *f) {
         _mm256_storeu_ps(f, a);
     }
+
+    // Load every stride-th float
+    inline type gather(const float *f, int stride) {
+#ifdef IMAGESTACK_AVX2
+        const __m256i lanes = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+        return _mm256_i32gather_ps(f, _mm256_mullo_epi32(lanes, _mm256_set1_epi32(stride)), 4);
+#else
+        return _mm256_set_ps(f[7*stride], f[6*stride], f[5*stride], f[4*stride],
+                             f[3*stride], f[2*stride], f[stride], f[0]);
+#endif
+    }
+
+    // Bitwise ops and conversions between floats and their bits,
+    // used by the transcendental functions in Expr_math.h
+    inline type andBits(type a, type b) {
+        return _mm256_and_ps(a, b);
+    }
+
+    inline type orBits(type a, type b) {
+        return _mm256_or_ps(a, b);
+    }
+
+    inline type xorBits(type a, type b) {
+        return _mm256_xor_ps(a, b);
+    }
+
+    // ~a & b
+    inline type andNotBits(type a, type b) {
+        return _mm256_andnot_ps(a, b);
+    }
+
+    // A vector with every lane holding the given bit pattern
+    inline type broadcastBits(uint32_t bits) {
+        return _mm256_castsi256_ps(_mm256_set1_epi32((int)bits));
+    }
+
+    // Interpret the bits of each lane as an int and convert it to float
+    inline type intFromBits(type a) {
+        return _mm256_cvtepi32_ps(_mm256_castps_si256(a));
+    }
+
+    // Convert each integer-valued lane to an int and return its bits
+    inline type bitsFromInt(type a) {
+        return _mm256_castsi256_ps(_mm256_cvttps_epi32(a));
+    }
+
+    // Round to the nearest integer
+    inline type round(type a) {
+        return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    }
+
+    // Loads and stores that convert to and from compact storage
+    // types. Integer stores round to nearest and saturate. Plain AVX
+    // has no 256-bit integer ops, so without AVX2 the integer work is
+    // done in two 128-bit halves.
+#ifdef IMAGESTACK_AVX2
+    inline type loadU8(const uint8_t *f) {
+        return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)f)));
+    }
+
+    inline type loadU16(const uint16_t *f) {
+        return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)f)));
+    }
+#else
+    inline type fromInt32Halves(__m128i lo, __m128i hi) {
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_cvtepi32_ps(lo)),
+                                    _mm_cvtepi32_ps(hi), 1);
+    }
+
+    inline type loadU8(const uint8_t *f) {
+        __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)f), _mm_setzero_si128());
+        return fromInt32Halves(_mm_unpacklo_epi16(v, _mm_setzero_si128()),
+                       _mm_unpackhi_epi16(v, _mm_setzero_si128()));
+    }
+
+    inline type loadU16(const uint16_t *f) {
+        __m128i v = _mm_loadu_si128((const __m128i *)f);
+        return fromInt32Halves(_mm_unpacklo_epi16(v, _mm_setzero_si128()),
+                       _mm_unpackhi_epi16(v, _mm_setzero_si128()));
+    }
+#endif
+
+    inline void storeU8(type a, uint8_t *f) {
+        a = _mm256_min_ps(_mm256_max_ps(a, _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+        __m256i i = _mm256_cvtps_epi32(a);
+        __m128i v = _mm_packs_epi32(_mm256_castsi256_si128(i), _mm256_extractf128_si256(i, 1));
+        _mm_storel_epi64((__m128i *)f, _mm_packus_epi16(v, v));
+    }
+
+    inline void storeU16(type a, uint16_t *f) {
+        // Shift into the signed range so we can use the signed pack
+        a = _mm256_min_ps(_mm256_max_ps(a, _mm256_setzero_ps()), _mm256_set1_ps(65535.0f));
+        __m256i i = _mm256_cvtps_epi32(_mm256_sub_ps(a, _mm256_set1_ps(32768.0f)));
+        __m128i v = _mm_packs_epi32(_mm256_castsi256_si128(i), _mm256_extractf128_si256(i, 1));
+        _mm_storeu_si128((__m128i *)f, _mm_xor_si128(v, _mm_set1_epi16((short)0x8000)));
+    }
+
+#ifdef IMAGESTACK_F16C
+    inline type loadHalf(const uint16_t *f) {
+        return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)f));
+    }
+
+    inline void storeHalf(type a, uint16_t *f) {
+        _mm_storeu_si128((__m128i *)f, _mm256_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT));
+    }
+#else
+    inline type loadHalf(const uint16_t *f) {
+        using namespace ImageStack::Scalar;
+        return set(halfToFloat(f[0]), halfToFloat(f[1]), halfToFloat(f[2]), halfToFloat(f[3]),
+                   halfToFloat(f[4]), halfToFloat(f[5]), halfToFloat(f[6]), halfToFloat(f[7]));
+    }
+
+    inline void storeHalf(type a, uint16_t *f) {
+        union {
+            float f[width];
+            type v;
+        } v;
+        v.v = a;
+        for (int i = 0; i < width; i++) {
+            f[i] = ImageStack::Scalar::floatToHalf(v.f[i]);
+        }
+    }
+#endif
 }
 
 #include "footer.h"
@@ -0,0 +1,205 @@
+#ifndef IMAGESTACK_EXPR_AVX512_H
+#define IMAGESTACK_EXPR_AVX512_H
+
+#include <immintrin.h>
+
+#include "header.h"
+
+// Only AVX-512F instructions are used here, so this works on every
+// AVX-512 machine. Comparisons produce mask registers, which are
+// expanded into all-ones lanes so that they can be treated as vectors
+// like in the other backends.
+namespace Vec {
+    typedef __m512 type;
+    const int width = 16;
+
+    inline type broadcast(float v) {
+        return _mm512_set1_ps(v);
+    }
+
+    inline type set(float a, float b, float c, float d = 0,
+                    float e = 0, float f = 0, float g = 0, float h = 0,
+                    float i = 0, float j = 0, float k = 0, float l = 0,
+                    float m = 0, float n = 0, float o = 0, float p = 0) {
+        return _mm512_set_ps(p, o, n, m, l, k, j, i, h, g, f, e, d, c, b, a);
+    }
+
+    inline type zero() {
+        return _mm512_setzero_ps();
+    }
+
+    // Arithmetic binary operators
+    struct Add : public ImageStack::Scalar::Add {
+        static type vec(type a, type b) {return _mm512_add_ps(a, b);}
+    };
+    struct Sub : public ImageStack::Scalar::Sub {
+        static type vec(type a, type b) {return _mm512_sub_ps(a, b);}
+    };
+    struct Mul : public ImageStack::Scalar::Mul {
+        static type vec(type a, type b) {return _mm512_mul_ps(a, b);}
+    };
+    struct Div : public ImageStack::Scalar::Div {
+        static type vec(type a, type b) {return _mm512_div_ps(a, b);}
+    };
+    struct Min : public ImageStack::Scalar::Min {
+        static type vec(type a, type b) {return _mm512_min_ps(a, b);}
+    };
+    struct Max : public ImageStack::Scalar::Max {
+        static type vec(type a, type b) {return _mm512_max_ps(a, b);}
+    };
+
+    // a*b + c
+    inline type mulAdd(type a, type b, type c) {
+        return _mm512_fmadd_ps(a, b, c);
+    }
+
+    // Comparisons
+    inline type fromMask(__mmask16 m) {
+        return _mm512_castsi512_ps(_mm512_maskz_set1_epi32(m, -1));
+    }
+
+    struct GT : public ImageStack::Scalar::GT {
+        static type vec(type a, type b) {return fromMask(_mm512_cmp_ps_mask(a, b, _CMP_GT_OQ));}
+    };
+    struct LT : public ImageStack::Scalar::LT {
+        static type vec(type a, type b) {return fromMask(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ));}
+    };
+    struct GE : public ImageStack::Scalar::GE {
+        static type vec(type a, type b) {return fromMask(_mm512_cmp_ps_mask(a, b, _CMP_GE_OQ));}
+    };
+    struct LE : public ImageStack::Scalar::LE {
+        static type vec(type a, type b) {return fromMask(_mm512_cmp_ps_mask(a, b, _CMP_LE_OQ));}
+    };
+    struct EQ : public ImageStack::Scalar::EQ {
+        static type vec(type a, type b) {return fromMask(_mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ));}
+    };
+    struct NEQ : public ImageStack::Scalar::NEQ {
+        static type vec(type a, type b) {return fromMask(_mm512_cmp_ps_mask(a, b, _CMP_NEQ_OQ));}
+    };
+
+    // Logical ops
+    inline type blend(type a, type b, type mask) {
+        // Like blendv, select on the sign bit of the mask
+        __mmask16 m = _mm512_cmplt_epi32_mask(_mm512_castps_si512(mask), _mm512_setzero_si512());
+        return _mm512_mask_blend_ps(m, a, b);
+    }
+
+    inline type interleave(type a, type b) {
+        // Given vectors a and b, return a[0] b[0] a[1] b[1] ... a[7] b[7]
+        const __m512i idx = _mm512_set_epi32(23, 7, 22, 6, 21, 5, 20, 4,
+                                             19, 3, 18, 2, 17, 1, 16, 0);
+        return _mm512_permutex2var_ps(a, idx, b);
+    }
+
+    inline type subsample(type a, type b) {
+        // Given vectors a and b, return a[0], a[2], ... a[14], b[1], b[3], ... b[15]
+        const __m512i idx = _mm512_set_epi32(31, 29, 27, 25, 23, 21, 19, 17,
+                                             14, 12, 10, 8, 6, 4, 2, 0);
+        return _mm512_permutex2var_ps(a, idx, b);
+    }
+
+    inline type reverse(type a) {
+        const __m512i idx = _mm512_set_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                                             8, 9, 10, 11, 12, 13, 14, 15);
+        return _mm512_permutexvar_ps(idx, a);
+    }
+
+    // Unary ops
+    struct Floor : public ImageStack::Scalar::Floor {
+        static type vec(type a) {return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);}
+    };
+    struct Ceil : public ImageStack::Scalar::Ceil {
+        static type vec(type a) {return _mm512_roundscale_ps(a, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC);}
+    };
+    struct Sqrt : public ImageStack::Scalar::Sqrt {
+        static type vec(type a) {return _mm512_sqrt_ps(a);}
+    };
+
+    // Loads and stores
+    inline type load(const float *f) {
+        return _mm512_loadu_ps(f);
+    }
+
+    inline void store(type a, float *f) {
+        _mm512_storeu_ps(f, a);
+    }
+
+    // Load every stride-th float
+    inline type gather(const float *f, int stride) {
+        const __m512i lanes = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+                                               7, 6, 5, 4, 3, 2, 1, 0);
+        return _mm512_i32gather_ps(_mm512_mullo_epi32(lanes, _mm512_set1_epi32(stride)), f, 4);
+    }
+
+    // Bitwise ops and conversions between floats and their bits,
+    // used by the transcendental functions in Expr_math.h. The float
+    // forms of the bitwise ops need AVX-512DQ, so use the integer ones.
+    inline type andBits(type a, type b) {
+        return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));
+    }
+
+    inline type orBits(type a, type b) {
+        return _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));
+    }
+
+    inline type xorBits(type a, type b) {
+        return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));
+    }
+
+    // ~a & b
+    inline type andNotBits(type a, type b) {
+        return _mm512_castsi512_ps(_mm512_andnot_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));
+    }
+
+    // A vector with every lane holding the given bit pattern
+    inline type broadcastBits(uint32_t bits) {
+        return _mm512_castsi512_ps(_mm512_set1_epi32((int)bits));
+    }
+
+    // Interpret the bits of each lane as an int and convert it to float
+    inline type intFromBits(type a) {
+        return _mm512_cvtepi32_ps(_mm512_castps_si512(a));
+    }
+
+    // Convert each integer-valued lane to an int and return its bits
+    inline type bitsFromInt(type a) {
+        return _mm512_castsi512_ps(_mm512_cvttps_epi32(a));
+    }
+
+    // Round to the nearest integer
+    inline type round(type a) {
+        return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    }
+
+    // Loads and stores that convert to and from compact storage
+    // types. Integer stores round to nearest and saturate.
+    inline type loadU8(const uint8_t *f) {
+        return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)f)));
+    }
+
+    inline type loadU16(const uint16_t *f) {
+        return _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)f)));
+    }
+
+    inline void storeU8(type a, uint8_t *f) {
+        a = _mm512_min_ps(_mm512_max_ps(a, _mm512_setzero_ps()), _mm512_set1_ps(255.0f));
+        _mm_storeu_si128((__m128i *)f, _mm512_cvtepi32_epi8(_mm512_cvtps_epi32(a)));
+    }
+
+    inline void storeU16(type a, uint16_t *f) {
+        a = _mm512_min_ps(_mm512_max_ps(a, _mm512_setzero_ps()), _mm512_set1_ps(65535.0f));
+        _mm256_storeu_si256((__m256i *)f, _mm512_cvtepi32_epi16(_mm512_cvtps_epi32(a)));
+    }
+
+    inline type loadHalf(const uint16_t *f) {
+        return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)f));
+    }
+
+    inline void storeHalf(type a, uint16_t *f) {
+        _mm256_storeu_si256((__m256i *)f, _mm512_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT));
+    }
+}
+
+#include "footer.h"
+
+#endif
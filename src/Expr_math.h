@@ -0,0 +1,243 @@
+#ifndef IMAGESTACK_EXPR_MATH_H
+#define IMAGESTACK_EXPR_MATH_H
+
+#include <float.h>
+
+#include "header.h"
+
+// Vector versions of transcendental functions, used by Lift and Lift2
+// in place of calling the scalar libm function once per lane. They
+// use the range reductions and minimax polynomials of Cephes, built
+// from the primitives in Expr_avx.h or Expr_sse.h.
+//
+// Maximum error relative to the correctly rounded result, as measured
+// by Math_test.cpp:
+//
+// exp    1 ulp over [-87.3, 88.7]. Results below FLT_MIN flush to zero.
+// log    1 ulp over all positive floats.
+// sin    2 ulp over [-pi, pi]. Over [-8192, 8192] the absolute error
+// cos    is below 1e-7, but near the zeros that can be ~100 ulp.
+// atan2  4 ulp.
+// pow    Computed as exp(b*log(a)), so the error grows with the size
+//        of b*log(a), reaching ~40 ulp near the limits of the float
+//        range.
+//
+// Beyond [-8192, 8192] the argument reduction of sin and cos loses
+// accuracy, as in Cephes. Special values (nan, inf, zero, negative
+// arguments to log and pow) give the same results as libm, except
+// that pow of -0 is never negative.
+
+namespace Vec {
+
+    inline type abs(type a) {
+        return andBits(a, broadcastBits(0x7fffffff));
+    }
+
+    // The sign bit of each lane
+    inline type signBit(type a) {
+        return andBits(a, broadcastBits(0x80000000));
+    }
+
+    // The compiler is free to reassociate float math under
+    // -ffast-math, which would undo the extended precision argument
+    // reductions below. Passing a value through here pins down the
+    // order of evaluation.
+    inline type keep(type a) {
+#ifdef __GNUC__
+        __asm__("" : "+x"(a));
+#endif
+        return a;
+    }
+
+    // 2^n for integer-valued n in [-126, 127]
+    inline type pow2(type n) {
+        return bitsFromInt(Mul::vec(Add::vec(n, broadcast(127)), broadcast(1 << 23)));
+    }
+
+    inline type exp(type x) {
+        const type maxX = broadcast(88.72283905206835f);
+        const type minX = broadcast(-87.33654475055310898657f);
+        type in = x;
+        x = Min::vec(Max::vec(x, minX), maxX);
+
+        // x = n*log(2) + r, with log(2) split in two so that n*C1 is exact
+        type n = round(Mul::vec(x, broadcast(1.44269504088896341f)));
+        x = keep(Sub::vec(x, Mul::vec(n, broadcast(0.693359375f))));
+        x = Add::vec(x, Mul::vec(n, broadcast(2.12194440e-4f)));
+
+        type z = Mul::vec(x, x);
+        type y = broadcast(1.9875691500E-4f);
+        y = mulAdd(y, x, broadcast(1.3981999507E-3f));
+        y = mulAdd(y, x, broadcast(8.3334519073E-3f));
+        y = mulAdd(y, x, broadcast(4.1665795894E-2f));
+        y = mulAdd(y, x, broadcast(1.6666665459E-1f));
+        y = mulAdd(y, x, broadcast(5.0000001201E-1f));
+        y = Add::vec(mulAdd(y, z, x), broadcast(1));
+
+        // n can be 128 at the top of the range, which doesn't fit in
+        // the exponent bits, so fold the extra factor of two into y
+        type capped = Min::vec(n, broadcast(127));
+        y = mulAdd(y, Sub::vec(n, capped), y);
+        y = Mul::vec(y, pow2(capped));
+
+        y = blend(y, broadcast(INFINITY), GT::vec(in, maxX));
+        y = blend(y, zero(), LT::vec(in, minX));
+        // nan propagates through the comparisons above as false
+        return blend(y, in, NEQ::vec(in, in));
+    }
+
+    inline type log(type x) {
+        type in = x;
+
+        // Scale denormals up into the normal range
+        type denormal = LT::vec(x, broadcast(FLT_MIN));
+        x = blend(x, Mul::vec(x, broadcast(8388608.0f)), denormal);
+
+        // x = m * 2^e, with m in [0.5, 1)
+        type e = Mul::vec(intFromBits(andBits(x, broadcastBits(0x7f800000))),
+                          broadcast(1.0f / (1 << 23)));
+        e = Sub::vec(e, broadcast(126));
+        e = Sub::vec(e, andBits(denormal, broadcast(23)));
+        type m = orBits(andBits(x, broadcastBits(0x007fffff)), broadcast(0.5f));
+
+        // Shift m into [sqrt(1/2) - 1, sqrt(2) - 1]
+        type small = LT::vec(m, broadcast(0.707106781186547524f));
+        e = Sub::vec(e, andBits(small, broadcast(1)));
+        m = Sub::vec(Add::vec(m, andBits(small, m)), broadcast(1));
+
+        type z = Mul::vec(m, m);
+        type y = broadcast(7.0376836292E-2f);
+        y = mulAdd(y, m, broadcast(-1.1514610310E-1f));
+        y = mulAdd(y, m, broadcast(1.1676998740E-1f));
+        y = mulAdd(y, m, broadcast(-1.2420140846E-1f));
+        y = mulAdd(y, m, broadcast(1.4249322787E-1f));
+        y = mulAdd(y, m, broadcast(-1.6668057665E-1f));
+        y = mulAdd(y, m, broadcast(2.0000714765E-1f));
+        y = mulAdd(y, m, broadcast(-2.4999993993E-1f));
+        y = mulAdd(y, m, broadcast(3.3333331174E-1f));
+        y = Mul::vec(Mul::vec(y, m), z);
+
+        y = keep(mulAdd(e, broadcast(-2.12194440e-4f), y));
+        y = keep(mulAdd(z, broadcast(-0.5f), y));
+        y = keep(Add::vec(m, y));
+        y = mulAdd(e, broadcast(0.693359375f), y);
+
+        // inf and nan map to themselves
+        y = blend(y, in, NEQ::vec(Sub::vec(in, in), zero()));
+        y = blend(y, broadcast(-INFINITY), EQ::vec(in, zero()));
+        return blend(y, broadcast(NAN), LT::vec(in, zero()));
+    }
+
+    // Reduce x to r in [-pi/4, pi/4], and the quadrant k in {0, 1, 2, 3}
+    // such that |x| = r + k*pi/2 (mod 2*pi)
+    inline void reduceTrig(type x, type &r, type &k) {
+        x = abs(x);
+        type q = round(Mul::vec(x, broadcast(0.636619772367581f)));
+        // q mod 4, using round because floor is slow without SSE4.1
+        type q4 = round(mulAdd(q, broadcast(0.25f), broadcast(-0.375f)));
+        k = Sub::vec(q, Mul::vec(q4, broadcast(4)));
+
+        // Extended precision modular arithmetic
+        x = keep(Sub::vec(x, Mul::vec(q, broadcast(1.5703125f))));
+        x = keep(Sub::vec(x, Mul::vec(q, broadcast(4.837512969970703125e-4f))));
+        r = Sub::vec(x, Mul::vec(q, broadcast(7.54978995489188216e-8f)));
+    }
+
+    inline type sinPoly(type r) {
+        type z = Mul::vec(r, r);
+        type y = broadcast(-1.9515295891E-4f);
+        y = mulAdd(y, z, broadcast(8.3321608736E-3f));
+        y = mulAdd(y, z, broadcast(-1.6666654611E-1f));
+        return mulAdd(Mul::vec(y, z), r, r);
+    }
+
+    inline type cosPoly(type r) {
+        type z = Mul::vec(r, r);
+        type y = broadcast(2.443315711809948E-005f);
+        y = mulAdd(y, z, broadcast(-1.388731625493765E-003f));
+        y = mulAdd(y, z, broadcast(4.166664568298827E-002f));
+        y = Mul::vec(Mul::vec(y, z), z);
+        return Add::vec(mulAdd(z, broadcast(-0.5f), y), broadcast(1));
+    }
+
+    // sin(r + k*pi/2), negated if the sign bit is set in flip
+    inline type trig(type r, type k, type flip) {
+        // Odd quadrants use the other polynomial
+        type swap = orBits(EQ::vec(k, broadcast(1)), EQ::vec(k, broadcast(3)));
+        type y = blend(sinPoly(r), cosPoly(r), swap);
+        // The lower half plane is negated
+        type negate = GE::vec(k, broadcast(2));
+        flip = xorBits(flip, andBits(negate, broadcastBits(0x80000000)));
+        return xorBits(y, flip);
+    }
+
+    inline type sin(type x) {
+        type r, k;
+        reduceTrig(x, r, k);
+        return trig(r, k, signBit(x));
+    }
+
+    inline type cos(type x) {
+        type r, k;
+        reduceTrig(x, r, k);
+        // cos(x) = sin(|x| + pi/2)
+        k = Add::vec(k, broadcast(1));
+        k = blend(k, zero(), EQ::vec(k, broadcast(4)));
+        return trig(r, k, zero());
+    }
+
+    // atan(lo/hi) for 0 <= lo <= hi
+    inline type atanUnit(type lo, type hi) {
+        // Reduce to [0, tan(pi/8)] using atan(t) = pi/4 + atan((t-1)/(t+1))
+        type big = GT::vec(lo, Mul::vec(hi, broadcast(0.4142135623730950f)));
+        type x = Div::vec(blend(lo, Sub::vec(lo, hi), big), blend(hi, Add::vec(lo, hi), big));
+        type z = Mul::vec(x, x);
+        type y = broadcast(8.05374449538e-2f);
+        y = mulAdd(y, z, broadcast(-1.38776856032E-1f));
+        y = mulAdd(y, z, broadcast(1.99777106478E-1f));
+        y = mulAdd(y, z, broadcast(-3.33329491539E-1f));
+        y = mulAdd(Mul::vec(y, z), x, x);
+        return Add::vec(y, andBits(big, broadcast((float)M_PI_4)));
+    }
+
+    inline type atan2(type y, type x) {
+        type ax = abs(x), ay = abs(y);
+        type hi = Max::vec(ax, ay), lo = Min::vec(ax, ay);
+        type a = atanUnit(lo, hi);
+        a = blend(a, zero(), EQ::vec(hi, zero()));
+        // Both infinite gives pi/4 in the first octant
+        type bothInf = andBits(EQ::vec(ax, broadcast(INFINITY)), EQ::vec(ay, broadcast(INFINITY)));
+        a = blend(a, broadcast((float)M_PI_4), bothInf);
+        // Unfold the octants
+        a = blend(a, Sub::vec(broadcast((float)M_PI_2), a), GT::vec(ay, ax));
+        // Test the sign bit rather than x < 0, so that -0 counts as negative
+        type negative = LT::vec(orBits(signBit(x), broadcast(1)), zero());
+        a = blend(a, Sub::vec(broadcast((float)M_PI), a), negative);
+        a = xorBits(a, signBit(y));
+        // nan in either argument gives nan
+        type nan = orBits(NEQ::vec(x, x), NEQ::vec(y, y));
+        return blend(a, broadcast(NAN), nan);
+    }
+
+    inline type pow(type a, type b) {
+        type r = exp(Mul::vec(b, log(abs(a))));
+
+        // A negative base is only defined for integer exponents, and
+        // odd ones flip the sign. Floats this large are all even
+        // integers, and clamping keeps them in range of round.
+        type bc = Min::vec(Max::vec(b, broadcast(-(1 << 30))), broadcast(1 << 30));
+        type half = Mul::vec(bc, broadcast(0.5f));
+        type integer = EQ::vec(round(bc), bc);
+        type odd = andBits(integer, NEQ::vec(round(half), half));
+        type negative = LT::vec(a, zero());
+        r = xorBits(r, andBits(andBits(negative, odd), broadcastBits(0x80000000)));
+        r = blend(r, broadcast(NAN), andNotBits(integer, negative));
+
+        // x^0 is 1, even for nan x, and 1^y is 1, even for nan y
+        type one = orBits(EQ::vec(b, zero()), EQ::vec(a, broadcast(1)));
+        return blend(r, broadcast(1), one);
+    }
+}
+
+#include "footer.h"
+#endif
@@ -135,6 +135,53 @@ namespace Scalar {
             return make_pair(scalar_f(a.first), scalar_f(a.second));
         }
     };
+
+    // Conversions to and from the bits of an IEEE half-precision
+    // float, for targets without hardware support
+    inline float halfToFloat(uint16_t h) {
+        uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+        uint32_t exponent = (h >> 10) & 0x1f;
+        uint32_t mantissa = h & 0x3ff;
+        union {
+            uint32_t i;
+            float f;
+        } v;
+        if (exponent == 0x1f) {
+            // Inf or nan
+            v.i = sign | 0x7f800000 | (mantissa << 13);
+        } else if (exponent == 0) {
+            // Zero or denormal
+            v.f = mantissa * (1.0f / (1 << 24));
+            v.i |= sign;
+        } else {
+            v.i = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        }
+        return v.f;
+    }
+
+    inline uint16_t floatToHalf(float f) {
+        union {
+            uint32_t i;
+            float f;
+        } v;
+        v.f = f;
+        uint32_t sign = (v.i >> 16) & 0x8000;
+        uint32_t bits = v.i & 0x7fffffff;
+        if (bits >= 0x7f800000) {
+            // Inf or nan
+            return sign | 0x7c00 | (bits > 0x7f800000 ? 0x200 : 0);
+        } else if (bits >= 0x477ff000) {
+            // Too large, so round to inf
+            return sign | 0x7c00;
+        } else if (bits < 0x38800000) {
+            // Too small to be normal, so make a denormal
+            v.i = bits;
+            return sign | (uint16_t)rintf(v.f * (1 << 24));
+        }
+        // Rebias the exponent and round the mantissa to nearest even
+        bits += 0xc8000fff + ((bits >> 13) & 1);
+        return sign | (bits >> 13);
+    }
 }
 
 #include "footer.h"
@@ -94,6 +94,36 @@ namespace Vec {
     inline void store(type a, float *f) {
         *f = a;
     }
+
+    inline type gather(const float *f, int stride) {
+        return *f;
+    }
+
+    // Loads and stores that convert to and from compact storage
+    // types. Integer stores round to nearest and saturate.
+    inline type loadU8(const uint8_t *f) {
+        return *f;
+    }
+
+    inline type loadU16(const uint16_t *f) {
+        return *f;
+    }
+
+    inline type loadHalf(const uint16_t *f) {
+        return ImageStack::Scalar::halfToFloat(*f);
+    }
+
+    inline void storeU8(type a, uint8_t *f) {
+        *f = (uint8_t)rintf(std::min(std::max(a, 0.0f), 255.0f));
+    }
+
+    inline void storeU16(type a, uint16_t *f) {
+        *f = (uint16_t)rintf(std::min(std::max(a, 0.0f), 65535.0f));
+    }
+
+    inline void storeHalf(type a, uint16_t *f) {
+        *f = ImageStack::Scalar::floatToHalf(a);
+    }
 }
 
 
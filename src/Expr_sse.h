@@ -41,6 +41,15 @@ namespace Vec {
         static type vec(type a, type b) {return _mm_max_ps(a, b);}
     };
     
+    // a*b + c
+    inline type mulAdd(type a, type b, type c) {
+#ifdef IMAGESTACK_FMA
+        return _mm_fmadd_ps(a, b, c);
+#else
+        return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+    }
+
     // Comparisons
     struct GT : public ImageStack::Scalar::GT {
         static type vec(type a, type b) {return _mm_cmpgt_ps(a, b);}
@@ -73,7 +82,7 @@ namespace Vec {
         return _mm_shuffle_ps(a, a, (3 << 0) | (2 << 2) | (1 << 4) | (0 << 6));
     }
     
-#ifdef __SSE4_1__
+#ifdef IMAGESTACK_SSE4_1
     // Logical ops
     inline type blend(type a, type b, type mask) {
         return _mm_blendv_ps(a, b, mask);
@@ -139,6 +148,107 @@ namespace Vec {
     inline void store(type a, float *f) {
         _mm_storeu_ps(f, a);
     }
+
+    // Load every stride-th float
+    inline type gather(const float *f, int stride) {
+        return _mm_set_ps(f[3*stride], f[2*stride], f[stride], f[0]);
+    }
+
+    // Bitwise ops and conversions between floats and their bits,
+    // used by the transcendental functions in Expr_math.h
+    inline type andBits(type a, type b) {
+        return _mm_and_ps(a, b);
+    }
+
+    inline type orBits(type a, type b) {
+        return _mm_or_ps(a, b);
+    }
+
+    inline type xorBits(type a, type b) {
+        return _mm_xor_ps(a, b);
+    }
+
+    // ~a & b
+    inline type andNotBits(type a, type b) {
+        return _mm_andnot_ps(a, b);
+    }
+
+    // A vector with every lane holding the given bit pattern
+    inline type broadcastBits(uint32_t bits) {
+        return _mm_castsi128_ps(_mm_set1_epi32((int)bits));
+    }
+
+    // Interpret the bits of each lane as an int and convert it to float
+    inline type intFromBits(type a) {
+        return _mm_cvtepi32_ps(_mm_castps_si128(a));
+    }
+
+    // Convert each integer-valued lane to an int and return its bits
+    inline type bitsFromInt(type a) {
+        return _mm_castsi128_ps(_mm_cvttps_epi32(a));
+    }
+
+    // Round to the nearest integer. Only valid within the range of
+    // an int, which is all Expr_math.h needs.
+    inline type round(type a) {
+        return _mm_cvtepi32_ps(_mm_cvtps_epi32(a));
+    }
+
+    // Loads and stores that convert to and from compact storage
+    // types. Integer stores round to nearest and saturate.
+    inline type loadU8(const uint8_t *f) {
+        int32_t bytes;
+        memcpy(&bytes, f, sizeof(bytes));
+        __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), _mm_setzero_si128());
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+    }
+
+    inline type loadU16(const uint16_t *f) {
+        __m128i v = _mm_loadl_epi64((const __m128i *)f);
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+    }
+
+    inline void storeU8(type a, uint8_t *f) {
+        a = _mm_min_ps(_mm_max_ps(a, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+        __m128i v = _mm_cvtps_epi32(a);
+        v = _mm_packs_epi32(v, v);
+        int32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+        memcpy(f, &bytes, sizeof(bytes));
+    }
+
+    inline void storeU16(type a, uint16_t *f) {
+        // Shift into the signed range so we can use the signed pack
+        a = _mm_min_ps(_mm_max_ps(a, _mm_setzero_ps()), _mm_set1_ps(65535.0f));
+        __m128i v = _mm_cvtps_epi32(_mm_sub_ps(a, _mm_set1_ps(32768.0f)));
+        v = _mm_packs_epi32(v, v);
+        _mm_storel_epi64((__m128i *)f, _mm_xor_si128(v, _mm_set1_epi16((short)0x8000)));
+    }
+
+#ifdef IMAGESTACK_F16C
+    inline type loadHalf(const uint16_t *f) {
+        return _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)f));
+    }
+
+    inline void storeHalf(type a, uint16_t *f) {
+        _mm_storel_epi64((__m128i *)f, _mm_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT));
+    }
+#else
+    inline type loadHalf(const uint16_t *f) {
+        using namespace ImageStack::Scalar;
+        return set(halfToFloat(f[0]), halfToFloat(f[1]), halfToFloat(f[2]), halfToFloat(f[3]));
+    }
+
+    inline void storeHalf(type a, uint16_t *f) {
+        union {
+            float f[width];
+            type v;
+        } v;
+        v.v = a;
+        for (int i = 0; i < width; i++) {
+            f[i] = ImageStack::Scalar::floatToHalf(v.f[i]);
+        }
+    }
+#endif
 }
 
 #include "footer.h"
@@ -5,9 +5,12 @@
 #include "Arithmetic.h"
 #include "Statistics.h"
 #include "Filter.h"
+#include "Geometry.h"
+#include "PackedImage.h"
+#include <exception>
+#include <set>
 #include "header.h"
 
-namespace {
 // used for picking file formats
 bool suffixMatch(string filename, string suffix) {
     if (suffix.size() > filename.size()) { return false; }
@@ -18,15 +21,7 @@ bool suffixMatch(string filename, string suffix) {
     return true;
 }
 
-
-struct TempFile {
-    string name;
-    TempFile() : name("_test") {}
-    TempFile(string name_) : name(name_) {}
-    ~TempFile() {
-        remove(name.c_str());
-    }
-};
+namespace {
 
 // Used to help testing. Saves and loads and checks the result is what you saved.
 bool testFormat(Image im, string fmt) {
@@ -38,6 +33,44 @@ bool testFormat(Image im, string fmt) {
     return nearlyEqual(im, b);
 }
 
+// Calls f(i) for each of n files, several at once if parallel is
+// set. Once all are done, rethrows the error of the first one that
+// failed, as a loop over them would have. Nothing may escape the
+// parallel loop itself.
+template<typename F>
+void forEachFile(int n, F f, bool parallel = true) {
+    vector<std::exception_ptr> errors(n);
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1) if (parallel)
+#endif
+    for (int i = 0; i < n; i++) {
+        try {
+            f(i);
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (errors[i]) std::rethrow_exception(errors[i]);
+    }
+}
+
+// The filenames given by a printf style pattern for 0 to n-1
+vector<string> patternNames(string pattern, int n) {
+    vector<string> names(n);
+    for (int i = 0; i < n; i++) {
+        char filename[4096];
+        snprintf(filename, 4096, pattern.c_str(), i);
+        names[i] = filename;
+    }
+    return names;
+}
+
+// Whether the names are all different, so that they can be written at once
+bool allDistinct(const vector<string> &names) {
+    return std::set<string>(names.begin(), names.end()).size() == names.size();
+}
+
 
 };
 
@@ -48,6 +81,8 @@ void Load::help() {
     printf("\n");
     FileTMP::help();
     printf("\n");
+    FileTiles::help();
+    printf("\n");
     FileHDR::help();
     printf("\n");
     FileJPG::help();
@@ -70,7 +105,19 @@ void Load::help() {
     printf("\n");
     FilePBA::help();
     printf("\n");
-    printf("Usage: ImageStack -load foo.jpg\n\n");
+    pprintf("When loading a .tmp file, an optional second argument of \"shared\""
+            " writes any edits to the image back to the file, and \"copy\""
+            " reads the file into memory rather than mapping it.\n\n");
+    pprintf("When loading a .jpg file, an optional second argument of 2, 4, or 8"
+            " decodes it at that fraction of its size, which is several times"
+            " faster than decoding it whole. The result is close to, but not the"
+            " same as, -downsample. Given a width and height instead, it decodes"
+            " at the smallest such fraction that is at least that size. A load of"
+            " a .jpg followed by -downsample by 2, 4, or 8, or by -resample to"
+            " a fixed size, does this automatically.\n\n");
+    printf("Usage: ImageStack -load foo.jpg\n"
+           "       ImageStack -load foo.tmp shared\n"
+           "       ImageStack -load foo.jpg -resample 160 120 -save thumb.jpg\n\n");
 }
 
 bool Load::test() {
@@ -81,12 +128,76 @@ bool Load::test() {
     Quantize::apply(a, 1.0/256);
 
     testFormat(a, "tmp");
+    if (!testFormat(a, "tiles")) return false;
+
+    // Mapped tmp files: private edits stay private, shared edits land
+    // in the file, and saving over a mapped file leaves the mapping
+    // intact
+    {
+        TempFile t("_test.tmp");
+        Save::apply(a, t.name);
+        Image priv = FileTMP::load(t.name, FileTMP::MapPrivate);
+        priv(0, 0, 0, 0) = 7;
+        if (FileTMP::load(t.name, FileTMP::Read)(0, 0, 0, 0) != a(0, 0, 0, 0)) return false;
+        Image shared = FileTMP::load(t.name, FileTMP::MapShared);
+        shared(1, 0, 0, 0) = 7;
+        if (FileTMP::load(t.name, FileTMP::Read)(1, 0, 0, 0) != 7) return false;
+        shared(1, 0, 0, 0) = a(1, 0, 0, 0);
+        if (!nearlyEqual(a, shared)) return false;
+        Image copy = priv.copy();
+        Save::apply(a * 2, t.name);
+        if (!nearlyEqual(priv, copy)) return false;
+        if (!nearlyEqual(FileTMP::load(t.name), a * 2)) return false;
+    }
 
-    // tmp is the only multi-frame format, so now we switch to a single frame
+    // Bytes after the data in a tmp file are ignored, and mustn't be
+    // mapped over whatever follows the image in memory
+    {
+        TempFile t("_test.tmp");
+        Image small = a.region(0, 0, 0, 0, 4, 4, 1, 1).copy();
+        Save::apply(small, t.name);
+        FILE *f = fopen(t.name.c_str(), "ab");
+        vector<char> junk(1 << 20, 1);
+        for (int i = 0; i < 16; i++) {
+            fwrite(&junk[0], 1, junk.size(), f);
+        }
+        fclose(f);
+        Image loaded = FileTMP::load(t.name);
+        Image other(1000, 1000, 1, 1);
+        other.set(3);
+        if (!nearlyEqual(loaded, small)) return false;
+    }
+
+    // tmp and tiles are the only multi-frame formats, so now we switch to a single frame
     a = a.frame(0);
 
 #ifndef NO_JPG
     if (!testFormat(a, "jpg")) return false;
+
+    // Decoding a jpeg at a fraction of its size should be close to
+    // decoding it whole and downsampling
+    {
+        TempFile t("_test.jpg");
+        Save::apply(GaussianBlur::apply(a, 2, 2, 0), t.name, "100");
+        Image whole = Load::apply(t.name);
+        for (int shrink = 2; shrink <= 8; shrink *= 2) {
+            Image small = FileJPG::load(t.name, Image(), shrink);
+            Image diff = small - Downsample::apply(whole, shrink, shrink);
+            Abs::apply(diff);
+            if (Stats(diff).mean() > 0.01) return false;
+        }
+        Image fit = FileJPG::loadAtLeast(t.name, 40, 50);
+        if (fit.width != 61 || fit.height != 117) return false;
+
+        // The fusion only happens for sizes given as numbers
+        vector<string> args(1, t.name), next;
+        next.push_back("-downsample");
+        next.push_back("4");
+        if (!fuse(args, next) || args.size() != 2 || args[1] != "4") return false;
+        args.resize(1);
+        next[1] = "width/4";
+        if (fuse(args, next) || args.size() != 1) return false;
+    }
 #endif
 #ifndef NO_PNG
     if (!testFormat(a, "png")) return false;
@@ -120,14 +231,63 @@ bool Load::test() {
 }
 
 void Load::parse(vector<string> args) {
-    assert(args.size() == 1, "-load takes exactly 1 argument\n");
+    if (args.size() > 1 && (suffixMatch(args[0], ".jpg") || suffixMatch(args[0], ".jpeg"))) {
+        if (args.size() == 2) {
+            push(FileJPG::load(args[0], Image(), readInt(args[1])));
+        } else {
+            assert(args.size() == 3, "-load takes 1, 2, or 3 arguments for a .jpg\n");
+            push(FileJPG::loadAtLeast(args[0], readInt(args[1]), readInt(args[2])));
+        }
+        return;
+    }
+    if (args.size() == 2) {
+        assert(suffixMatch(args[0], ".tmp"),
+               "Only .tmp files take a second argument to -load\n");
+        if (args[1] == "shared") {
+            push(FileTMP::load(args[0], FileTMP::MapShared));
+        } else if (args[1] == "copy") {
+            push(FileTMP::load(args[0], FileTMP::Read));
+        } else {
+            panic("Unknown mode for loading a .tmp file: %s\n", args[1].c_str());
+        }
+        return;
+    }
+    assert(args.size() == 1, "-load takes 1 or 2 arguments\n");
     push(apply(args[0]));
 }
 
+bool Load::fuse(vector<string> &args, vector<string> next) {
+    if (args.size() != 1 || next.size() < 2 ||
+        !(suffixMatch(args[0], ".jpg") || suffixMatch(args[0], ".jpeg"))) {
+        return false;
+    }
+    // The sizes may be expressions of the image being loaded, so
+    // only plain numbers are taken
+    for (size_t i = 1; i < next.size(); i++) {
+        for (size_t j = 0; j < next[i].size(); j++) {
+            if (!isdigit(next[i][j])) { return false; }
+        }
+    }
+
+    if (next[0] == "-downsample" &&
+        (next.size() == 2 || (next.size() == 3 && next[1] == next[2])) &&
+        (next[1] == "2" || next[1] == "4" || next[1] == "8")) {
+        // Decode at the smaller size instead
+        args.push_back(next[1]);
+        return true;
+    } else if (next[0] == "-resample" && next.size() == 3) {
+        // Decode at a size between the two, and let -resample do the rest
+        args.push_back(next[1]);
+        args.push_back(next[2]);
+    }
+    return false;
+}
 
 Image Load::apply(string filename) {
     if (suffixMatch(filename, ".tmp")) {
         return FileTMP::load(filename);
+    } else if (suffixMatch(filename, ".tiles")) {
+        return FileTiles::load(filename);
     } else if (suffixMatch(filename, ".hdr")) {
         return FileHDR::load(filename);
     } else if (suffixMatch(filename, ".jpg") ||
@@ -161,6 +321,23 @@ Image Load::apply(string filename) {
     return Image();
 }
 
+void Load::apply(string filename, Image into) {
+    if (suffixMatch(filename, ".jpg") ||
+        suffixMatch(filename, ".jpeg")) {
+        FileJPG::load(filename, into);
+    } else if (suffixMatch(filename, ".png")) {
+        FilePNG::load(filename, into);
+    } else {
+        Image im = apply(filename);
+        assert(im.width == into.width && im.height == into.height &&
+               im.frames == into.frames && im.channels == into.channels,
+               "%s is %dx%dx%dx%d, but %dx%dx%dx%d was expected\n",
+               filename.c_str(), im.width, im.height, im.frames, im.channels,
+               into.width, into.height, into.frames, into.channels);
+        into.set(im);
+    }
+}
+
 void LoadFrames::help() {
     printf("\n-loadframes accepts a sequence of images and loads them as the frames of a\n"
            "single stack entry. See the help for -load for details on file formats.\n\n"
@@ -184,7 +361,26 @@ bool LoadFrames::test() {
     filenames.push_back(f2.name);
     filenames.push_back(f3.name);
     Image b = LoadFrames::apply(filenames);
-    return nearlyEqual(a, b);
+    if (!nearlyEqual(a, b)) return false;
+
+    // A file of the wrong size, or a missing one, is reported once
+    // the others have loaded
+    TempFile f4(prefix + "3.jpg");
+    Save::apply(a.frame(0).region(0, 0, 0, 0, 100, 100, 1, 3), f4.name);
+    filenames.push_back(f4.name);
+    filenames.push_back(prefix + "missing.jpg");
+    try {
+        LoadFrames::apply(filenames);
+        return false;
+    } catch (Exception &e) {
+        if (!strstr(e.message, f4.name.c_str())) return false;
+    }
+
+    // A pattern that names the same file each time saves the frames in
+    // order, so the last one wins
+    TempFile same(prefix + "same.tmp");
+    SaveFrames::apply(a, same.name);
+    return nearlyEqual(Load::apply(same.name), a.frame(2));
 }
 
 void LoadFrames::parse(vector<string> args) {
@@ -195,21 +391,16 @@ void LoadFrames::parse(vector<string> args) {
 Image LoadFrames::apply(vector<string> args) {
     assert(args.size() > 0, "-loadframes requires at least one file argument.\n");
 
+    // The first file gives the size, and the rest are decoded in
+    // parallel straight into their frames
     Image im = Load::apply(args[0]);
     assert(im.frames == 1, "-loadframes can only load many single frame images\n");
-    Image result(im.width, im.height, (int)args.size(), im.channels);
+    Image result(im.width, im.height, (int)args.size(), im.channels, Image::UNINITIALIZED);
     result.frame(0).set(im);
 
-    for (size_t i = 1; i < args.size(); i++) {
-        im = Load::apply(args[i]);
-        // check dimensions and channels match
-        assert(im.frames == 1, "-loadframes can only load many single frame images\n");
-        assert((im.width == result.width) &&
-               (im.height == result.height) &&
-               (im.channels == result.channels),
-               "-loadframes can only load file sequences of matching width, height, and channel count\n");
-        result.frame(i).set(im);
-    }
+    forEachFile((int)args.size() - 1, [&](int i) {
+        Load::apply(args[i+1], result.frame(i+1));
+    });
 
     return result;
 }
@@ -249,19 +440,12 @@ Image LoadChannels::apply(vector<string> args) {
 
     Image im = Load::apply(args[0]);
     assert(im.channels == 1, "-loadchannels can only load many single channel images\n");
-    Image result(im.width, im.height, im.frames, (int)args.size());
+    Image result(im.width, im.height, im.frames, (int)args.size(), Image::UNINITIALIZED);
     result.channel(0).set(im);
 
-    for (size_t i = 1; i < args.size(); i++) {
-        im = Load::apply(args[i]);
-        // check dimensions and channels match
-        assert(im.channels == 1, "-loadchannels can only load many single frame images\n");
-        assert((im.width == result.width) &&
-               (im.height == result.height) &&
-               (im.frames == result.frames),
-               "-loadchannels can only load file sequences of matching size\n");
-        result.channel(i).set(im);
-    }
+    forEachFile((int)args.size() - 1, [&](int i) {
+        Load::apply(args[i+1], result.channel(i+1));
+    });
 
     return result;
 }
@@ -274,6 +458,8 @@ void Save::help() {
     printf("\n");
     FileTMP::help();
     printf("\n");
+    FileTiles::help();
+    printf("\n");
     FileHDR::help();
     printf("\n");
     FileJPG::help();
@@ -304,7 +490,31 @@ void Save::help() {
 }
 
 bool Save::test() {
-    // tested by load
+    // Most formats are tested by load. Here we check that integer
+    // data survives the various storage types of tmp files.
+    Image a(123, 234, 3, 3);
+    Noise::apply(a, 0, 256);
+    Quantize::apply(a, 1);
+
+    const char *types[] = {"uint8", "uint16", "int16", "float16", "float64"};
+    for (int i = 0; i < 5; i++) {
+        printf("%s ", types[i]);
+        fflush(stdout);
+        TempFile t(string("_test") + ".tmp");
+        Save::apply(a, t.name, types[i]);
+        Image b = Load::apply(t.name);
+        if (!nearlyEqual(a, b)) return false;
+    }
+    printf("\n");
+
+    // The same compact types are available in memory
+    a /= 255;
+    if (!nearlyEqual(a, Image(PackedImage<uint8_t>(a)))) return false;
+    if (!nearlyEqual(a, Image(PackedImage<uint16_t>(a)))) return false;
+    if (!nearlyEqual(a, Image(PackedImage<Half>(a)))) return false;
+    // and start out zero, like an Image
+    Stats s(Image(PackedImage<uint16_t>(a.width, a.height, a.frames, a.channels)));
+    if (s.minimum() != 0 || s.maximum() != 0) return false;
     return true;
 }
 
@@ -319,6 +529,9 @@ void Save::apply(Image im, string filename, string arg) {
     if (suffixMatch(filename, ".tmp")) {
         if (arg == "") { arg = "float32"; }
         FileTMP::save(im, filename, arg);
+    } else if (suffixMatch(filename, ".tiles")) {
+        if (arg == "") { arg = "float32"; }
+        FileTiles::save(im, filename, arg);
     } else if (suffixMatch(filename, ".hdr")) {
         FileHDR::save(im, filename);
     } else if (suffixMatch(filename, ".jpg") ||
@@ -388,12 +601,11 @@ void SaveFrames::parse(vector<string> args) {
 #endif
 
 void SaveFrames::apply(Image im, string pattern, string arg) {
-    char filename[4096];
-
-    for (int t = 0; t < im.frames; t++) {
-        snprintf(filename, 4096, pattern.c_str(), t);
-        Save::apply(im.frame(t), filename, arg);
-    }
+    // A pattern that repeats names is saved in order, as a loop would
+    vector<string> names = patternNames(pattern, im.frames);
+    forEachFile(im.frames, [&](int t) {
+        Save::apply(im.frame(t), names[t], arg);
+    }, allDistinct(names));
 }
 
 void SaveChannels::help() {
@@ -420,16 +632,14 @@ void SaveChannels::parse(vector<string> args) {
 }
 
 void SaveChannels::apply(Image im, string pattern, string arg) {
-    char filename[4096];
-
-    for (int c = 0; c < im.channels; c++) {
-        snprintf(filename, 4096, pattern.c_str(), c);
-        Save::apply(im.channel(c), filename, arg);
-    }
+    vector<string> names = patternNames(pattern, im.channels);
+    forEachFile(im.channels, [&](int c) {
+        Save::apply(im.channel(c), names[c], arg);
+    }, allDistinct(names));
 }
 
 void LoadBlock::help() {
-    pprintf("-loadblock loads a rectangular portion of a .tmp file. It is roughly"
+    pprintf("-loadblock loads a rectangular portion of a .tmp or .tiles file. It is roughly"
             " equivalent to a load followed by a crop, except that the file need not"
             " fit in memory. The nine arguments are filename, x, y, t, and c offsets"
             " within the file, then width, height, frames, and channels. If seven"
@@ -437,7 +647,10 @@ void LoadBlock::help() {
             " given, all frames are used and the arguments specify x and y. If three"
             " arguments are given, they specify frames and all x, y, and channels"
             " are loaded. Loading out of bounds from the tmp file is"
-            " permitted. Undefined areas will be zero-filled.\n\n"
+            " permitted. Undefined areas will be zero-filled. A .tmp file is read a"
+            " scanline at a time, while a .tiles file is read a tile at a time,"
+            " which is much faster for blocks spanning many rows, frames, or"
+            " channels.\n\n"
             "This example multiplies a 512x512x128x3 volume by two, without ever loading it\n"
             "all into memory:\n"
             "ImageStack -loadblock foo.tmp 0 0 0 0 512 512 64 3 \\\n"
@@ -453,20 +666,63 @@ bool LoadBlock::test() {
     Noise::apply(a, 0, 1);
     FastBlur::apply(a, 1, 1, 1);
 
-    TempFile f(string("_test") + ".tmp");
+    const char *suffixes[] = {".tmp", ".tiles"};
+    for (int i = 0; i < 2; i++) {
+        TempFile f(string("_test") + suffixes[i]);
 
-    CreateTmp::apply(f.name, 234, 342, 5, 5);
+        CreateTmp::apply(f.name, 234, 342, 5, 5);
 
-    SaveBlock::apply(a, f.name, 4, 3, 2, 1);
+        SaveBlock::apply(a, f.name, 4, 3, 2, 1);
 
-    // Check the saved region is correct
-    Image b = LoadBlock::apply(f.name, 4, 3, 2, 1, 123, 234, 3, 3);
-    if (!nearlyEqual(a, b)) return false;
+        // Check the saved region is correct
+        Image b = LoadBlock::apply(f.name, 4, 3, 2, 1, 123, 234, 3, 3);
+        if (!nearlyEqual(a, b)) return false;
+
+        // Check other regions are zero
+        b = LoadBlock::apply(f.name, 130, 0, 0, 0, 50, 50, 5, 5);
+        Stats s(b);
+        if (s.mean() != 0 || s.variance() != 0) return false;
+    }
 
-    // Check other regions are zero
-    b = LoadBlock::apply(f.name, 130, 0, 0, 0, 50, 50, 5, 5);
-    Stats s(b);
-    return (s.mean() == 0 && s.variance() == 0);
+    // Stream through a compressed tiled file of integers, with tiles
+    // and blocks that don't divide it evenly
+    Image q = a * 1000;
+    Quantize::apply(q, 1);
+    TempFile f(string("_test") + ".tiles");
+    {
+        FileTiles::TiledFile file(f.name, 123, 234, 3, 3, "uint16", true, 50, 40, 2, 2);
+        file.write(q, 0, 0, 0, 0);
+        for (FileTiles::TiledFile::Iterator it(file, 30, 70, 1, 3); !it.done(); it.next()) {
+            Image block = it.read();
+            if (!nearlyEqual(block, q.region(it.x, it.y, it.t, it.c,
+                                             it.width, it.height, it.frames, it.channels))) {
+                return false;
+            }
+            it.write(block * 2);
+        }
+    }
+    if (!nearlyEqual(Load::apply(f.name), q * 2)) return false;
+
+    // Tiles that grow and shrink again should reuse the space they
+    // leave behind, even across reopening the file
+    Image flat(123, 234, 3, 3);
+    flat.set(1);
+    long sizes[2];
+    for (int i = 0; i < 2; i++) {
+        {
+            FileTiles::TiledFile file(f.name);
+            file.write(flat, 0, 0, 0, 0);
+        }
+        {
+            FileTiles::TiledFile file(f.name);
+            file.write(q, 0, 0, 0, 0);
+        }
+        FILE *fp = fopen(f.name.c_str(), "rb");
+        fseek(fp, 0, SEEK_END);
+        sizes[i] = ftell(fp);
+        fclose(fp);
+    }
+    return sizes[1] == sizes[0] && nearlyEqual(Load::apply(f.name), q);
 }
 
 void LoadBlock::parse(vector<string> args) {
@@ -515,6 +771,15 @@ void fread_(void *ptr, size_t size, size_t n, FILE *f) {
 
 Image LoadBlock::apply(string filename, int xoff, int yoff, int toff, int coff,
                        int width, int height, int frames, int channels) {
+    if (suffixMatch(filename, ".tiles")) {
+        FileTiles::TiledFile in(filename);
+        if (width    <= 0) { width    = in.width; }
+        if (height   <= 0) { height   = in.height; }
+        if (frames   <= 0) { frames   = in.frames; }
+        if (channels <= 0) { channels = in.channels; }
+        return in.read(xoff, yoff, toff, coff, width, height, frames, channels);
+    }
+
     // peek in the header
 
     struct {
@@ -580,7 +845,7 @@ Image LoadBlock::apply(string filename, int xoff, int yoff, int toff, int coff,
 
 
 void SaveBlock::help() {
-    pprintf("-saveblock overwrites a rectangular subblock of a .tmp file with the"
+    pprintf("-saveblock overwrites a rectangular subblock of a .tmp or .tiles file with the"
             " top of the stack. It is logically similar to a load, paste, save"
             " combination, but never loads the full tmp file. The five arguments are"
             " the filename, followed by the offset at which to paste the volume in"
@@ -624,6 +889,15 @@ void SaveBlock::parse(vector<string> args) {
 }
 
 void SaveBlock::apply(Image im, string filename, int xoff, int yoff, int toff, int coff) {
+    if (suffixMatch(filename, ".tiles")) {
+        FileTiles::TiledFile out(filename);
+        out.write(im, xoff, yoff, toff, coff);
+        return;
+    }
+
+    // We write whole scanlines at a time
+    im = im.toLayout(Image::PLANAR);
+
     // Peek in the header
     struct {
         int width, height, frames, channels, type;
@@ -677,11 +951,12 @@ void SaveBlock::apply(Image im, string filename, int xoff, int yoff, int toff, i
 
 
 void CreateTmp::help() {
-    pprintf("-createtmp creates a zero filled floating point .tmp file of the specified"
-            " dimensions. It can be used to create tmp files larger than can fit in"
-            " memory. The five arguments are the filename, width, height, frames and"
-            " channels. If only four arguments are specified, frames is assumed to"
-            " be one.\n\n"
+    pprintf("-createtmp creates a zero filled floating point .tmp or .tiles file of the"
+            " specified dimensions. It can be used to create files larger than can fit"
+            " in memory. A .tiles file is created instantly and only grows as"
+            " non-zero blocks are saved to it. The five arguments are the filename,"
+            " width, height, frames and channels. If only four arguments are"
+            " specified, frames is assumed to be one.\n\n"
             "The following example creates a giant volume, and fills some of it with noise:\n"
             "ImageStack -createtmp volume.tmp 1024 1024 1024 1 \\\n"
             "           -push 256 256 256 1 -noise \\\n"
@@ -717,6 +992,10 @@ void CreateTmp::apply(string filename, int width, int height, int frames, int ch
     assert(frames > 0 && width > 0 && height > 0 && channels > 0,
            "Some of the specified dimensions are less than 1\n");
 
+    if (suffixMatch(filename, ".tiles")) {
+        FileTiles::TiledFile out(filename, width, height, frames, channels);
+        return;
+    }
 
     FILE *f = fopen(filename.c_str(), "wb");
     assert(f, "Could not open/create file %s\n", filename.c_str());
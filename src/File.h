@@ -2,12 +2,29 @@
 #define IMAGESTACK_FILE_H
 #include "header.h"
 
+// Check the extension of a filename, ignoring case
+bool suffixMatch(string filename, string suffix);
+
+// A file used by a test, which is deleted when this goes out of scope
+struct TempFile {
+    string name;
+    TempFile() : name("_test") {}
+    TempFile(string name_) : name(name_) {}
+    ~TempFile() {
+        remove(name.c_str());
+    }
+};
+
 class Load : public Operation {
 public:
     void help();
     bool test();
     void parse(vector<string> args);
+    bool fuse(vector<string> &args, vector<string> next);
     static Image apply(string filename);
+    // Load a file into an existing image of the same size, such as a
+    // frame of a larger one. Formats that can decode in place do so.
+    static void apply(string filename, Image into);
 };
 
 class LoadFrames : public Operation {
@@ -116,12 +133,20 @@ Image load(string filename);
 namespace FileJPG {
 void help();
 void save(Image im, string filename, int quality);
-Image load(string filename);
+// Decodes into the given image if it is defined, which must be the
+// size of the file, and otherwise into a new one. A shrink of 2, 4,
+// or 8 decodes at that fraction of the size (rounded down) in the
+// DCT domain, which is much faster than decoding it whole.
+Image load(string filename, Image into = Image(), int shrink = 1);
+// Decodes at the smallest of those fractions that is at least the
+// given size
+Image loadAtLeast(string filename, int width, int height);
 }
 
 namespace FilePNG {
 void help();
-Image load(string filename);
+// As FileJPG::load
+Image load(string filename, Image into = Image());
 void save(Image im, string filename);
 }
 
@@ -155,9 +180,107 @@ void save(Image im, string filename);
 }
 
 namespace FileTMP {
+// How float32 files are brought into memory. Mapped files are private
+// copy-on-write views by default; shared ones write edits back to the
+// file; Read copies the data in the old-fashioned way.
+enum Mode {MapPrivate = 0, MapShared, Read};
+// The element types a file may hold, as stored in the header
+enum TypeCode {FLOAT32 = 0, FLOAT64, UINT8, INT8, UINT16, INT16, UINT32, INT32, UINT64, INT64, FLOAT16};
+// Look up a type by any of the names listed in the help
+TypeCode typeCode(string type);
+void help();
+void save(Image im, string filename, string type);
+Image load(string filename, Mode mode = MapPrivate);
+}
+
+namespace FileTiles {
 void help();
 void save(Image im, string filename, string type);
 Image load(string filename);
+
+// Random access to a tiled file on disk. Only the index of tiles is
+// held in memory, and blocks are read and written a tile at a time,
+// so files may be far larger than memory. Not safe to use from
+// several threads at once.
+class TiledFile {
+public:
+    // Open an existing file
+    TiledFile(string filename);
+
+    // Create a new file, which reads as zero until written. Tiles
+    // that are zero take no space. A tile size of zero picks a
+    // default.
+    TiledFile(string filename, int w, int h, int f, int c,
+              string type = "float32", bool compress = true,
+              int tw = 0, int th = 0, int tf = 0, int tc = 0);
+
+    ~TiledFile();
+
+    int width, height, frames, channels;
+    int tileWidth, tileHeight, tileFrames, tileChannels;
+
+    // Read a block. Parts out of bounds read as zero.
+    Image read(int xoff, int yoff, int toff, int coff, int w, int h, int f, int c);
+
+    // Write an image at an offset. Parts out of bounds are dropped.
+    void write(Image im, int xoff, int yoff, int toff, int coff);
+
+    // Walks the file a block at a time in storage order, so that it
+    // can be processed piecewise in bounded memory:
+    //
+    // for (TiledFile::Iterator it(file); !it.done(); it.next()) {
+    //     Image block = it.read();
+    //     ...
+    //     it.write(block);
+    // }
+    //
+    // Blocks are one tile by default, and are clipped to the file.
+    class Iterator {
+    public:
+        Iterator(TiledFile &file, int bw = 0, int bh = 0, int bf = 0, int bc = 0);
+        bool done() const;
+        void next();
+        Image read() const;
+        void write(Image im) const;
+
+        // The current block
+        int x, y, t, c, width, height, frames, channels;
+    private:
+        TiledFile &tiled;
+        int blockWidth, blockHeight, blockFrames, blockChannels;
+        void clip();
+    };
+
+private:
+    struct Entry {
+        uint64_t offset; // zero for a tile that has never been written
+        uint32_t bytes, encoding;
+    };
+
+    FILE *file;
+    bool writable;
+    int type, compression;
+    int tilesX, tilesY, tilesT, tilesC;
+    vector<Entry> index;
+    vector<uint8_t> raw, packed;
+
+    // Unused space between tiles, from offset to size, and the end
+    // of the space in use. Tiles that are rewritten move into these
+    // holes when they no longer fit where they were.
+    map<uint64_t, uint64_t> holes;
+    uint64_t end;
+
+    size_t tileSize() const;
+    void readTile(int tile, float *dst);
+    void writeTile(int tile, const float *src);
+    void writeEntry(int tile);
+    uint64_t allocate(uint64_t bytes);
+    void release(uint64_t offset, uint64_t bytes);
+
+    // Not copyable
+    TiledFile(const TiledFile &);
+    void operator=(const TiledFile &);
+};
 }
 
 namespace FileYUV {
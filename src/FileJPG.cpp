@@ -11,6 +11,7 @@ namespace FileJPG {
 
 #else
 
+#include <setjmp.h>
 extern "C" {
 #include <jpeglib.h>
 }
@@ -24,18 +25,102 @@ void help() {
            "and may have either one or three channels.\n");
 }
 
+// libjpeg's default error handler exits the process. This one jumps
+// back into load or save instead, which raise an exception, so that
+// a bad file can be reported from any thread.
+struct ErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+void errorExit(j_common_ptr cinfo) {
+    longjmp(((ErrorManager *)cinfo->err)->jump, 1);
+}
+
+// Convert between rows of interleaved 8-bit samples and rows of an
+// image, a vector at a time using the 8-bit conversions in Expr.h.
+// Each channel is first gathered into, or afterwards scattered from,
+// a contiguous row of bytes of scratch space, which needs no copy
+// for one channel.
+template<int channels>
+void fromLDR(const JSAMPLE *src, Image im, int y, JSAMPLE *plane) {
+    const Expr::Vec::type scale = Expr::Vec::broadcast(1.0f/255);
+    for (int c = 0; c < channels; c++) {
+        const uint8_t *p = src;
+        if (channels > 1) {
+            for (int x = 0; x < im.width; x++) {
+                plane[x] = src[x * channels + c];
+            }
+            p = plane;
+        }
+        float *dst = &im(0, y, c);
+        int x = 0;
+        if (im.xstride == 1) {
+            for (; x + Expr::Vec::width <= im.width; x += Expr::Vec::width) {
+                Expr::Vec::store(Expr::Vec::Mul::vec(Expr::Vec::loadU8(p + x), scale), dst + x);
+            }
+        }
+        for (; x < im.width; x++) {
+            dst[x * im.xstride] = LDRtoHDR(p[x]);
+        }
+    }
+}
+
+template<int channels>
+void toLDR(Image im, int y, JSAMPLE *dst, JSAMPLE *plane) {
+    // storeU8 rounds to nearest, and HDRtoLDR rounds up from just
+    // under a half
+    const Expr::Vec::type scale = Expr::Vec::broadcast(255.0f);
+    const Expr::Vec::type offset = Expr::Vec::broadcast(0.49999f - 0.5f);
+    for (int c = 0; c < channels; c++) {
+        uint8_t *p = channels > 1 ? plane : dst;
+        const float *src = &im(0, y, c);
+        int x = 0;
+        if (im.xstride == 1) {
+            for (; x + Expr::Vec::width <= im.width; x += Expr::Vec::width) {
+                Expr::Vec::storeU8(Expr::Vec::mulAdd(Expr::Vec::load(src + x), scale, offset), p + x);
+            }
+        }
+        for (; x < im.width; x++) {
+            p[x] = HDRtoLDR(src[x * im.xstride]);
+        }
+        if (channels > 1) {
+            for (x = 0; x < im.width; x++) {
+                dst[x * channels + c] = plane[x];
+            }
+        }
+    }
+}
+
 void save(Image im, string filename, int quality) {
     assert(im.channels == 1 || im.channels == 3, "Can only save jpg images with 1 or 3 channels\n");
     assert(im.frames == 1, "Can't save multiframe jpg images\n");
     assert(quality > 0 && quality <= 100, "jpeg quality must lie between 1 and 100\n");
 
     struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    ErrorManager jerr;
 
     FILE *f = fopen(filename.c_str(), "wb");
     assert(f, "Could not open file %s\n", filename.c_str());
 
-    cinfo.err = jpeg_std_error(&jerr);
+    // Compress a batch of rows at a time
+    const int batch = 16;
+    JSAMPLE *rows = new JSAMPLE[batch * im.width * im.channels];
+    JSAMPROW rowPtrs[batch];
+    for (int i = 0; i < batch; i++) {
+        rowPtrs[i] = rows + i * im.width * im.channels;
+    }
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = errorExit;
+    if (setjmp(jerr.jump)) {
+        char message[JMSG_LENGTH_MAX];
+        (*cinfo.err->format_message)((j_common_ptr)&cinfo, message);
+        jpeg_destroy_compress(&cinfo);
+        fclose(f);
+        delete[] rows;
+        panic("Could not write %s: %s\n", filename.c_str(), message);
+    }
     jpeg_create_compress(&cinfo);
     jpeg_stdio_dest(&cinfo, f);
 
@@ -53,54 +138,113 @@ void save(Image im, string filename, int quality) {
 
     jpeg_start_compress(&cinfo, TRUE);
 
-    JSAMPLE *row = new JSAMPLE[im.width * im.channels];
+    JSAMPLE *plane = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, im.width, 1)[0];
 
     while (cinfo.next_scanline < cinfo.image_height) {
-        // convert the row
-        JSAMPLE *dstPtr = row;
-        for (int x = 0; x < im.width; x++) {
-            for (int c = 0; c < im.channels; c++) {
-                *dstPtr++ = (JSAMPLE)(HDRtoLDR(im(x, cinfo.next_scanline, c)));
+        int y = cinfo.next_scanline;
+        int n = min(batch, im.height - y);
+        for (int i = 0; i < n; i++) {
+            if (im.channels == 3) {
+                toLDR<3>(im, y + i, rowPtrs[i], plane);
+            } else {
+                toLDR<1>(im, y + i, rowPtrs[i], plane);
             }
         }
-        jpeg_write_scanlines(&cinfo, &row, 1);
+        jpeg_write_scanlines(&cinfo, rowPtrs, n);
     }
 
     jpeg_finish_compress(&cinfo);
     fclose(f);
 
     // clean up
-    delete[] row;
+    delete[] rows;
     jpeg_destroy_compress(&cinfo);
 
 }
 
 
 
-Image load(string filename) {
+namespace {
+// Decode at 1/shrink of the size, or if minWidth is positive, at the
+// smallest fraction that is at least minWidth by minHeight.
+Image decode(string filename, Image into, int shrink, int minWidth, int minHeight) {
+    assert(shrink == 1 || shrink == 2 || shrink == 4 || shrink == 8,
+           "A jpeg can only be shrunk by 2, 4, or 8 while loading\n");
 
     struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    ErrorManager jerr;
 
     FILE *f = fopen(filename.c_str(), "rb");
     assert(f, "Could not open file %s\n", filename.c_str());
 
-    cinfo.err = jpeg_std_error(&jerr);
+    Image im;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = errorExit;
+    if (setjmp(jerr.jump)) {
+        char message[JMSG_LENGTH_MAX];
+        (*cinfo.err->format_message)((j_common_ptr)&cinfo, message);
+        jpeg_destroy_decompress(&cinfo);
+        fclose(f);
+        panic("Could not read %s: %s\n", filename.c_str(), message);
+    }
     jpeg_create_decompress(&cinfo);
     jpeg_stdio_src(&cinfo, f);
 
     jpeg_read_header(&cinfo, TRUE);
+
+    if (minWidth > 0) {
+        while (shrink < 8 &&
+               (int)cinfo.image_width / (shrink * 2) >= minWidth &&
+               (int)cinfo.image_height / (shrink * 2) >= minHeight) {
+            shrink *= 2;
+        }
+    }
+
+    // libjpeg does the shrinking in its inverse DCT, which is much
+    // cheaper than the full one. It rounds the size up, so the
+    // partial last row and column are dropped, as -downsample does.
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = shrink;
+    int width = cinfo.image_width / shrink, height = cinfo.image_height / shrink;
+    if (width < 1 || height < 1) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(f);
+        panic("%s is too small to shrink by %d\n", filename.c_str(), shrink);
+    }
+
     jpeg_start_decompress(&cinfo);
 
-    Image im(cinfo.output_width, cinfo.output_height, 1, cinfo.output_components);
-    JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, im.width * im.channels, 1);
+    int channels = cinfo.output_components;
+    if (into.defined()) {
+        if (into.width != width || into.height != height ||
+            into.frames != 1 || into.channels != channels) {
+            jpeg_destroy_decompress(&cinfo);
+            fclose(f);
+            panic("%s is %dx%dx1x%d, but %dx%dx%dx%d was expected\n",
+                  filename.c_str(), width, height, channels,
+                  into.width, into.height, into.frames, into.channels);
+        }
+        im = into;
+    } else {
+        im = Image(width, height, 1, channels, Image::UNINITIALIZED);
+    }
+
+    // Decode as many rows at a time as libjpeg can do at once
+    int batch = cinfo.rec_outbuf_height;
+    JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE,
+                                                    cinfo.output_width * channels, batch);
+    JSAMPLE *plane = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE,
+                                                 cinfo.output_width, 1)[0];
 
     while (cinfo.output_scanline < cinfo.output_height) {
-        jpeg_read_scanlines(&cinfo, buffer, 1);
-        JSAMPLE *srcPtr = buffer[0];
-        for (int x = 0; x < im.width; x++) {
-            for (int c = 0; c < im.channels; c++) {
-                im(x, cinfo.output_scanline-1, c) = LDRtoHDR(*srcPtr++);
+        int y = cinfo.output_scanline;
+        int n = jpeg_read_scanlines(&cinfo, buffer, batch);
+        for (int i = 0; i < n && y + i < height; i++) {
+            switch (channels) {
+            case 1: fromLDR<1>(buffer[i], im, y + i, plane); break;
+            case 3: fromLDR<3>(buffer[i], im, y + i, plane); break;
+            default: fromLDR<4>(buffer[i], im, y + i, plane); break; // CMYK
             }
         }
     }
@@ -113,5 +257,14 @@ Image load(string filename) {
     return im;
 }
 }
+
+Image load(string filename, Image into, int shrink) {
+    return decode(filename, into, shrink, 0, 0);
+}
+
+Image loadAtLeast(string filename, int width, int height) {
+    return decode(filename, Image(), 1, max(width, 1), max(height, 1));
+}
+}
 #include "footer.h"
 #endif
@@ -7,6 +7,24 @@ Image load(string filename) {
     return im;
 }
 
+Image load(string filename, Image into) {
+    panic("This file type not implemented in this build\n");
+    Image im;
+    return im;
+}
+
+Image load(string filename, Image into, int opt) {
+    panic("This file type not implemented in this build\n");
+    Image im;
+    return im;
+}
+
+Image loadAtLeast(string filename, int width, int height) {
+    panic("This file type not implemented in this build\n");
+    Image im;
+    return im;
+}
+
 void save(Image im, string filename) {
     panic("This file type not implemented in this build\n");
 }
@@ -18,7 +18,7 @@ void help() {
            "only have 1 frame.\n");
 }
 
-Image load(string filename) {
+Image load(string filename, Image into) {
     png_byte header[8];        // 8 is the maximum size that can be checked
     png_structp png_ptr;
     png_infop info_ptr;
@@ -55,7 +55,20 @@ Image load(string filename) {
         png_set_packing(png_ptr);
     }
 
-    Image im(width, height, 1, channels);
+    Image im;
+    if (into.defined()) {
+        if (into.width != width || into.height != height ||
+            into.frames != 1 || into.channels != channels) {
+            png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+            fclose(f);
+            panic("%s is %dx%dx1x%d, but %dx%dx%dx%d was expected\n",
+                  filename.c_str(), width, height, channels,
+                  into.width, into.height, into.frames, into.channels);
+        }
+        im = into;
+    } else {
+        im = Image(width, height, 1, channels);
+    }
 
     //number_of_passes = png_set_interlace_handling(png_ptr);
     png_read_update_info(png_ptr, info_ptr);
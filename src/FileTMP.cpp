@@ -1,10 +1,16 @@
 #include "main.h"
 #include "File.h"
+#include "PackedImage.h"
 #include "header.h"
 #include <stdint.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace FileTMP {
-enum TypeCode {FLOAT32 = 0, FLOAT64, UINT8, INT8, UINT16, INT16, UINT32, INT32, UINT64, INT64};
 
 void help() {
     pprintf(".tmp files. This format is used to save temporary image data, and to"
@@ -24,12 +30,47 @@ void help() {
             " 7: 32 bit signed integers\n"
             " 8: 64 bit unsigned integers\n"
             " 9: 64 bit signed integers\n"
+            " 10: 16 bit floats\n"
             "\n"
             "When saving, an optional second argument specifies the format. This"
             " may be any of int8, uint8, int16, uint16, int32, uint32, int64,"
-            " uint64, float32, float64, or correspondingly char, unsigned"
-            " char, short, unsigned short, int, unsigned int, float, or"
-            " double. The default is float32.\n");
+            " uint64, float16, float32, float64, or correspondingly char,"
+            " unsigned char, short, unsigned short, int, unsigned int, half,"
+            " float, or double. The default is float32.\n"
+            "\n"
+            "Float32 files are loaded by mapping them into memory rather than"
+            " reading them, so loading is immediate and pages are read from disk"
+            " as they are used. Edits to the loaded image are private to this"
+            " process unless the file is loaded in shared mode, in which case"
+            " they are written back to the file.\n");
+}
+
+TypeCode typeCode(string type) {
+    if (type == "float" || type == "float32") {
+        return FLOAT32;
+    } else if (type == "half" || type == "float16") {
+        return FLOAT16;
+    } else if (type == "double" || type == "float64") {
+        return FLOAT64;
+    } else if (type == "uint8" || type == "unsigned char") {
+        return UINT8;
+    } else if (type == "int8" || type == "char") {
+        return INT8;
+    } else if (type == "uint16" || type == "unsigned short") {
+        return UINT16;
+    } else if (type == "int16" || type == "short") {
+        return INT16;
+    } else if (type == "uint32" || type == "unsigned int") {
+        return UINT32;
+    } else if (type == "int32" || type == "int") {
+        return INT32;
+    } else if (type == "uint64") {
+        return UINT64;
+    } else if (type == "int64") {
+        return INT64;
+    }
+    panic("Unknown type %s\n", type.c_str());
+    return FLOAT32;
 }
 
 template<typename T>
@@ -50,6 +91,18 @@ void saveData(FILE *f, Image im) {
     }
 }
 
+template<>
+void saveData<Half>(FILE *f, Image im) {
+    // Convert and write a frame at a time
+    PackedImage<Half> frame(im.width, im.height, 1, 1, 1.0f, Image::UNINITIALIZED);
+    for (int c = 0; c < im.channels; c++) {
+        for (int t = 0; t < im.frames; t++) {
+            frame.set(im.region(0, 0, t, c, im.width, im.height, 1, 1));
+            fwrite(frame.baseAddress(), sizeof(Half), (size_t)im.width * im.height, f);
+        }
+    }
+}
+
 template<>
 void saveData<float>(FILE *f, Image im) {
 
@@ -66,6 +119,24 @@ void saveData<float>(FILE *f, Image im) {
 
 
 void save(Image im, string filename, string type) {
+    // We write whole scanlines at a time
+    im = im.toLayout(Image::PLANAR);
+    int code = typeCode(type);
+
+    // If the file already exists, it may be mapped by a loaded image,
+    // in this or another process. Truncating it would pull the pages
+    // out from under them, so we write a new file and rename it into
+    // place instead.
+    string target = filename;
+#ifndef WIN32
+    struct stat st;
+    if (lstat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+        char suffix[64];
+        snprintf(suffix, sizeof(suffix), ".%d.partial", (int)getpid());
+        filename += suffix;
+    }
+#endif
+
     FILE *f = fopen(filename.c_str(), "wb");
     assert(f, "Could not write output file %s\n", filename.c_str());
     // write the dimensions
@@ -74,50 +145,27 @@ void save(Image im, string filename, string type) {
     fwrite(&im.frames, sizeof(int), 1, f);
     fwrite(&im.channels, sizeof(int), 1, f);
 
-    int typeCode;
+    fwrite(&code, sizeof(int), 1, f);
 
-    if (type == "float" || type == "float32") {
-        typeCode = FLOAT32;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<float>(f, im);
-    } else if (type == "double" || type == "float64") {
-        typeCode = FLOAT64;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<double>(f, im);
-    } else if (type == "uint8" || type == "unsigned char") {
-        typeCode = UINT8;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<uint8_t>(f, im);
-    } else if (type == "int8" || type == "char") {
-        typeCode = INT8;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<int8_t>(f, im);
-    } else if (type == "uint16" || type == "unsigned short") {
-        typeCode = UINT16;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<uint16_t>(f, im);
-    } else if (type == "int16" || type == "short") {
-        typeCode = INT16;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<int16_t>(f, im);
-    } else if (type == "uint32" || type == "unsigned int") {
-        typeCode = UINT32;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<uint32_t>(f, im);
-    } else if (type == "int32" || type == "int") {
-        typeCode = INT32;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<int32_t>(f, im);
-    } else if (type == "uint64") {
-        typeCode = UINT64;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<uint64_t>(f, im);
-    } else if (type == "int64") {
-        typeCode = INT64;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<int64_t>(f, im);
+    switch (code) {
+    case FLOAT32: saveData<float>(f, im); break;
+    case FLOAT16: saveData<Half>(f, im); break;
+    case FLOAT64: saveData<double>(f, im); break;
+    case UINT8: saveData<uint8_t>(f, im); break;
+    case INT8: saveData<int8_t>(f, im); break;
+    case UINT16: saveData<uint16_t>(f, im); break;
+    case INT16: saveData<int16_t>(f, im); break;
+    case UINT32: saveData<uint32_t>(f, im); break;
+    case INT32: saveData<int32_t>(f, im); break;
+    case UINT64: saveData<uint64_t>(f, im); break;
+    case INT64: saveData<int64_t>(f, im); break;
     }
     fclose(f);
+
+    if (filename != target) {
+        assert(rename(filename.c_str(), target.c_str()) == 0,
+               "Could not replace output file %s\n", target.c_str());
+    }
 }
 
 template<typename T>
@@ -140,6 +188,22 @@ Image loadData(FILE *f, int width, int height, int frames, int channels) {
     return im;
 }
 
+template<>
+Image loadData<Half>(FILE *f, int width, int height, int frames, int channels) {
+    // Read and widen a frame at a time
+    Image im(width, height, frames, channels, Image::UNINITIALIZED);
+    PackedImage<Half> frame(width, height, 1, 1, 1.0f, Image::UNINITIALIZED);
+    size_t size = (size_t)width * height;
+    for (int c = 0; c < channels; c++) {
+        for (int t = 0; t < frames; t++) {
+            assert(fread(frame.baseAddress(), sizeof(Half), size, f) == size,
+                   "Unexpected end of file\n");
+            im.region(0, 0, t, c, width, height, 1, 1).set(frame);
+        }
+    }
+    return im;
+}
+
 template<>
 Image loadData<float>(FILE *f, int width, int height, int frames, int channels) {
     Image im(width, height, frames, channels);
@@ -156,7 +220,52 @@ Image loadData<float>(FILE *f, int width, int height, int frames, int channels)
     return im;
 }
 
-Image load(string filename) {
+#ifndef WIN32
+// Map the pixel data of a float32 file straight into an image. The
+// data starts 20 bytes into the file, so it is not aligned the way a
+// freshly allocated image is, which costs a little speed but nothing
+// else. Returns an undefined image if the file can't be mapped.
+Image mapData(string filename, int width, int height, int frames, int channels, Mode mode) {
+    size_t size = (size_t)width * height * frames * channels;
+    size_t header = 5 * sizeof(int32_t);
+
+    int fd = open(filename.c_str(), mode == MapShared ? O_RDWR : O_RDONLY);
+    if (fd < 0) return Image();
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < header + size * sizeof(float)) {
+        close(fd);
+        return Image();
+    }
+
+    // Reserve a zeroed region with room for the padding an image
+    // needs past the end of the data, then map the file over the
+    // front of it. Mapping the file itself past its end would fault.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t length = ((header + (size + Image::padding) * sizeof(float)) + page - 1) & ~(page - 1);
+    void *region = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        close(fd);
+        return Image();
+    }
+    // Only the header and the data are mapped. Anything after them in
+    // the file would run past the end of the reservation.
+    void *mapped = mmap(region, header + size * sizeof(float), PROT_READ | PROT_WRITE,
+                        MAP_FIXED | (mode == MapShared ? MAP_SHARED : MAP_PRIVATE),
+                        fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        munmap(region, length);
+        return Image();
+    }
+
+    float *data = (float *)((char *)region + header);
+    return Image(width, height, frames, channels, data,
+                 [region, length]() {munmap(region, length);});
+}
+#endif
+
+Image load(string filename, Mode mode) {
     FILE *file = fopen(filename.c_str(), "rb");
     assert(file, "Could not open file %s\n", filename.c_str());
 
@@ -170,7 +279,13 @@ Image load(string filename) {
     Image im;
 
     if (h.typeCode == FLOAT32) {
-        im = loadData<float>(file, h.width, h.height, h.frames, h.channels);
+#ifndef WIN32
+        if (mode != Read) {
+            im = mapData(filename, h.width, h.height, h.frames, h.channels, mode);
+        }
+        if (!im.defined())
+#endif
+            im = loadData<float>(file, h.width, h.height, h.frames, h.channels);
     } else if (h.typeCode == FLOAT64) {
         im = loadData<double>(file, h.width, h.height, h.frames, h.channels);
     } else if (h.typeCode == UINT8) {
@@ -189,6 +304,8 @@ Image load(string filename) {
         im = loadData<uint64_t>(file, h.width, h.height, h.frames, h.channels);
     } else if (h.typeCode == INT64) {
         im = loadData<int64_t>(file, h.width, h.height, h.frames, h.channels);
+    } else if (h.typeCode == FLOAT16) {
+        im = loadData<Half>(file, h.width, h.height, h.frames, h.channels);
     } else {
         printf("Unknown type code %d. Possibly trying to load an old-style tmp file.\n", h.typeCode);
         fseek(file, 16, SEEK_SET);
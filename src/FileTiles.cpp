@@ -0,0 +1,676 @@
+#include "main.h"
+#include "File.h"
+#include "PackedImage.h"
+#include "header.h"
+#include <stdint.h>
+
+// 64 bit systems may not have fseeko. In this case fseek is just fine.
+#ifndef fseeko
+#define fseeko fseek
+#endif
+#ifndef ftello
+#define ftello ftell
+#endif
+
+namespace FileTiles {
+
+void help() {
+    pprintf(".tiles files. This format stores an image of any size as a grid of"
+            " fixed-size four dimensional tiles, so that a block of it can be"
+            " loaded or saved by -loadblock and -saveblock without touching the"
+            " rest of the file. The header holds the dimensions, the element type,"
+            " the tile size, and an index giving the location of each tile. Tiles"
+            " that have never been written, or are entirely zero, take no space."
+            " Each tile is stored compressed if that makes it much smaller, by splitting"
+            " the bytes of each element into planes, and storing each plane as a"
+            " constant, run-length encoded, or as it is. This is lossless, and works"
+            " well on sparse, flat, quantized, or low bit depth data. A tile that is"
+            " rewritten stays where it was if it still fits, and otherwise moves to"
+            " the first gap left by other tiles that is big enough, or to the end of"
+            " the file.\n"
+            "\n"
+            "When saving, an optional second argument specifies the element type,"
+            " which may be any of the types supported by .tmp files. The default is"
+            " float32. Tiles are 128x128 pixels, one frame, and up to four"
+            " channels.\n");
+}
+
+// The size of one element of each type
+size_t elementSize(int type) {
+    switch (type) {
+    case FileTMP::FLOAT32: return sizeof(float);
+    case FileTMP::FLOAT64: return sizeof(double);
+    case FileTMP::UINT8: return sizeof(uint8_t);
+    case FileTMP::INT8: return sizeof(int8_t);
+    case FileTMP::UINT16: return sizeof(uint16_t);
+    case FileTMP::INT16: return sizeof(int16_t);
+    case FileTMP::UINT32: return sizeof(uint32_t);
+    case FileTMP::INT32: return sizeof(int32_t);
+    case FileTMP::UINT64: return sizeof(uint64_t);
+    case FileTMP::INT64: return sizeof(int64_t);
+    case FileTMP::FLOAT16: return sizeof(Half);
+    }
+    panic("Unknown type code %d\n", type);
+    return 0;
+}
+
+// Conversion between floats and the stored type, which, as for .tmp
+// files, is a plain cast
+template<typename T>
+void packData(const float *src, uint8_t *dst, size_t n) {
+    T *out = (T *)dst;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (T)src[i];
+    }
+}
+
+template<>
+void packData<Half>(const float *src, uint8_t *dst, size_t n) {
+    uint16_t *out = (uint16_t *)dst;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = Scalar::floatToHalf(src[i]);
+    }
+}
+
+template<typename T>
+void unpackData(const uint8_t *src, float *dst, size_t n) {
+    const T *in = (const T *)src;
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = (float)in[i];
+    }
+}
+
+template<>
+void unpackData<Half>(const uint8_t *src, float *dst, size_t n) {
+    const uint16_t *in = (const uint16_t *)src;
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = Scalar::halfToFloat(in[i]);
+    }
+}
+
+void pack(int type, const float *src, uint8_t *dst, size_t n) {
+    switch (type) {
+    case FileTMP::FLOAT32: memcpy(dst, src, n * sizeof(float)); break;
+    case FileTMP::FLOAT64: packData<double>(src, dst, n); break;
+    case FileTMP::UINT8: packData<uint8_t>(src, dst, n); break;
+    case FileTMP::INT8: packData<int8_t>(src, dst, n); break;
+    case FileTMP::UINT16: packData<uint16_t>(src, dst, n); break;
+    case FileTMP::INT16: packData<int16_t>(src, dst, n); break;
+    case FileTMP::UINT32: packData<uint32_t>(src, dst, n); break;
+    case FileTMP::INT32: packData<int32_t>(src, dst, n); break;
+    case FileTMP::UINT64: packData<uint64_t>(src, dst, n); break;
+    case FileTMP::INT64: packData<int64_t>(src, dst, n); break;
+    case FileTMP::FLOAT16: packData<Half>(src, dst, n); break;
+    }
+}
+
+void unpack(int type, const uint8_t *src, float *dst, size_t n) {
+    switch (type) {
+    case FileTMP::FLOAT32: memcpy(dst, src, n * sizeof(float)); break;
+    case FileTMP::FLOAT64: unpackData<double>(src, dst, n); break;
+    case FileTMP::UINT8: unpackData<uint8_t>(src, dst, n); break;
+    case FileTMP::INT8: unpackData<int8_t>(src, dst, n); break;
+    case FileTMP::UINT16: unpackData<uint16_t>(src, dst, n); break;
+    case FileTMP::INT16: unpackData<int16_t>(src, dst, n); break;
+    case FileTMP::UINT32: unpackData<uint32_t>(src, dst, n); break;
+    case FileTMP::INT32: unpackData<int32_t>(src, dst, n); break;
+    case FileTMP::UINT64: unpackData<uint64_t>(src, dst, n); break;
+    case FileTMP::INT64: unpackData<int64_t>(src, dst, n); break;
+    case FileTMP::FLOAT16: unpackData<Half>(src, dst, n); break;
+    }
+}
+
+// Tile compression. The bytes of n elements of the given size are
+// split into planes, so that the sign and exponent bytes of floats,
+// or the high bytes of integers, sit next to each other. Each plane
+// is then stored as a single byte if it is constant, run-length
+// encoded if that makes it much smaller, or as it is. Noisy low bytes
+// thus cost nothing to decode. The run-length encoding uses a control
+// byte k < 128 followed by k+1 literal bytes, or k >= 128 followed by
+// one byte that repeats k-125 times.
+enum Encoding {RAW = 0, PLANES};
+enum PlaneEncoding {PLANE_RAW = 0, PLANE_CONSTANT, PLANE_RLE};
+
+// Split elements of S bytes into byte planes, and back again. Each
+// element is assembled a word at a time so that these vectorize.
+template<typename W, int S>
+void splitPlanes(const uint8_t *src, uint8_t *const *planes, size_t n) {
+    const W *in = (const W *)src;
+    for (int b = 0; b < S; b++) {
+        uint8_t *plane = planes[b];
+        for (size_t i = 0; i < n; i++) {
+            plane[i] = (uint8_t)(in[i] >> (8 * b));
+        }
+    }
+}
+
+template<typename W, int S>
+void joinPlanes(const uint8_t *const *planes, uint8_t *dst, size_t n) {
+    W *out = (W *)dst;
+    for (size_t i = 0; i < n; i++) {
+        W v = 0;
+        for (int b = 0; b < S; b++) {
+            v |= (W)planes[b][i] << (8 * b);
+        }
+        out[i] = v;
+    }
+}
+
+void splitPlanes(const uint8_t *src, uint8_t *const *planes, size_t n, size_t size) {
+    switch (size) {
+    case 1: memcpy(planes[0], src, n); break;
+    case 2: splitPlanes<uint16_t, 2>(src, planes, n); break;
+    case 4: splitPlanes<uint32_t, 4>(src, planes, n); break;
+    case 8: splitPlanes<uint64_t, 8>(src, planes, n); break;
+    }
+}
+
+void joinPlanes(const uint8_t *const *planes, uint8_t *dst, size_t n, size_t size) {
+    switch (size) {
+    case 1: memcpy(dst, planes[0], n); break;
+    case 2: joinPlanes<uint16_t, 2>(planes, dst, n); break;
+    case 4: joinPlanes<uint32_t, 4>(planes, dst, n); break;
+    case 8: joinPlanes<uint64_t, 8>(planes, dst, n); break;
+    }
+}
+
+// Returns the number of bytes written to dst, which must have room
+// for n + n/128 + 1 of them
+size_t runLengthEncode(const uint8_t *src, size_t n, uint8_t *dst) {
+    uint8_t *out = dst;
+    size_t i = 0;
+    while (i < n) {
+        size_t j = i + 1;
+        while (j < n && j - i < 130 && src[j] == src[i]) j++;
+        if (j - i >= 3) {
+            *out++ = (uint8_t)(125 + (j - i));
+            *out++ = src[i];
+            i = j;
+            continue;
+        }
+        // A literal run lasts until the next run of three
+        size_t start = i;
+        while (i < n && i - start < 128) {
+            if (i + 2 < n && src[i] == src[i+1] && src[i] == src[i+2]) break;
+            i++;
+        }
+        *out++ = (uint8_t)(i - start - 1);
+        memcpy(out, src + start, i - start);
+        out += i - start;
+    }
+    return out - dst;
+}
+
+void compress(const uint8_t *src, size_t n, size_t size, vector<uint8_t> &dst) {
+    vector<uint8_t> planes(n * size), rle(n + n / 128 + 1);
+    uint8_t *plane[8];
+    for (size_t b = 0; b < size; b++) {
+        plane[b] = &planes[b * n];
+    }
+    splitPlanes(src, plane, n, size);
+
+    dst.clear();
+    for (size_t b = 0; b < size; b++) {
+        const uint8_t *p = plane[b];
+        size_t i = 1;
+        while (i < n && p[i] == p[0]) i++;
+        if (i == n) {
+            dst.push_back(PLANE_CONSTANT);
+            dst.push_back(p[0]);
+            continue;
+        }
+        // A run saves a byte for each byte that repeats the two
+        // before it, and costs a control byte to resume literals
+        // after it. Estimating this is much faster than encoding, and
+        // rules out most planes that won't shrink enough.
+        size_t repeats = 0, runs = 0;
+        for (i = 3; i < n; i++) {
+            bool repeat = (p[i] == p[i-1]) & (p[i] == p[i-2]);
+            bool continues = (p[i-1] == p[i-2]) & (p[i-1] == p[i-3]);
+            repeats += repeat;
+            runs += repeat & !continues;
+        }
+        uint32_t bytes = n;
+        if (repeats > runs + n / 8) {
+            bytes = runLengthEncode(p, n, &rle[0]);
+        }
+        if (bytes < n - n / 8) {
+            dst.push_back(PLANE_RLE);
+            dst.insert(dst.end(), (uint8_t *)&bytes, (uint8_t *)&bytes + 4);
+            dst.insert(dst.end(), rle.begin(), rle.begin() + bytes);
+        } else {
+            dst.push_back(PLANE_RAW);
+            dst.insert(dst.end(), p, p + n);
+        }
+    }
+}
+
+void decompress(const uint8_t *src, size_t bytes, uint8_t *dst, size_t n, size_t size) {
+    const uint8_t *end = src + bytes;
+    vector<uint8_t> planes(n * size);
+    const uint8_t *plane[8];
+    for (size_t b = 0; b < size; b++) {
+        assert(src < end, "Corrupt tile in .tiles file\n");
+        int encoding = *src++;
+        if (encoding == PLANE_CONSTANT) {
+            assert(src < end, "Corrupt tile in .tiles file\n");
+            memset(&planes[b * n], *src++, n);
+            plane[b] = &planes[b * n];
+        } else if (encoding == PLANE_RLE) {
+            uint32_t length;
+            assert(src + 4 <= end, "Corrupt tile in .tiles file\n");
+            memcpy(&length, src, 4);
+            src += 4;
+            const uint8_t *runsEnd = src + length;
+            assert(runsEnd <= end, "Corrupt tile in .tiles file\n");
+            uint8_t *p = &planes[b * n];
+            size_t i = 0;
+            while (i < n && src < runsEnd) {
+                int k = *src++;
+                size_t count = k < 128 ? k + 1 : k - 125;
+                if (i + count > n || src + (k < 128 ? count : 1) > runsEnd) break;
+                if (k < 128) {
+                    memcpy(p + i, src, count);
+                    src += count;
+                } else {
+                    memset(p + i, *src++, count);
+                }
+                i += count;
+            }
+            assert(i == n && src == runsEnd, "Corrupt tile in .tiles file\n");
+            plane[b] = p;
+        } else {
+            assert(encoding == PLANE_RAW && src + n <= end, "Corrupt tile in .tiles file\n");
+            plane[b] = src;
+            src += n;
+        }
+    }
+    joinPlanes(plane, dst, n, size);
+}
+
+// The file starts with this header, followed by an index entry for
+// each tile, with x varying fastest and then y, t, and c. Each tile
+// holds tileWidth x tileHeight x tileFrames x tileChannels elements
+// in planar order, including those of edge tiles that lie past the
+// end of the image.
+struct Header {
+    char magic[8];
+    int32_t width, height, frames, channels, type;
+    int32_t tileWidth, tileHeight, tileFrames, tileChannels;
+    int32_t compression;
+};
+
+const char magic[8] = {'I', 'S', 'T', 'I', 'L', 'E', 'S', '1'};
+
+TiledFile::TiledFile(string filename) {
+    writable = true;
+    file = fopen(filename.c_str(), "rb+");
+    if (!file) {
+        writable = false;
+        file = fopen(filename.c_str(), "rb");
+    }
+    assert(file, "Could not open file %s\n", filename.c_str());
+
+    Header h;
+    assert(fread(&h, sizeof(h), 1, file) == 1 && memcmp(h.magic, magic, 8) == 0,
+           "%s is not a .tiles file\n", filename.c_str());
+    assert(h.width > 0 && h.height > 0 && h.frames > 0 && h.channels > 0 &&
+           h.tileWidth > 0 && h.tileHeight > 0 && h.tileFrames > 0 && h.tileChannels > 0,
+           "The header of %s is corrupt\n", filename.c_str());
+
+    width = h.width;
+    height = h.height;
+    frames = h.frames;
+    channels = h.channels;
+    type = h.type;
+    elementSize(type);
+    tileWidth = h.tileWidth;
+    tileHeight = h.tileHeight;
+    tileFrames = h.tileFrames;
+    tileChannels = h.tileChannels;
+    compression = h.compression;
+
+    tilesX = (width + tileWidth - 1) / tileWidth;
+    tilesY = (height + tileHeight - 1) / tileHeight;
+    tilesT = (frames + tileFrames - 1) / tileFrames;
+    tilesC = (channels + tileChannels - 1) / tileChannels;
+    index.resize((size_t)tilesX * tilesY * tilesT * tilesC);
+    assert(fread(&index[0], sizeof(Entry), index.size(), file) == index.size(),
+           "Unexpected end of file\n");
+
+    // Find the space between tiles, so that it can be reused
+    vector<pair<uint64_t, uint64_t> > used;
+    for (size_t i = 0; i < index.size(); i++) {
+        if (index[i].offset) {
+            used.push_back(make_pair(index[i].offset, (uint64_t)index[i].bytes));
+        }
+    }
+    ::std::sort(used.begin(), used.end());
+    end = sizeof(Header) + index.size() * sizeof(Entry);
+    for (size_t i = 0; i < used.size(); i++) {
+        if (used[i].first > end) {
+            holes[end] = used[i].first - end;
+        }
+        end = max(end, used[i].first + used[i].second);
+    }
+}
+
+TiledFile::TiledFile(string filename, int w, int h, int f, int c,
+                     string typeName, bool compress,
+                     int tw, int th, int tf, int tc) {
+    assert(w > 0 && h > 0 && f > 0 && c > 0,
+           "Some of the specified dimensions are less than 1\n");
+
+    width = w;
+    height = h;
+    frames = f;
+    channels = c;
+    type = FileTMP::typeCode(typeName);
+    compression = compress ? PLANES : RAW;
+
+    // By default a tile covers a 128x128 patch of one frame, and
+    // enough channels for a block of color pixels to come from one
+    // tile.
+    tileWidth = tw > 0 ? tw : min(width, 128);
+    tileHeight = th > 0 ? th : min(height, 128);
+    tileFrames = tf > 0 ? tf : 1;
+    tileChannels = tc > 0 ? tc : min(channels, 4);
+
+    tilesX = (width + tileWidth - 1) / tileWidth;
+    tilesY = (height + tileHeight - 1) / tileHeight;
+    tilesT = (frames + tileFrames - 1) / tileFrames;
+    tilesC = (channels + tileChannels - 1) / tileChannels;
+    Entry empty = {0, 0, 0};
+    index.resize((size_t)tilesX * tilesY * tilesT * tilesC, empty);
+
+    writable = true;
+    file = fopen(filename.c_str(), "wb+");
+    assert(file, "Could not open/create file %s\n", filename.c_str());
+
+    Header header = {{0}, width, height, frames, channels, type,
+                     tileWidth, tileHeight, tileFrames, tileChannels, compression
+                    };
+    memcpy(header.magic, magic, 8);
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(&index[0], sizeof(Entry), index.size(), file);
+    fflush(file);
+    end = sizeof(Header) + index.size() * sizeof(Entry);
+}
+
+TiledFile::~TiledFile() {
+    fclose(file);
+}
+
+size_t TiledFile::tileSize() const {
+    return (size_t)tileWidth * tileHeight * tileFrames * tileChannels;
+}
+
+void TiledFile::readTile(int tile, float *dst) {
+    const Entry &e = index[tile];
+    size_t n = tileSize();
+    if (e.offset == 0) {
+        memset(dst, 0, n * sizeof(float));
+        return;
+    }
+
+    size_t size = elementSize(type);
+    raw.resize(n * size);
+    fseeko(file, e.offset, SEEK_SET);
+    if (e.encoding == RAW) {
+        assert(e.bytes == raw.size(), "Corrupt tile in .tiles file\n");
+        assert(fread(&raw[0], 1, e.bytes, file) == e.bytes, "Unexpected end of file\n");
+    } else {
+        assert(e.encoding == PLANES, "Unknown tile encoding %d\n", e.encoding);
+        packed.resize(e.bytes);
+        assert(fread(&packed[0], 1, e.bytes, file) == e.bytes, "Unexpected end of file\n");
+        decompress(&packed[0], e.bytes, &raw[0], n, size);
+    }
+    unpack(type, &raw[0], dst, n);
+}
+
+void TiledFile::writeTile(int tile, const float *src) {
+    assert(writable, "Can't write to a read-only file\n");
+
+    size_t n = tileSize();
+    size_t size = elementSize(type);
+    raw.resize(n * size);
+    pack(type, src, &raw[0], n);
+
+    // All-zero tiles are left out of the file
+    bool zero = true;
+    for (size_t i = 0; i < raw.size() && zero; i++) {
+        zero = raw[i] == 0;
+    }
+    Entry &e = index[tile];
+    if (e.offset) {
+        release(e.offset, e.bytes);
+    }
+    if (zero) {
+        Entry empty = {0, 0, 0};
+        e = empty;
+        writeEntry(tile);
+        return;
+    }
+
+    const uint8_t *data = &raw[0];
+    uint32_t bytes = raw.size(), encoding = RAW;
+    if (compression == PLANES) {
+        // Decoding costs more than reading a few more bytes, so
+        // compression has to be worth it
+        compress(&raw[0], n, size, packed);
+        if (packed.size() < raw.size() - raw.size() / 8) {
+            data = &packed[0];
+            bytes = packed.size();
+            encoding = PLANES;
+        }
+    }
+
+    // The tile goes back where it was if it still fits, and
+    // otherwise into the first hole big enough, or at the end
+    e.offset = allocate(bytes);
+    fseeko(file, e.offset, SEEK_SET);
+    e.bytes = bytes;
+    e.encoding = encoding;
+    assert(fwrite(data, 1, bytes, file) == bytes, "Could not write tile\n");
+    writeEntry(tile);
+}
+
+uint64_t TiledFile::allocate(uint64_t bytes) {
+    for (map<uint64_t, uint64_t>::iterator it = holes.begin(); it != holes.end(); it++) {
+        if (it->second >= bytes) {
+            uint64_t offset = it->first;
+            if (it->second > bytes) {
+                holes[offset + bytes] = it->second - bytes;
+            }
+            holes.erase(it);
+            return offset;
+        }
+    }
+    uint64_t offset = end;
+    end += bytes;
+    return offset;
+}
+
+void TiledFile::release(uint64_t offset, uint64_t bytes) {
+    // Merge with the holes on either side
+    map<uint64_t, uint64_t>::iterator next = holes.lower_bound(offset);
+    if (next != holes.end() && next->first == offset + bytes) {
+        bytes += next->second;
+        holes.erase(next++);
+    }
+    if (next != holes.begin()) {
+        map<uint64_t, uint64_t>::iterator prev = next;
+        prev--;
+        if (prev->first + prev->second == offset) {
+            offset = prev->first;
+            bytes += prev->second;
+            holes.erase(prev);
+        }
+    }
+    // Space at the end is simply given back
+    if (offset + bytes == end) {
+        end = offset;
+    } else {
+        holes[offset] = bytes;
+    }
+}
+
+void TiledFile::writeEntry(int tile) {
+    fseeko(file, sizeof(Header) + (size_t)tile * sizeof(Entry), SEEK_SET);
+    assert(fwrite(&index[tile], sizeof(Entry), 1, file) == 1, "Could not write tile index\n");
+}
+
+Image TiledFile::read(int xoff, int yoff, int toff, int coff, int w, int h, int f, int c) {
+    Image out(w, h, f, c);
+
+    int xmin = max(xoff, 0), xmax = min(xoff + w, width);
+    int ymin = max(yoff, 0), ymax = min(yoff + h, height);
+    int tmin = max(toff, 0), tmax = min(toff + f, frames);
+    int cmin = max(coff, 0), cmax = min(coff + c, channels);
+    if (xmin >= xmax || ymin >= ymax || tmin >= tmax || cmin >= cmax) return out;
+
+    vector<float> tile(tileSize());
+    for (int tc = cmin / tileChannels; tc * tileChannels < cmax; tc++) {
+        for (int tt = tmin / tileFrames; tt * tileFrames < tmax; tt++) {
+            for (int ty = ymin / tileHeight; ty * tileHeight < ymax; ty++) {
+                for (int tx = xmin / tileWidth; tx * tileWidth < xmax; tx++) {
+                    int i = ((tc * tilesT + tt) * tilesY + ty) * tilesX + tx;
+                    if (index[i].offset == 0) continue;
+                    readTile(i, &tile[0]);
+
+                    int x0 = max(xmin, tx * tileWidth), x1 = min(xmax, (tx + 1) * tileWidth);
+                    int y0 = max(ymin, ty * tileHeight), y1 = min(ymax, (ty + 1) * tileHeight);
+                    int t0 = max(tmin, tt * tileFrames), t1 = min(tmax, (tt + 1) * tileFrames);
+                    int c0 = max(cmin, tc * tileChannels), c1 = min(cmax, (tc + 1) * tileChannels);
+                    for (int ch = c0; ch < c1; ch++) {
+                        for (int t = t0; t < t1; t++) {
+                            for (int y = y0; y < y1; y++) {
+                                const float *src = &tile[0] +
+                                    (((size_t)(ch - tc * tileChannels) * tileFrames +
+                                      (t - tt * tileFrames)) * tileHeight +
+                                     (y - ty * tileHeight)) * tileWidth + (x0 - tx * tileWidth);
+                                memcpy(&out(x0 - xoff, y - yoff, t - toff, ch - coff), src,
+                                       (x1 - x0) * sizeof(float));
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return out;
+}
+
+void TiledFile::write(Image im, int xoff, int yoff, int toff, int coff) {
+    im = im.toLayout(Image::PLANAR);
+
+    int xmin = max(xoff, 0), xmax = min(xoff + im.width, width);
+    int ymin = max(yoff, 0), ymax = min(yoff + im.height, height);
+    int tmin = max(toff, 0), tmax = min(toff + im.frames, frames);
+    int cmin = max(coff, 0), cmax = min(coff + im.channels, channels);
+    if (xmin >= xmax || ymin >= ymax || tmin >= tmax || cmin >= cmax) return;
+
+    vector<float> tile(tileSize());
+    for (int tc = cmin / tileChannels; tc * tileChannels < cmax; tc++) {
+        for (int tt = tmin / tileFrames; tt * tileFrames < tmax; tt++) {
+            for (int ty = ymin / tileHeight; ty * tileHeight < ymax; ty++) {
+                for (int tx = xmin / tileWidth; tx * tileWidth < xmax; tx++) {
+                    int i = ((tc * tilesT + tt) * tilesY + ty) * tilesX + tx;
+
+                    int x0 = max(xmin, tx * tileWidth), x1 = min(xmax, (tx + 1) * tileWidth);
+                    int y0 = max(ymin, ty * tileHeight), y1 = min(ymax, (ty + 1) * tileHeight);
+                    int t0 = max(tmin, tt * tileFrames), t1 = min(tmax, (tt + 1) * tileFrames);
+                    int c0 = max(cmin, tc * tileChannels), c1 = min(cmax, (tc + 1) * tileChannels);
+
+                    // A tile that is only partly overwritten must be
+                    // read first. The parts of edge tiles past the end
+                    // of the image are always zero.
+                    bool whole = (x0 == tx * tileWidth && x1 == min(width, (tx + 1) * tileWidth) &&
+                                  y0 == ty * tileHeight && y1 == min(height, (ty + 1) * tileHeight) &&
+                                  t0 == tt * tileFrames && t1 == min(frames, (tt + 1) * tileFrames) &&
+                                  c0 == tc * tileChannels && c1 == min(channels, (tc + 1) * tileChannels));
+                    if (whole) {
+                        std::fill(tile.begin(), tile.end(), 0.0f);
+                    } else {
+                        readTile(i, &tile[0]);
+                    }
+
+                    for (int ch = c0; ch < c1; ch++) {
+                        for (int t = t0; t < t1; t++) {
+                            for (int y = y0; y < y1; y++) {
+                                float *dst = &tile[0] +
+                                    (((size_t)(ch - tc * tileChannels) * tileFrames +
+                                      (t - tt * tileFrames)) * tileHeight +
+                                     (y - ty * tileHeight)) * tileWidth + (x0 - tx * tileWidth);
+                                memcpy(dst, &im(x0 - xoff, y - yoff, t - toff, ch - coff),
+                                       (x1 - x0) * sizeof(float));
+                            }
+                        }
+                    }
+
+                    writeTile(i, &tile[0]);
+                }
+            }
+        }
+    }
+    fflush(file);
+}
+
+TiledFile::Iterator::Iterator(TiledFile &file, int bw, int bh, int bf, int bc) :
+    x(0), y(0), t(0), c(0), tiled(file),
+    blockWidth(bw > 0 ? bw : file.tileWidth),
+    blockHeight(bh > 0 ? bh : file.tileHeight),
+    blockFrames(bf > 0 ? bf : file.tileFrames),
+    blockChannels(bc > 0 ? bc : file.tileChannels) {
+    clip();
+}
+
+bool TiledFile::Iterator::done() const {
+    return c >= tiled.channels;
+}
+
+void TiledFile::Iterator::next() {
+    x += blockWidth;
+    if (x >= tiled.width) {
+        x = 0;
+        y += blockHeight;
+    }
+    if (y >= tiled.height) {
+        y = 0;
+        t += blockFrames;
+    }
+    if (t >= tiled.frames) {
+        t = 0;
+        c += blockChannels;
+    }
+    clip();
+}
+
+void TiledFile::Iterator::clip() {
+    width = min(blockWidth, tiled.width - x);
+    height = min(blockHeight, tiled.height - y);
+    frames = min(blockFrames, tiled.frames - t);
+    channels = min(blockChannels, tiled.channels - c);
+}
+
+Image TiledFile::Iterator::read() const {
+    return tiled.read(x, y, t, c, width, height, frames, channels);
+}
+
+void TiledFile::Iterator::write(Image im) const {
+    tiled.write(im, x, y, t, c);
+}
+
+void save(Image im, string filename, string type) {
+    TiledFile out(filename, im.width, im.height, im.frames, im.channels, type);
+    out.write(im, 0, 0, 0, 0);
+}
+
+Image load(string filename) {
+    TiledFile in(filename);
+    return in.read(0, 0, 0, 0, in.width, in.height, in.frames, in.channels);
+}
+
+}
+#include "footer.h"
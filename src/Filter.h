@@ -7,7 +7,20 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
-    static Image apply(Image im, float filterWidth, float filterHeight, float filterFrames);
+    int footprint(vector<string> args);
+
+    // Exact convolves by a gaussian truncated at three standard
+    // deviations. Recursive uses a third order recursive filter (van
+    // Vliet, Young, and Verbeek), whose cost doesn't depend on the
+    // standard deviation.
+    enum Method {Exact = 0, Recursive};
+
+    static Image apply(Image im, float filterWidth, float filterHeight, float filterFrames,
+                       Method method = Exact);
+private:
+    // Blur one dimension (0, 1, or 2 for x, y, or t) of an image in
+    // place with the recursive filter
+    static void recursive(Image im, float sigma, int dimension);
 };
 
 class FastBlur : public Operation {
@@ -15,14 +28,12 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string> args);
     static void apply(Image im, float filterWidth, float filterHeight, float filterFrames);
 private:
     // helper function for IIR filtering
     static void calculateCoefficients(float sigma, float *c0, float *c1, float *c2, float *c3);
 
-    // filter a 16-wide chunk of data in place with the given iir coefficients
-    static void blurChunk(float *data, int size, float c0, float c1, float c2, float c3);
-
     // compute the inverse of the attenuation due to the zero boundary condition
     static void computeAttenuation(float *data, int size, int width, float c0, float c1, float c2, float c3, int iterations);
 };
@@ -32,13 +43,13 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string> args);
     static void apply(Image im, int filterWidth, int filterHeight, int filterFrames, int iterations = 1);
 
 private:
     static void blurX(Image im, int filterSize, int iterations = 1);
     static void blurY(Image im, int filterSize, int iterations = 1);
     static void blurT(Image im, int filterSize, int iterations = 1);
-    static void blurXCompletely(Image im);
 };
 
 
@@ -47,6 +58,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string> args);
     static Image apply(Image im, float filterWidth, float filterHeight, float filterFrames);
 };
 
@@ -55,6 +67,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static Image apply(Image im, int radius);
 };
 
@@ -63,6 +76,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static void apply(Image im, int radius);
 };
 
@@ -71,6 +85,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static void apply(Image im, int radius);
 };
 
@@ -79,6 +94,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
     static Image apply(Image im, int radius, float percentile);
 };
 
@@ -1,6 +1,10 @@
 #ifndef IMAGESTACK_FUNC_H
 #define IMAGESTACK_FUNC_H
 
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
 #include "Image.h"
 #include "header.h"
 
@@ -14,34 +18,109 @@ namespace Expr {
         std::string name;
         int size[4];
 
-        vector<int> evaluated;
+        // The state of each scanline of a lazy func. A thread claims
+        // a scanline by moving it from Pending to Running, and
+        // publishes the result by moving it to Done with release
+        // semantics, so a thread that sees Done (with acquire
+        // semantics) also sees the computed values.
+        enum {Pending = 0, Running, Done};
+        std::unique_ptr<std::atomic<int>[]> evaluated;
+
+        // Threads that find a scanline being computed by someone else
+        // spin for a little while, then sleep here until it's done.
+        std::mutex waitMutex;
+        std::condition_variable waitCondition;
+        std::atomic<int> waiters;
+
+        // Sliding window storage (see Func::slidingWindow). If
+        // windowRows is non-zero there is no backing for the whole
+        // required region. Instead each thread keeps a ring of the
+        // windowRows scanlines it computed most recently, tagged with
+        // which scanline each one holds.
+        int windowRows;
+        struct Window {
+            Image rows;
+            vector<int> tags;
+        };
+        vector<Window> windows;
+
+        BaseFunc() : waiters(0), windowRows(0) {}
+
+        int scanlineIndex(int y, int t, int c) const {
+            return ((c-minC) * (maxT-minT) + t-minT) * (maxY-minY) + y-minY;
+        }
 
         // Evaluate myself at the given scanline only if necessary
         void evalScanlineIfNeeded(int y, int t, int c) {
             if (!lazy) return;
            
-            int idx = ((c-minC) * im.frames + t-minT) * im.height + y;
-            if (!evaluated[idx])  {
-                // TODO: consider adding mem fences
-                evaluated[idx] = 1;
-                evalScanline(y, t, c);
-                evaluated[idx] = 2;
-            } else {            
-                while (evaluated[idx] < 2) {
-                    //printf("Stalling...\n");
-                    sched_yield();
+            std::atomic<int> &state = evaluated[scanlineIndex(y, t, c)];
+            if (state.load(std::memory_order_acquire) == Done) return;
+
+            int expected = Pending;
+            if (state.compare_exchange_strong(expected, Running, std::memory_order_acquire)) {
+                evalScanline(&im(0, y-minY, t-minT, c-minC) - minX, y, t, c);
+                state.store(Done, std::memory_order_seq_cst);
+                if (waiters.load(std::memory_order_seq_cst)) {
+                    // Take the lock so a waiter can't miss the
+                    // wakeup between checking the state and sleeping
+                    std::lock_guard<std::mutex> lock(waitMutex);
+                    waitCondition.notify_all();
                 }
-            }            
+                return;
+            }
+
+            // Someone else is computing it. Most scanlines are quick,
+            // so spin briefly before going to sleep.
+            for (int i = 0; i < 1024; i++) {
+                if (state.load(std::memory_order_acquire) == Done) return;
+            }
+
+            std::unique_lock<std::mutex> lock(waitMutex);
+            waiters++;
+            while (state.load(std::memory_order_seq_cst) != Done) {
+                waitCondition.wait(lock);
+            }
+            waiters--;
+        }
+
+        // Get the given scanline from this thread's window, computing
+        // it if it isn't there. The result is a single row with zero
+        // y, t, and c strides, so it can be indexed with the same
+        // coordinates as the full backing would be.
+        Image windowScanline(int y, int t, int c) {
+            int thread = 0;
+            #ifdef _OPENMP
+            thread = omp_get_thread_num();
+            #endif
+            assert(thread < (int)windows.size(),
+                   "Sliding window func evaluated by more threads than expected\n");
+            Window &w = windows[thread];
+            int slot = (y - minY) % windowRows;
+            Image row = w.rows.row(slot);
+            row.ystride = row.tstride = row.cstride = 0;
+            int tag = scanlineIndex(y, t, c);
+            if (w.tags[slot] != tag) {
+                evalScanline(&row(0, 0, 0, 0) - minX, y, t, c);
+                w.tags[slot] = tag;
+            }
+            return row;
         }
 
         _Shift<Image>::Iter scanline(int x, int y, int t, int c, int width) {
-            evalScanlineIfNeeded(y, t, c);
-            Image::Iter iter = im.scanline(x-minX, y-minY, t-minT, c-minC, width);
+            Image backing = im;
+            if (windowRows) {
+                backing = windowScanline(y, t, c);
+            } else {
+                evalScanlineIfNeeded(y, t, c);
+            }
+            Image::Iter iter = backing.scanline(x-minX, y-minY, t-minT, c-minC, width);
             return _Shift<Image>::Iter(iter, minX);            
         }
 
-        // Evaluate myself into buffer at the given scanline. 
-        virtual void evalScanline(int y, int t, int c) = 0;
+        // Evaluate myself into buffer at the given scanline. dst
+        // points to where x = 0 would go.
+        virtual void evalScanline(float *dst, int y, int t, int c) = 0;
 
         // Prepare to be evaluated over a given region
         virtual void prepare(Region r, int phase) = 0;
@@ -74,7 +153,7 @@ namespace Expr {
             m.set(expr);
         }
 
-        void evalScanline(int y, int t, int c) {
+        void evalScanline(float *const dst, int y, int t, int c) {
             
             //printf("Evaluating %s(%p) at scanline %d-%d %d %d %d\n",
             //name.c_str(), this, minX, maxX, y, t, c);
@@ -91,11 +170,7 @@ namespace Expr {
             */
 
             //printf("Image has size: %d %d %d %d\n", im.width, im.height, im.frames, im.channels);
-            //printf("Computing destination address...\n");
-            float *const dst = &im(0, y-minY, t-minT, c-minC) - minX;
-
-            //printf("Destination address is %p.\n"
-            //"Computing source iterator...\n", dst);
+            //printf("Computing source iterator...\n");
             typename T::Iter src = expr.scanline(minX, y, t, c, maxX-minX);
             
             //printf("Done. Running kernel...\n");
@@ -145,7 +220,10 @@ namespace Expr {
                     maxC = std::max(r.c + r.channels, maxC);
                 }
                 if (phaseCount == count) {
-                    if (!im.defined() ||                            
+                    if (windowRows) {
+                        // Windows are allocated per thread at evaluation time
+                        im = Image();
+                    } else if (!im.defined() ||                            
                         im.width < maxX - minX ||
                         im.height < maxY - minY ||
                         im.frames < maxT - minT ||
@@ -177,9 +255,25 @@ namespace Expr {
                     phaseCount = 1;
                     expr.prepare(r, 2);
 
-                    if (lazy) {
+                    if (windowRows) {
+                        // Give each thread an empty ring of scanlines
+                        int threads = 1;
+                        #ifdef _OPENMP
+                        threads = omp_get_max_threads();
+                        #endif
+                        windows.resize(threads);
+                        for (int i = 0; i < threads; i++) {
+                            windows[i].rows = Image(maxX - minX + Vec::width, windowRows, 1, 1,
+                                                    Image::UNINITIALIZED);
+                            windows[i].tags.assign(windowRows, -1);
+                        }
+                    } else if (lazy) {
                         // No scanlines have been evaluated
-                        evaluated.assign((maxY - minY)*(maxT - minT)*(maxC - minC), false);
+                        size_t scanlines = (size_t)(maxY - minY)*(maxT - minT)*(maxC - minC);
+                        evaluated.reset(new std::atomic<int>[scanlines]);
+                        for (size_t i = 0; i < scanlines; i++) {
+                            evaluated[i].store(Pending, std::memory_order_relaxed);
+                        }
                     } else {
                         /*
                         printf("Evaluating %s(%p) over %d %d %d %d %d %d %d %d\n",
@@ -187,16 +281,10 @@ namespace Expr {
                                maxX-minX, maxY-minY, maxT-minT, maxC-minC);
                         */
                         // evaluate all scanlines here
-                        for (int ec = minC; ec < maxC; ec++) {
-                            for (int et = minT; et < maxT; et++) {
-                                #ifdef _OPENMP
-                                #pragma omp parallel for
-                                #endif
-                                for (int ey = minY; ey < maxY; ey++) {
-                                    evalScanline(ey, et, ec);
-                                }
-                            }
-                        }
+                        forEachScanline(minY, maxY, minT, maxT, minC, maxC, maxX - minX,
+                                        [&](int ey, int et, int ec) {
+                            evalScanline(&im(0, ey-minY, et-minT, ec-minC) - minX, ey, et, ec);
+                        });
                         //printf("Done evaluating %s(%p)\n", name.c_str(), this);
                     }                                
                 } else {
@@ -206,6 +294,8 @@ namespace Expr {
             } else if (phase == 3) {
                 // clean up
                 im = Image();
+                evaluated.reset();
+                windows.clear();
             }                       
 
             lastPhase = phase;
@@ -287,7 +377,15 @@ namespace Expr {
                 auto syIter = (sy-ptr->minY).scanline(x, y, t, c, width);
                 auto stIter = (st-ptr->minT).scanline(x, y, t, c, width);
                 auto scIter = (sc-ptr->minC).scanline(x, y, t, c, width);
-                if (ptr->lazy) {
+                if (ptr->windowRows) {
+                    assert(AffineCase || ShiftedCase,
+                           "A func stored in a sliding window can only be sampled "
+                           "at a single scanline per output scanline\n");
+                    Image row = ptr->windowScanline(syIter[0]+ptr->minY,
+                                                    stIter[0]+ptr->minT,
+                                                    scIter[0]+ptr->minC);
+                    return Iter(row, sxIter, syIter, stIter, scIter);
+                } else if (ptr->lazy) {
                     if (AffineCase || ShiftedCase) {
                         ptr->evalScanlineIfNeeded(syIter[0]+ptr->minY, 
                                                   stIter[0]+ptr->minT, 
@@ -416,12 +514,30 @@ namespace Expr {
             return std::make_pair(-INF, INF);
         }
         
+        // Compute scanlines on demand, keeping every one computed
         void lazy() {
             ptr->lazy = true;
+            ptr->windowRows = 0;
         }
         
+        // Compute the entire required region before it's used
         void eager() {
             ptr->lazy = false;
+            ptr->windowRows = 0;
+        }
+
+        // Compute scanlines on demand, but only keep the last few
+        // computed by each thread, so the storage is a few rows
+        // rather than the whole image and stays in cache. rows must
+        // span all the scanlines of this func that are read to
+        // compute one scanline of the consumer (e.g. 3 for a three-tap
+        // vertical blur), and those scanlines must all come from the
+        // same frame and channel. Consumers walk down their output in chunks,
+        // so each chunk recomputes the rows above its first scanline.
+        void slidingWindow(int rows) {
+            assert(rows > 0, "A sliding window must have at least one row\n");
+            ptr->lazy = true;
+            ptr->windowRows = rows;
         }
 
         // Evaluate yourself into an existing image
@@ -0,0 +1,85 @@
+#include "ImageStack.h"
+#include "Func.h"
+#include <omp.h>
+
+using namespace ImageStack;
+using namespace ImageStack::Expr;
+
+// A stress test for lazy Func evaluation. It builds deep chains of
+// lazy funcs in which every level reads three scanlines of the level
+// below, like the levels of a pyramid, so many threads race to claim
+// the same scanlines. Each result is checked against the same chain
+// evaluated eagerly, and the chain is also run with its
+// intermediates stored in sliding windows.
+//
+// To look for data races, build it and the rest of ImageStack with
+// -fsanitize=thread. OpenMP runtimes that aren't themselves built
+// with thread sanitizer support report false positives in their own
+// barriers, so use one that is (e.g. llvm's libomp built with
+// LIBOMP_TSAN_SUPPORT).
+//
+// Usage: Func_stress_test [iterations]
+
+typedef enum {Lazy = 0, Eager, Window} Schedule;
+
+Func blurChain(Image in, int depth, Schedule schedule) {
+    X x; Y y; C c;
+    Func f = zeroBoundary(in);
+    for (int i = 0; i < depth; i++) {
+        if (schedule == Window && i > 0) {
+            // Each level is read one scanline at a time by the next
+            f.slidingWindow(1);
+        }
+        Func blurX = (f(x-1, y, c) + 2*f(x, y, c) + f(x+1, y, c))/4;
+        f = (blurX(x, y-1, c) + 2*blurX(x, y, c) + blurX(x, y+1, c))/4;
+        if (schedule == Eager) {
+            blurX.eager();
+            f.eager();
+        } else if (schedule == Window) {
+            blurX.slidingWindow(3);
+        }
+    }
+    return f;
+}
+
+int main(int argc, char **argv) {
+    start();
+
+    int iterations = argc > 1 ? atoi(argv[1]) : 100;
+    const int depth = 8;
+
+    try {
+        for (int i = 0; i < iterations; i++) {
+            // Vary the shape, so that scanlines are sometimes cheap
+            // and contended, and sometimes long
+            int w = 1 + rand() % 512;
+            int h = 1 + rand() % 256;
+            int c = 1 + rand() % 3;
+            Image in(w, h, 1, c);
+            for (int ic = 0; ic < c; ic++) {
+                for (int y = 0; y < h; y++) {
+                    for (int x = 0; x < w; x++) {
+                        in(x, y, 0, ic) = (float)rand() / RAND_MAX;
+                    }
+                }
+            }
+
+            Image lazyResult(w, h, 1, c), eagerResult(w, h, 1, c), windowResult(w, h, 1, c);
+            lazyResult.set(blurChain(in, depth, Lazy));
+            eagerResult.set(blurChain(in, depth, Eager));
+            windowResult.set(blurChain(in, depth, Window));
+
+            if (!nearlyEqual(lazyResult, eagerResult) ||
+                !nearlyEqual(windowResult, eagerResult)) {
+                printf("Mismatch on iteration %d (%d x %d x %d)\n", i, w, h, c);
+                return 1;
+            }
+        }
+    } catch (Exception &e) {
+        printf("Failure: %s\n", e.message);
+        return 1;
+    }
+
+    printf("Passed\n");
+    return 0;
+}
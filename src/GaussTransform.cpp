@@ -63,11 +63,89 @@ bool GaussTransform::test() {
     out = out.channel(0) / out.channel(1);
     if (!nearlyEqual(out, correct)) return false;
 
+    // Splat into several private copies of the grid, then into a grid
+    // coarsened to fit in very little memory
+    for (int i = 0; i < 2; i++) {
+        DenseGrid grid(3, 2, 5);
+        vector<float> pos(3), val(2);
+        for (int t = 0; t < 2; t++) {
+            Image positions = t ? slice : splat;
+            for (int y = 0; y < positions.height; y++) {
+                for (int x = 0; x < positions.width; x++) {
+                    for (int c = 0; c < 3; c++) {
+                        pos[c] = positions(x, y, 0, c) / sigma[c];
+                    }
+                    grid.preview(&pos[0]);
+                }
+            }
+        }
+        int copies = grid.beginSplat(4, i ? 1 : ((size_t)1 << 30));
+        if (copies != (i ? 1 : 4)) return false;
+        for (int y = 0; y < splat.height; y++) {
+            for (int x = 0; x < splat.width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    pos[c] = splat(x, y, 0, c) / sigma[c];
+                }
+                val[0] = values(x, y, 0, 0);
+                val[1] = values(x, y, 0, 1);
+                grid.splat(&pos[0], &val[0], x % copies);
+            }
+        }
+        grid.blur();
+        out = Image(slice.width, slice.height, 1, 1);
+        for (int y = 0; y < slice.height; y++) {
+            for (int x = 0; x < slice.width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    pos[c] = slice(x, y, 0, c) / sigma[c];
+                }
+                grid.slice(&pos[0], &val[0]);
+                out(x, y) = val[0] / val[1];
+            }
+        }
+        if (!nearlyEqual(out, correct.frame(0))) return false;
+    }
+
     printf("Testing permutohedral lattice\n");
     out = GaussTransform::apply(slice, splat, values, sigma, PERMUTOHEDRAL);
     out = out.channel(0) / out.channel(1);
     if (!nearlyEqual(out, correct)) return false;
 
+    // Splat without sizing the lattice first, so that it fills up
+    // and grows part way through, with values summed atomically and
+    // then in input order
+    {
+        Image positions(200, 100, 1, 3);
+        Noise::apply(positions, 0, 100);
+        const int inputs = positions.width * positions.height;
+        Image results[2];
+        for (int deterministic = 0; deterministic < 2; deterministic++) {
+            PermutohedralLattice lattice(3, 1, inputs, deterministic);
+            vector<char> done(inputs, 0);
+            for (bool finished = false; !finished;) {
+                finished = true;
+                #ifdef _OPENMP
+                #pragma omp parallel for reduction(&&:finished)
+                #endif
+                for (int i = 0; i < inputs; i++) {
+                    if (done[i]) { continue; }
+                    float pos[3], val = 1;
+                    for (int c = 0; c < 3; c++) {
+                        pos[c] = positions(i % 200, i / 200, 0, c);
+                    }
+                    done[i] = lattice.splat(pos, &val, i);
+                    finished = finished && done[i];
+                }
+                if (!finished) { lattice.grow(); }
+            }
+            lattice.blur();
+            results[deterministic] = Image(positions.width, positions.height, 1, 1);
+            for (int i = 0; i < inputs; i++) {
+                lattice.slice(&results[deterministic](i % 200, i / 200), i);
+            }
+        }
+        if (!nearlyEqual(results[0], results[1])) return false;
+    }
+
     printf("Testing Gaussian kd-tree\n");
     out = GaussTransform::apply(slice, splat, values, sigma, GKDTREE);
     out = out.channel(0) / out.channel(1);
@@ -161,27 +239,56 @@ Image GaussTransform::apply(Image slice, Image splat, Image values,
         return out;
     }
     case PERMUTOHEDRAL: {
-        // Create lattice
-        PermutohedralLattice lattice(splat.channels, values.channels,
-                                     values.width*values.height*values.frames);
-
-        // Splat into the lattice
-        //printf("Splatting...\n");
+        // Create lattice. Setting IMAGESTACK_DETERMINISTIC makes the
+        // result independent of how the work is split across threads.
+        const int inputs = values.width*values.height*values.frames;
+        PermutohedralLattice lattice(splat.channels, values.channels, inputs,
+                                     getenv("IMAGESTACK_DETERMINISTIC") != NULL);
 
+        // Size the lattice from an evenly spread sample of the inputs
         vector<float> pos(splat.channels);
-        vector<float> val(values.channels);
-        for (int t = 0; t < splat.frames; t++) {
-            for (int y = 0; y < splat.height; y++) {
-                for (int x = 0; x < splat.width; x++) {
+        const int sampleStride = std::max(1, inputs / 16384);
+        for (int i = 0; i < inputs; i += sampleStride) {
+            const int x = i % splat.width;
+            const int y = (i / splat.width) % splat.height;
+            const int t = i / (splat.width * splat.height);
+            for (int c = 0; c < splat.channels; c++) {
+                pos[c] = splat(x, y, t, c) * invSigma[c];
+            }
+            lattice.preview(&pos[0]);
+        }
+        lattice.beginSplat();
+
+        // Splat into the lattice in parallel over scanlines. If the
+        // lattice fills up, grow it and carry on from where each
+        // scanline stopped.
+        //printf("Splatting...\n");
+        const int splatRows = splat.frames * splat.height;
+        vector<int> splatted(splatRows, 0);
+        bool finished = false;
+        while (!finished) {
+            finished = true;
+            #ifdef _OPENMP
+            #pragma omp parallel for schedule(dynamic, 1) reduction(&&:finished)
+            #endif
+            for (int r = 0; r < splatRows; r++) {
+                const int t = r / splat.height, y = r % splat.height;
+                vector<float> splatPos(splat.channels);
+                vector<float> splatVal(values.channels);
+                int x = splatted[r];
+                for (; x < splat.width; x++) {
                     for (int c = 0; c < splat.channels; c++) {
-                        pos[c] = splat(x, y, t, c) * invSigma[c];
+                        splatPos[c] = splat(x, y, t, c) * invSigma[c];
                     }
                     for (int c = 0; c < values.channels; c++) {
-                        val[c] = values(x, y, t, c);
+                        splatVal[c] = values(x, y, t, c);
                     }
-                    lattice.splat(&pos[0], &val[0]);
+                    if (!lattice.splat(&splatPos[0], &splatVal[0], r * splat.width + x)) { break; }
                 }
+                splatted[r] = x;
+                finished = finished && x == splat.width;
             }
+            if (!finished) { lattice.grow(); }
         }
 
         // Blur the lattice
@@ -193,81 +300,89 @@ Image GaussTransform::apply(Image slice, Image splat, Image values,
 
         Image out(slice.width, slice.height, slice.frames, values.channels);
 
-        if (slice == splat) {
-            lattice.beginSlice();
-            for (int t = 0; t < slice.frames; t++) {
-                for (int y = 0; y < slice.height; y++) {
-                    for (int x = 0; x < slice.width; x++) {
-                        lattice.slice(&val[0]);
-                        for (int c = 0; c < out.channels; c++) {
-                            out(x, y, t, c) = val[c];
-                        }
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 1)
+        #endif
+        for (int r = 0; r < slice.frames * slice.height; r++) {
+            const int t = r / slice.height, y = r % slice.height;
+            const bool replay = slice == splat;
+            vector<float> slicePos(slice.channels);
+            vector<float> sliceVal(values.channels);
+            for (int x = 0; x < slice.width; x++) {
+                if (replay) {
+                    lattice.slice(&sliceVal[0], r * slice.width + x);
+                } else {
+                    for (int c = 0; c < slice.channels; c++) {
+                        slicePos[c] = slice(x, y, t, c) * invSigma[c];
                     }
+                    lattice.slice(&slicePos[0], &sliceVal[0]);
                 }
-            }
-        } else {
-            for (int t = 0; t < slice.frames; t++) {
-                for (int y = 0; y < slice.height; y++) {
-                    for (int x = 0; x < slice.width; x++) {
-                        for (int c = 0; c < slice.channels; c++) {
-                            pos[c] = slice(x, y, t, c) * invSigma[c];
-                        }
-                        lattice.slice(&pos[0], &val[0]);
-                        for (int c = 0; c < out.channels; c++) {
-                            out(x, y, t, c) = val[c];
-                        }
-                    }
+                for (int c = 0; c < out.channels; c++) {
+                    out(x, y, t, c) = sliceVal[c];
                 }
             }
         }
 
-
         return out;
     }
     case GRID: {
         // Create grid
         DenseGrid grid(splat.channels, values.channels, 5);
 
-        // Splat into the grid
-
+        // The grid spans the bounding box of the positions
         vector<float> pos(splat.channels);
-        vector<float> val(values.channels);
 
         //printf("Allocating...\n");
-        for (int t = 0; t < splat.frames; t++) {
-            for (int y = 0; y < splat.height; y++) {
-                for (int x = 0; x < splat.width; x++) {
-                    for (int c = 0; c < splat.channels; c++) {
-                        pos[c] = splat(x, y, t, c) * invSigma[c];
-                    }
-                    grid.preview(&pos[0]);
-                }
+        {
+            Stats stats(splat);
+            for (int c = 0; c < splat.channels; c++) {
+                pos[c] = stats.minimum(c) * invSigma[c];
+            }
+            grid.preview(&pos[0]);
+            for (int c = 0; c < splat.channels; c++) {
+                pos[c] = stats.maximum(c) * invSigma[c];
             }
+            grid.preview(&pos[0]);
         }
         if (splat != slice) {
-            for (int t = 0; t < slice.frames; t++) {
-                for (int y = 0; y < slice.height; y++) {
-                    for (int x = 0; x < slice.width; x++) {
-                        for (int c = 0; c < slice.channels; c++) {
-                            pos[c] = slice(x, y, t, c) * invSigma[c];
-                        }
-                        grid.preview(&pos[0]);
-                    }
-                }
+            Stats stats(slice);
+            for (int c = 0; c < slice.channels; c++) {
+                pos[c] = stats.minimum(c) * invSigma[c];
             }
+            grid.preview(&pos[0]);
+            for (int c = 0; c < slice.channels; c++) {
+                pos[c] = stats.maximum(c) * invSigma[c];
+            }
+            grid.preview(&pos[0]);
         }
 
+        // Splat into the grid. Each thread splats a band of scanlines
+        // into its own copy of the grid, and the copies are summed
+        // before blurring.
         //printf("Splatting...\n");
-        for (int t = 0; t < splat.frames; t++) {
-            for (int y = 0; y < splat.height; y++) {
+        int threads = 1;
+        #ifdef _OPENMP
+        threads = omp_get_max_threads();
+        #endif
+        const int copies = grid.beginSplat(threads);
+        const int splatRows = splat.frames * splat.height;
+
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(static, 1)
+        #endif
+        for (int copy = 0; copy < copies; copy++) {
+            vector<float> splatPos(splat.channels);
+            vector<float> splatVal(values.channels);
+            for (int r = splatRows * copy / copies; r < splatRows * (copy + 1) / copies; r++) {
+                const int t = r / splat.height, y = r % splat.height;
                 for (int x = 0; x < splat.width; x++) {
                     for (int c = 0; c < splat.channels; c++) {
-                        pos[c] = splat(x, y, t, c) * invSigma[c];
+                        splatPos[c] = splat(x, y, t, c) * invSigma[c];
                     }
                     for (int c = 0; c < values.channels; c++) {
-                        val[c] = values(x, y, t, c);
+                        splatVal[c] = values(x, y, t, c);
                     }
-                    grid.splat(&pos[0], &val[0]);
+                    grid.splat(&splatPos[0], &splatVal[0], copy);
                 }
             }
         }
@@ -280,16 +395,20 @@ Image GaussTransform::apply(Image slice, Image splat, Image values,
 
         Image out(slice.width, slice.height, slice.frames, values.channels);
 
-        for (int t = 0; t < slice.frames; t++) {
-            for (int y = 0; y < slice.height; y++) {
-                for (int x = 0; x < slice.width; x++) {
-                    for (int c = 0; c < slice.channels; c++) {
-                        pos[c] = slice(x, y, t, c) * invSigma[c];
-                    }
-                    grid.slice(&pos[0], &val[0]);
-                    for (int c = 0; c < out.channels; c++) {
-                        out(x, y, t, c) = val[c];
-                    }
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 1)
+        #endif
+        for (int r = 0; r < slice.frames * slice.height; r++) {
+            const int t = r / slice.height, y = r % slice.height;
+            vector<float> slicePos(slice.channels);
+            vector<float> sliceVal(values.channels);
+            for (int x = 0; x < slice.width; x++) {
+                for (int c = 0; c < slice.channels; c++) {
+                    slicePos[c] = slice(x, y, t, c) * invSigma[c];
+                }
+                grid.slice(&slicePos[0], &sliceVal[0]);
+                for (int c = 0; c < out.channels; c++) {
+                    out(x, y, t, c) = sliceVal[c];
                 }
             }
         }
@@ -0,0 +1,72 @@
+#include "ImageStack.h"
+
+using namespace ImageStack;
+
+// Compares the recursive gaussian blur with the exact one, for
+// standard deviations from half a pixel up. For each, prints the
+// largest and the RMS difference on a noise image with values in [0,
+// 1], the largest difference on an image of a single impulse relative
+// to the peak of the exact blur, and the time in milliseconds taken by
+// each method.
+//
+// Usage: GaussianBlur_test [width height]
+
+template<typename F>
+double bestTime(F f) {
+    double best = 1e10;
+    for (int i = 0; i < 3; i++) {
+        double t1 = currentTime();
+        f();
+        best = std::min(best, currentTime() - t1);
+    }
+    return best * 1000;
+}
+
+int main(int argc, char **argv) {
+    start();
+
+    int width = 1000, height = 1000;
+    if (argc > 2) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+
+    printf("%8s %12s %12s %12s %12s %12s\n", "sigma",
+           "max diff", "rms diff", "impulse", "exact ms", "recursive ms");
+
+    try {
+        Image noise(width, height, 1, 1);
+        Noise::apply(noise, 0, 1);
+        Image impulse(width, height, 1, 1);
+        impulse(width/2, height/2) = 1;
+
+        const float sigmas[] = {0.5f, 0.7f, 1, 1.5f, 2, 3, 5, 8, 16, 32, 64, 128};
+        for (size_t i = 0; i < sizeof(sigmas)/sizeof(sigmas[0]); i++) {
+            const float s = sigmas[i];
+            Image exact, recursive;
+            double t1 = bestTime([&]() {
+                exact = GaussianBlur::apply(noise, s, s, 0);
+            });
+            double t2 = bestTime([&]() {
+                recursive = GaussianBlur::apply(noise, s, s, 0, GaussianBlur::Recursive);
+            });
+            Image diff = recursive - exact;
+            Stats stats(diff);
+            double maxDiff = std::max(fabs(stats.maximum()), fabs(stats.minimum()));
+            double rms = ::sqrt(Stats(diff * diff).mean());
+
+            exact = GaussianBlur::apply(impulse, s, s, 0);
+            recursive = GaussianBlur::apply(impulse, s, s, 0, GaussianBlur::Recursive);
+            Stats impulseStats(recursive - exact);
+            double impulseDiff = std::max(fabs(impulseStats.maximum()), fabs(impulseStats.minimum()));
+            impulseDiff /= Stats(exact).maximum();
+
+            printf("%8g %12.2e %12.2e %12.2e %12.2f %12.2f\n",
+                   s, maxDiff, rms, impulseDiff, t1, t2);
+        }
+    } catch (Exception &e) {
+        printf("Failure: %s\n", e.message);
+    }
+
+    return 0;
+}
@@ -34,6 +34,10 @@ bool Upsample::test() {
     return true;
 }
 
+int Upsample::footprint(vector<string> args) {
+    return (args.size() < 3 || readInt(args[2]) == 1) ? PER_FRAME : WHOLE_VOLUME;
+}
+
 void Upsample::parse(vector<string> args) {
     int boxWidth = 2, boxHeight = 2, boxFrames = 1;
     assert(args.size() <= 3, "-upsample takes three or fewer arguments\n");
@@ -103,6 +107,10 @@ bool Downsample::test() {
     return true;
 }
 
+int Downsample::footprint(vector<string> args) {
+    return (args.size() < 3 || readInt(args[2]) == 1) ? PER_FRAME : WHOLE_VOLUME;
+}
+
 void Downsample::parse(vector<string> args) {
     int boxWidth = 2, boxHeight = 2, boxFrames = 1;
     assert(args.size() <= 3, "-downsample takes three or fewer arguments\n");
@@ -187,6 +195,10 @@ bool Resample::test() {
     return true;
 }
 
+int Resample::footprint(vector<string> args) {
+    return args.size() == 2 ? PER_FRAME : WHOLE_VOLUME;
+}
+
 void Resample::parse(vector<string> args) {
 
     if (args.size() == 2) {
@@ -584,6 +596,10 @@ bool Rotate::test() {
 }
 
 
+int Rotate::footprint(vector<string>) {
+    return PER_FRAME;
+}
+
 void Rotate::parse(vector<string> args) {
     assert(args.size() == 1, "-rotate takes one argument\n");
     Image im = apply(stack(0), readFloat(args[0]));
@@ -636,7 +652,10 @@ Image AffineWarp::apply(Image im, vector<float> matrix) {
 }
 
 Image AffineWarp::apply(Image im, float *matrix) {
-    Image out(im.width, im.height, im.frames, im.channels);
+    // sample2D reads every channel of each tap, so it's cheaper to
+    // work with interleaved channels and convert back at the end
+    im = im.toLayout(Image::INTERLEAVED);
+    Image out(im.width, im.height, im.frames, im.channels, Image::INTERLEAVED);
 
     vector<float> sample(im.channels);
     for (int t = 0; t < im.frames; t++) {
@@ -658,7 +677,7 @@ Image AffineWarp::apply(Image im, float *matrix) {
         }
     }
 
-    return out;
+    return out.toLayout(Image::PLANAR);
 }
 
 void Crop::help() {
@@ -708,6 +727,11 @@ bool Crop::test() {
     return true;
 }
 
+int Crop::footprint(vector<string> args) {
+    // Cropping with no arguments looks at every frame to find the bounds
+    return args.size() == 4 ? PER_FRAME : WHOLE_VOLUME;
+}
+
 void Crop::parse(vector<string> args) {
 
     Image im;
@@ -870,6 +894,10 @@ bool Flip::test() {
     return true;
 }
 
+int Flip::footprint(vector<string> args) {
+    return (args.size() == 1 && args[0] != "t") ? PER_FRAME : WHOLE_VOLUME;
+}
+
 void Flip::parse(vector<string> args) {
     assert(args.size() == 1, "-flip takes exactly one argument\n");
     char dimension = readChar(args[0]);
@@ -1181,6 +1209,10 @@ bool Translate::test() {
     return (nearlyEqual(s.mean(), 0) && nearlyEqual(s.variance(), 0));
 }
 
+int Translate::footprint(vector<string> args) {
+    return (args.size() == 2 || (args.size() == 3 && readFloat(args[2]) == 0)) ? PER_FRAME : WHOLE_VOLUME;
+}
+
 void Translate::parse(vector<string> args) {
     if (args.size() == 2) {
         Image im = apply(stack(0), readFloat(args[0]), readFloat(args[1]), 0);
@@ -1727,7 +1759,8 @@ void Warp::parse(vector<string> args) {
 
 Image Warp::apply(Image coords, Image source) {
 
-    Image out(coords.width, coords.height, coords.frames, source.channels);
+    source = source.toLayout(Image::INTERLEAVED);
+    Image out(coords.width, coords.height, coords.frames, source.channels, Image::INTERLEAVED);
 
     vector<float> sample(out.channels);
     if (coords.channels == 3) {
@@ -1758,7 +1791,7 @@ Image Warp::apply(Image coords, Image source) {
     } else {
         panic("index image must have two or three channels\n");
     }
-    return out;
+    return out.toLayout(Image::PLANAR);
 }
 
 
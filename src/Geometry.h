@@ -7,6 +7,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string> args);
     static Image apply(Image im, int boxWidth, int boxHeight, int boxFrames = 1);
 };
 
@@ -15,6 +16,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string> args);
     static Image apply(Image im, int boxWidth, int boxHeight, int boxFrames = 1);
 };
 
@@ -51,6 +53,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string> args);
     static Image apply(Image im, int width, int height);
     static Image apply(Image im, int width, int height, int frames);
 private:
@@ -65,6 +68,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string> args);
     static Image apply(Image im, float degrees);
 };
 
@@ -82,6 +86,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string> args);
     static Image apply(Image im, int minX, int minY, int width, int height);
     static Image apply(Image im, int minX, int minY, int minT, int width, int height, int frames);
     static Image apply(Image im);
@@ -92,6 +97,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string> args);
     static void apply(Image im, char dimension);
 };
 
@@ -116,6 +122,7 @@ public:
     void help();
     bool test();
     void parse(vector<string> args);
+    int footprint(vector<string> args);
     static Image apply(Image im, float xoff, float yoff, float toff = 0);
 private:
     static Image applyX(Image im, float xoff);
@@ -2,6 +2,8 @@
 #define IMAGESTACK_IMAGE_H
 
 #include "Expr.h"
+#include "BufferPool.h"
+#include <functional>
 
 #include "tables.h"
 #include "header.h"
@@ -16,6 +18,12 @@
 // are those which do not change the metadata, not those which do not
 // change the pixel data.
 
+// Pixel (x, y, t, c) lives at base[x*xstride + y*ystride + t*tstride +
+// c*cstride]. Images are planar by default (xstride is one, and each
+// channel is a separate volume), but they can also be allocated with
+// the channels of each pixel interleaved, which suits code that touches
+// every channel of a pixel at once.
+
 
 template<typename SX, typename SY, typename ST, typename SC, bool AffineCase, bool ShiftedCase>
 class ImageRef;
@@ -24,22 +32,60 @@ class Image {
 public:
 
     int width, height, frames, channels;
-    int ystride, tstride, cstride;
+    int xstride, ystride, tstride, cstride;
 
     Image() :
         width(0), height(0), frames(0), channels(0),
-        ystride(0), tstride(0), cstride(0), data(), base(NULL) {
+        xstride(0), ystride(0), tstride(0), cstride(0), data(), base(NULL) {
     }
 
-    Image(int w, int h, int f, int c) :
+    // Whether a newly allocated image should be cleared to
+    // zero. Skipping the clear is only safe for images whose every
+    // pixel is about to be overwritten.
+    typedef enum {ZEROED = 0, UNINITIALIZED} Initialization;
+
+    // PLANAR stores each channel as a separate volume. INTERLEAVED
+    // stores the channels of each pixel next to each other, so
+    // xstride == channels and cstride == 1.
+    typedef enum {PLANAR = 0, INTERLEAVED} Layout;
+
+    // Freshly allocated data is padded by this many floats: enough
+    // to walk forwards to a vector-aligned address, and still have
+    // at least one whole vector beyond the end, so that vectors can
+    // be pulled safely from the image even if they go off the end.
+    static const int padding = 2 * ImageStack::Expr::Vec::width;
+
+    Image(int w, int h, int f, int c, Initialization init = ZEROED) :
         width(w), height(h), frames(f), channels(c),
-        ystride(w), tstride(w * h), cstride(w * h * f),
-        data(new Payload(w * h * f * c + 16)), base(compute_base(data)) {
-        // + 16 so that we can walk forwards up to one avx vector
-        // width (8 floats) for alignment, and so that we have at
-        // least one vector worth of allocation beyond the end so that
-        // we can pull vectors safely from the image even if they go
-        // off the end
+        xstride(1), ystride(w), tstride(w * h), cstride(w * h * f),
+        data(new Payload((size_t)w * h * f * c + padding, init == ZEROED)),
+        base(compute_base(data)) {
+    }
+
+    Image(int w, int h, int f, int c, Layout layout, Initialization init = ZEROED) :
+        width(w), height(h), frames(f), channels(c),
+        xstride(layout == INTERLEAVED ? c : 1),
+        ystride(layout == INTERLEAVED ? w * c : w),
+        tstride(layout == INTERLEAVED ? w * h * c : w * h),
+        cstride(layout == INTERLEAVED ? 1 : w * h * f),
+        data(new Payload((size_t)w * h * f * c + padding * (layout == INTERLEAVED ? c : 1),
+                         init == ZEROED)),
+        base(compute_base(data)) {
+        // Vector loads from an interleaved image gather one value
+        // per pixel, so walking a vector off the end reaches
+        // further.
+    }
+
+    // Wrap planar storage for a w x h x f x c image that was
+    // allocated elsewhere, such as a memory-mapped file. The storage
+    // need not be aligned, but must be readable for at least
+    // padding floats past the end, like a freshly allocated image. release is
+    // called once no image refers to it any more.
+    Image(int w, int h, int f, int c, float *external, std::function<void()> release) :
+        width(w), height(h), frames(f), channels(c),
+        xstride(1), ystride(w), tstride(w * h), cstride(w * h * f),
+        data(new Payload(external, (size_t)w * h * f * c, release)),
+        base(external) {
     }
 
     inline float &operator()(int x) const {
@@ -63,15 +109,29 @@ public:
                "Access out of bounds: %d %d %d %d\n",
                x, y, t, c);
 #endif
-        return (((base + c*cstride) + t*tstride) + y*ystride)[x];
+        return (((base + c*cstride) + t*tstride) + y*ystride)[x*xstride];
     }
 
     float *baseAddress() const {
         return base;
     }
 
+    Layout layout() const {
+        return xstride == 1 ? PLANAR : INTERLEAVED;
+    }
+
     Image copy() const {
-        Image m(width, height, frames, channels);
+        Image m(width, height, frames, channels, layout(), UNINITIALIZED);
+        m.set(*this);
+        return m;
+    }
+
+    // Get this image in the given layout. Only copies if the layout
+    // differs.
+    Image toLayout(Layout l) const {
+        // A single dense channel is in both layouts
+        if (layout() == l || (channels == 1 && xstride == 1)) return *this;
+        Image m(width, height, frames, channels, l, UNINITIALIZED);
         m.set(*this);
         return m;
     }
@@ -114,7 +174,8 @@ public:
     }
 
     bool dense() const {
-        return (cstride == width *height *frames && tstride == width *height && ystride == width);
+        return (cstride == width *height *frames && tstride == width *height &&
+                ystride == width && xstride == 1);
     }
 
 
@@ -124,6 +185,7 @@ public:
 
     bool operator==(const Image &other) const {
         return (base == other.base &&
+                xstride == other.xstride &&
                 ystride == other.ystride &&
                 tstride == other.tstride &&
                 cstride == other.cstride &&
@@ -474,18 +536,26 @@ public:
         //float t4 = currentTime();
         
 
-        for (int c = 0; c < channels; c++) {
-            for (int t = 0; t < frames; t++) {
-                #ifdef _OPENMP
-                #pragma omp parallel for
-                #endif
-                for (int y = 0; y < height; y++) {
-                    //printf("Evaluating at scanline %d\n", y);
+        if (xstride == 1) {
+            Expr::forEachScanline(0, height, 0, frames, 0, channels, width,
+                                  [&](int y, int t, int c) {
+                //printf("Evaluating at scanline %d\n", y);
+                FloatExprType(T)::Iter iter = expr.scanline(0, y, t, c, width);
+                float *const dst = base + c*cstride + t*tstride + y*ystride;
+                ImageStack::Expr::setScanline(iter, dst, 0, width, boundedVX, minVX, maxVX);
+            });
+        } else {
+            // Channels are interleaved, so do all the channels of a
+            // scanline together while it's in cache.
+            Expr::forEachScanline(0, height, 0, frames, 0, 1, width * channels,
+                                  [&](int y, int t, int) {
+                for (int c = 0; c < channels; c++) {
                     FloatExprType(T)::Iter iter = expr.scanline(0, y, t, c, width);
                     float *const dst = base + c*cstride + t*tstride + y*ystride;
-                    ImageStack::Expr::setScanline(iter, dst, 0, width, boundedVX, minVX, maxVX);
+                    ImageStack::Expr::setScanlineStrided(iter, dst, xstride, 0, width,
+                                                         boundedVX, minVX, maxVX);
                 }
-            }
+            });
         }
         //float t5 = currentTime();
 
@@ -593,39 +663,45 @@ public:
     struct Iter {
         int width;
         const float *const addr;
-        Iter() : addr(NULL) {}
-        Iter(const float *a, int w) : width(w), addr(a) {}
+        const int xstride;
+        Iter() : addr(NULL), xstride(1) {}
+        Iter(const float *a, int xs, int w) : width(w), addr(a), xstride(xs) {}
         float operator[](int x) const {
             assert(x >= 0 && x < width, 
                    "Access out of bounds in image iterator:\n"
                    "%d is not within 0 - %d\n", x, width);
-            return addr[x];
+            return addr[x*xstride];
         }
         ImageStack::Expr::Vec::type vec(int x) const {
             assert(x >= 0 && x <= width - ImageStack::Expr::Vec::width,
                    "Vector access out of bounds in image iterator:\n"
                    "%d is not sufficiently within 0 - %d\n", x, width);
-            return ImageStack::Expr::Vec::load(addr+x);
+            if (xstride == 1) return ImageStack::Expr::Vec::load(addr+x);
+            return ImageStack::Expr::Vec::gather(addr+x*xstride, xstride);
         }
     };
     Iter scanline(int x, int y, int t, int c, int w) const {
         assert(x >= 0 && x+w <= width,
                "Scanline will access image out of bounds:\n"
                "%d - %d is not within 0 - %d\n", x, x+w, width);
-        return Iter(base + y*ystride + t*tstride + c*cstride, width);
+        return Iter(base + y*ystride + t*tstride + c*cstride, xstride, width);
     }
     #else
     struct Iter {
         const float *const addr;
-        Iter() : addr(NULL) {}
-        Iter(const float *a) : addr(a) {}
-        float operator[](int x) const {return addr[x];}
+        const int xstride;
+        Iter() : addr(NULL), xstride(1) {}
+        Iter(const float *a, int xs) : addr(a), xstride(xs) {}
+        float operator[](int x) const {return addr[x*xstride];}
         ImageStack::Expr::Vec::type vec(int x) const {
-            return ImageStack::Expr::Vec::load(addr+x);
+            // Planar images load contiguous vectors. Interleaved
+            // images gather one value per pixel.
+            if (xstride == 1) return ImageStack::Expr::Vec::load(addr+x);
+            return ImageStack::Expr::Vec::gather(addr+x*xstride, xstride);
         }
     };
     Iter scanline(int x, int y, int t, int c, int w) const {
-        return Iter(base + y*ystride + t*tstride + c*cstride);
+        return Iter(base + y*ystride + t*tstride + c*cstride, xstride);
     }
     #endif
     
@@ -651,17 +727,18 @@ public:
     template<typename T>
     Image(const T &expr_, const FloatExprType(T) *ptr = NULL) :
         width(0), height(0), frames(0), channels(0),
-        ystride(0), tstride(0), cstride(0), data(), base(NULL) {
+        xstride(0), ystride(0), tstride(0), cstride(0), data(), base(NULL) {
         FloatExprType(T) expr(expr_);
         assert(expr.getSize(0) && expr.getSize(1) && expr.getSize(2) && expr.getSize(3),
                "Can only construct an image from a bounded expression\n");
-        (*this) = Image(expr.getSize(0), expr.getSize(1), expr.getSize(2), expr.getSize(3));
+        (*this) = Image(expr.getSize(0), expr.getSize(1), expr.getSize(2), expr.getSize(3),
+                        UNINITIALIZED);
         set(expr);
     }
 
     Image(const Image &other) :
         width(other.width), height(other.height), frames(other.frames), channels(other.channels),
-        ystride(other.ystride), tstride(other.tstride), cstride(other.cstride),
+        xstride(other.xstride), ystride(other.ystride), tstride(other.tstride), cstride(other.cstride),
         data(other.data), base(other.base) {
     }
 
@@ -725,22 +802,28 @@ private:
         exprC.prepare(r, 2);
         exprD.prepare(r, 2);
 
+        // An interleaved image is evaluated a scanline at a time into
+        // planar scratch, one per thread, and then interleaved
+        int threads = 1;
+        #ifdef _OPENMP
+        if (!omp_in_parallel()) threads = omp_get_max_threads();
+        #endif
+        vector<float> scratch(xstride == 1 ? 0 : (size_t)threads * outChannels * width);
+
         // 4 or 8-wide vector code, distributed across cores
-        for (int t = 0; t < frames; t++) {
+        Expr::forEachScanline(0, height, 0, frames, 0, 1, width * outChannels,
+                              [&](int y, int t, int) {
+            const int w = width;
+            const int cs = cstride;
 
-            #ifdef _OPENMP
-            #pragma omp parallel for
-            #endif
-            for (int y = 0; y < height; y++) {
-                const int w = width;
-                const int cs = cstride;
+            const typename A::Iter iterA = exprA.scanline(0, y, t, 0, w);
+            const typename B::Iter iterB = exprB.scanline(0, y, t, 0, w);
+            const typename C::Iter iterC = exprC.scanline(0, y, t, 0, w);
+            const typename D::Iter iterD = exprD.scanline(0, y, t, 0, w);
 
-                const typename A::Iter iterA = exprA.scanline(0, y, t, 0, w);
-                const typename B::Iter iterB = exprB.scanline(0, y, t, 0, w);
-                const typename C::Iter iterC = exprC.scanline(0, y, t, 0, w);
-                const typename D::Iter iterD = exprD.scanline(0, y, t, 0, w);
+            float *const dst1 = base + t*tstride + y*ystride;
 
-                float *const dst1 = base + t*tstride + y*ystride;
+            if (xstride == 1) {
                 float *const dst2 = outChannels > 1 ? dst1 + cs : NULL;
                 float *const dst3 = outChannels > 2 ? dst2 + cs : NULL;
                 float *const dst4 = outChannels > 3 ? dst3 + cs : NULL;
@@ -749,8 +832,28 @@ private:
                                        dst1, dst2, dst3, dst4,
                                        0, width, 
                                        boundedVX, minVX, maxVX);                
+            } else {
+                int thread = 0;
+                #ifdef _OPENMP
+                if (threads > 1) thread = omp_get_thread_num();
+                #endif
+                float *const tmp1 = &scratch[(size_t)thread * outChannels * w];
+                float *const tmp2 = outChannels > 1 ? tmp1 + w : NULL;
+                float *const tmp3 = outChannels > 2 ? tmp2 + w : NULL;
+                float *const tmp4 = outChannels > 3 ? tmp3 + w : NULL;
+
+                Expr::setScanlineMulti(iterA, iterB, iterC, iterD,
+                                       tmp1, tmp2, tmp3, tmp4,
+                                       0, width, 
+                                       boundedVX, minVX, maxVX);                
+
+                for (int x = 0; x < w; x++) {
+                    for (int c = 0; c < outChannels; c++) {
+                        dst1[x*xstride + c*cs] = tmp1[c*w + x];
+                    }
+                }
             }
-        }
+        });
 
         exprA.prepare(r, 3);
         exprB.prepare(r, 3);
@@ -762,31 +865,42 @@ private:
 
 
     struct Payload {
-        Payload(size_t size) : data(NULL) {
-            // In some cases we don't need to clear the memory, but
-            // typically this is optimized away by the system, so we
-            // don't care. On linux it just mmaps /dev/zero.
-            data = (float *)calloc(size, sizeof(float));
-            //printf("Allocating %d bytes\n", (int)(size * sizeof(float)));
-            if (!data) {
-                panic("Could not allocate %d bytes for image data\n",
-                      size * sizeof(float));
-            }
+        // The memory comes from a pool of recycled buffers (see
+        // BufferPool.h), so a recycled buffer is only cleared if
+        // the caller asked for it.
+        Payload(size_t size, bool clear) :
+            data((float *)BufferPool::allocate(size * sizeof(float), clear)),
+            bytes(size * sizeof(float)) {
+        }
+        // Memory owned by someone else, which is handed back by
+        // calling release
+        Payload(float *external, size_t size, std::function<void()> release_) :
+            data(external), bytes(size * sizeof(float)), release(release_) {
         }
         ~Payload() {
-            free(data);
+            if (release) {
+                release();
+            } else {
+                BufferPool::release(data, bytes);
+            }
         }
         float *data;
+        size_t bytes;
+        std::function<void()> release;
     private:
         // These are private to prevent copying a Payload
-        Payload(const Payload &other) : data(NULL) {}
+        Payload(const Payload &other) : data(NULL), bytes(0) {}
         void operator=(const Payload &other) {data = NULL;}
     };
 
-    // Compute a 32-byte aligned address within data
+    // Compute a vector-aligned address within freshly allocated
+    // data. Images wrapping external storage, and regions, start
+    // wherever they start; nothing relies on the alignment beyond
+    // speed, as vector loads and stores are all unaligned ones.
     static float *compute_base(const std::shared_ptr<const Payload> &payload) {
+        const size_t mask = ImageStack::Expr::Vec::width * sizeof(float) - 1;
         float *base = payload->data;
-        while (((size_t)base) & 0x1f) base++;
+        while (((size_t)base) & mask) base++;
         return base;
     }
 
@@ -794,7 +908,7 @@ private:
     Image(const Image &im, int x, int y, int t, int c,
           int xs, int ys, int ts, int cs) :
         width(xs), height(ys), frames(ts), channels(cs),
-        ystride(im.ystride), tstride(im.tstride), cstride(im.cstride),
+        xstride(im.xstride), ystride(im.ystride), tstride(im.tstride), cstride(im.cstride),
         data(im.data), base(&im(x, y, t, c)) {
         // Note that base is no longer aligned. You're only guaranteed
         // alignment if you allocate an image from scratch.
@@ -0,0 +1,153 @@
+#include "ImageStack.h"
+
+using namespace ImageStack;
+
+// Measures the accuracy and speed of the vector transcendental
+// functions in Expr_math.h. For each function it prints the maximum
+// error in ulps against the correctly rounded result (computed in
+// double precision) over a range of inputs, the maximum absolute
+// error, and the time per element of the vector version and of
+// calling the scalar libm function once per lane, as Lift used to.
+//
+// Usage: Math_test [samples]
+
+#ifndef IMAGESTACK_VECTOR_MATH
+int main(int argc, char **argv) {
+    printf("No vector math on this target\n");
+    return 0;
+}
+#else
+
+// The distance between two floats in units in the last place
+double ulps(float a, float b) {
+    if (a == b || (a != a && b != b)) return 0;
+    if (a != a || b != b || isinf(a) || isinf(b)) return INF;
+    union {float f; int32_t i;} ua = {a}, ub = {b};
+    int64_t ia = ua.i < 0 ? (int64_t)INT32_MIN - ua.i : ua.i;
+    int64_t ib = ub.i < 0 ? (int64_t)INT32_MIN - ub.i : ub.i;
+    return (double)std::abs(ia - ib);
+}
+
+// Sample n values spread over [lo, hi], with both endpoints
+void sample(vector<float> &v, int n, float lo, float hi) {
+    v.resize(n);
+    for (int i = 0; i < n; i++) {
+        v[i] = lo + (hi - lo) * ((double)i / (n - 1));
+    }
+    for (size_t i = 0; i < v.size() % Vec::width; i++) {
+        v.pop_back();
+    }
+}
+
+// Sample n values with random exponents, so that every binade is covered
+void sampleLog(vector<float> &v, int n, float lo, float hi) {
+    v.resize(n - n % Vec::width);
+    double llo = ::log(lo), lhi = ::log(hi);
+    for (size_t i = 0; i < v.size(); i++) {
+        v[i] = ::exp(llo + (lhi - llo) * ((double)rand() / RAND_MAX));
+    }
+}
+
+template<typename VecF, typename ScalarF, typename RefF>
+void report(const char *name, const vector<float> &in,
+            VecF vecF, ScalarF scalarF, RefF refF) {
+    vector<float> out(in.size());
+    double worst = 0, worstAbs = 0;
+    float worstX = 0;
+    for (size_t i = 0; i < in.size(); i += Vec::width) {
+        Vec::store(vecF(Vec::load(&in[i])), &out[i]);
+    }
+    for (size_t i = 0; i < in.size(); i++) {
+        double ref = refF(in[i]);
+        double e = ulps(out[i], (float)ref);
+        worstAbs = std::max(worstAbs, fabs(out[i] - ref));
+        if (e > worst) {
+            worst = e;
+            worstX = in[i];
+        }
+    }
+
+    const int reps = 5;
+    double t1 = currentTime();
+    for (int r = 0; r < reps; r++) {
+        for (size_t i = 0; i < in.size(); i += Vec::width) {
+            Vec::store(vecF(Vec::load(&in[i])), &out[i]);
+        }
+    }
+    double t2 = currentTime();
+    for (int r = 0; r < reps; r++) {
+        for (size_t i = 0; i < in.size(); i += Vec::width) {
+            union {
+                float f[Vec::width];
+                Vec::type v;
+            } va;
+            va.v = Vec::load(&in[i]);
+            for (int j = 0; j < Vec::width; j++) {
+                va.f[j] = scalarF(va.f[j]);
+            }
+            Vec::store(va.v, &out[i]);
+        }
+    }
+    double t3 = currentTime();
+
+    double n = (double)in.size() * reps;
+    printf("%-6s %6g ulp (at %-12g) %10.3g abs %8.3f ns vector %8.3f ns per lane\n",
+           name, worst, worstX, worstAbs, (t2 - t1) * 1e9 / n, (t3 - t2) * 1e9 / n);
+}
+
+int main(int argc, char **argv) {
+    start();
+
+    int n = argc > 1 ? atoi(argv[1]) : (1 << 22);
+    vector<float> in;
+
+    sample(in, n, -87.3f, 88.7f);
+    report("exp", in, [](Vec::type a) {return Vec::exp(a);},
+           [](float a) {return expf(a);}, [](double a) {return ::exp(a);});
+
+    sampleLog(in, n, FLT_MIN / 1024, FLT_MAX);
+    report("log", in, [](Vec::type a) {return Vec::log(a);},
+           [](float a) {return logf(a);}, [](double a) {return ::log(a);});
+
+    sample(in, n, -M_PI, M_PI);
+    report("sin", in, [](Vec::type a) {return Vec::sin(a);},
+           [](float a) {return sinf(a);}, [](double a) {return ::sin(a);});
+    report("cos", in, [](Vec::type a) {return Vec::cos(a);},
+           [](float a) {return cosf(a);}, [](double a) {return ::cos(a);});
+    sample(in, n, -8192, 8192);
+    report("sin", in, [](Vec::type a) {return Vec::sin(a);},
+           [](float a) {return sinf(a);}, [](double a) {return ::sin(a);});
+    report("cos", in, [](Vec::type a) {return Vec::cos(a);},
+           [](float a) {return cosf(a);}, [](double a) {return ::cos(a);});
+
+    // The two argument functions are driven by one argument: atan2
+    // over points around a circle, and pow with a fixed exponent or
+    // a fixed negative base
+    sample(in, n, -M_PI, M_PI);
+    report("atan2", in,
+           [](Vec::type a) {
+               float f[Vec::width], y[Vec::width], x[Vec::width];
+               Vec::store(a, f);
+               for (int i = 0; i < Vec::width; i++) {
+                   y[i] = sinf(f[i]) * 3.7f;
+                   x[i] = cosf(f[i]) * 3.7f;
+               }
+               return Vec::atan2(Vec::load(y), Vec::load(x));
+           },
+           [](float a) {return atan2f(sinf(a) * 3.7f, cosf(a) * 3.7f);},
+           [](double a) {return ::atan2((double)(sinf(a) * 3.7f), (double)(cosf(a) * 3.7f));});
+
+    sampleLog(in, n, 1e-3f, 1e3f);
+    report("pow", in,
+           [](Vec::type a) {return Vec::pow(a, Vec::broadcast(2.4f));},
+           [](float a) {return powf(a, 2.4f);},
+           [](double a) {return ::pow(a, 2.4);});
+    report("pow", in,
+           [](Vec::type a) {return Vec::pow(Vec::broadcast(-1.7f), Vec::round(Vec::Mul::vec(a, Vec::broadcast(0.1f))));},
+           [](float a) {return powf(-1.7f, rintf(a * 0.1f));},
+           [](double a) {return ::pow(-1.7, (double)rintf(a * 0.1f));});
+
+    return 0;
+}
+
+#endif
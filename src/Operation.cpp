@@ -48,6 +48,8 @@ void loadOperations() {
     operationMap["-loop"] = new Loop();
     operationMap["-pause"] = new Pause();
     operationMap["-time"] = new Time();
+    operationMap["-stream"] = new Stream();
+    operationMap["-poolstats"] = new PoolStats();
 
     // statistics
 
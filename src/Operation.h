@@ -8,6 +8,22 @@ public:
     virtual void parse(vector<string>) = 0;
     virtual void help() = 0;
     virtual bool test() = 0;
+
+    // How far along the time axis an operation with the given
+    // arguments looks. PER_FRAME means each output frame depends only
+    // on the same input frame, a positive number is the radius in
+    // frames of a sliding window, and WHOLE_VOLUME means any output
+    // frame may depend on any input frame. -stream uses this to run
+    // long sequences a few frames at a time.
+    enum {WHOLE_VOLUME = -1, PER_FRAME = 0};
+    virtual int footprint(vector<string>) {return WHOLE_VOLUME;}
+
+    // Some operations can do the work of the command that follows
+    // them more cheaply along with their own, such as loading a jpeg
+    // at a smaller size. Given that command, an operation may rewrite
+    // its own arguments to do so, and returns true if the command
+    // should then be skipped.
+    virtual bool fuse(vector<string> &, vector<string>) {return false;}
 };
 
 void loadOperations();
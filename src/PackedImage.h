@@ -0,0 +1,254 @@
+#ifndef IMAGESTACK_PACKED_IMAGE_H
+#define IMAGESTACK_PACKED_IMAGE_H
+
+#include "Image.h"
+#include "BufferPool.h"
+
+#include "header.h"
+
+// Compact pixel storage. An Image holds 32-bit floats, which is four
+// times the size of typical 8-bit source data. A PackedImage holds
+// 8-bit or 16-bit unsigned integers, or half-precision floats, and
+// converts to and from float as part of the vector loads and stores
+// of the expression machinery in Expr.h. Math still happens in float
+// registers, but only the compact representation crosses the memory
+// bus.
+//
+// A PackedImage is a valid expression, so it can be used anywhere an
+// Image can be read from:
+//
+// PackedImage<uint8_t> small(im);   // quantize
+// Image result(small * 2 + 1);      // math on the unpacked values
+// small.set(im / 2);                // quantize an expression
+//
+// Each stored value v represents the float v*scale. By default
+// integer types map their full range onto [0, 1], as an 8 or 16 bit
+// image file would, and half floats are unscaled. Stores round to
+// nearest and saturate to the range of the type.
+
+// The storage type for a half-precision float
+struct Half {
+    uint16_t bits;
+};
+
+template<typename T>
+struct PackedTraits;
+
+template<>
+struct PackedTraits<uint8_t> {
+    static float defaultScale() {return 1.0f/255;}
+    static float toFloat(uint8_t v) {return v;}
+    static uint8_t fromFloat(float v) {
+        return (uint8_t)rintf(std::min(std::max(v, 0.0f), 255.0f));
+    }
+    static Vec::type load(const uint8_t *p) {return Vec::loadU8(p);}
+    static void store(Vec::type v, uint8_t *p) {Vec::storeU8(v, p);}
+    static std::pair<float, float> range() {return std::make_pair(0.0f, 255.0f);}
+};
+
+template<>
+struct PackedTraits<uint16_t> {
+    static float defaultScale() {return 1.0f/65535;}
+    static float toFloat(uint16_t v) {return v;}
+    static uint16_t fromFloat(float v) {
+        return (uint16_t)rintf(std::min(std::max(v, 0.0f), 65535.0f));
+    }
+    static Vec::type load(const uint16_t *p) {return Vec::loadU16(p);}
+    static void store(Vec::type v, uint16_t *p) {Vec::storeU16(v, p);}
+    static std::pair<float, float> range() {return std::make_pair(0.0f, 65535.0f);}
+};
+
+template<>
+struct PackedTraits<Half> {
+    static float defaultScale() {return 1.0f;}
+    static float toFloat(Half v) {return Scalar::halfToFloat(v.bits);}
+    static Half fromFloat(float v) {
+        Half h = {Scalar::floatToHalf(v)};
+        return h;
+    }
+    static Vec::type load(const Half *p) {return Vec::loadHalf((const uint16_t *)p);}
+    static void store(Vec::type v, Half *p) {Vec::storeHalf(v, (uint16_t *)p);}
+    static std::pair<float, float> range() {return std::make_pair(-INF, INF);}
+};
+
+template<typename T>
+class PackedImage {
+public:
+    typedef PackedTraits<T> Traits;
+
+    int width, height, frames, channels;
+    int ystride, tstride, cstride;
+    float scale;
+
+    PackedImage() :
+        width(0), height(0), frames(0), channels(0),
+        ystride(0), tstride(0), cstride(0), scale(1), data(), base(NULL) {
+    }
+
+    // As with Image, new storage is zeroed unless the caller is about
+    // to overwrite all of it
+    PackedImage(int w, int h, int f, int c, float s = Traits::defaultScale(),
+                Image::Initialization init = Image::ZEROED) :
+        width(w), height(h), frames(f), channels(c),
+        ystride(w), tstride(w * h), cstride(w * h * f), scale(s),
+        data(new Payload((size_t)w * h * f * c, init == Image::ZEROED)),
+        base(data->data) {
+    }
+
+    // Quantize an image
+    explicit PackedImage(const Image &im, float s = Traits::defaultScale()) :
+        width(im.width), height(im.height), frames(im.frames), channels(im.channels),
+        ystride(im.width), tstride(im.width * im.height),
+        cstride(im.width * im.height * im.frames), scale(s),
+        data(new Payload((size_t)im.width * im.height * im.frames * im.channels, false)),
+        base(data->data) {
+        set(im);
+    }
+
+    // The raw stored value. Multiply by scale to get the value it
+    // represents.
+    T &operator()(int x, int y, int t, int c) const {
+#ifdef BOUNDS_CHECKING
+        assert(x >= 0 && x < width &&
+               y >= 0 && y < height &&
+               t >= 0 && t < frames &&
+               c >= 0 && c < channels,
+               "Access out of bounds: %d %d %d %d\n",
+               x, y, t, c);
+#endif
+        return base[c*cstride + t*tstride + y*ystride + x];
+    }
+
+    T *baseAddress() const {
+        return base;
+    }
+
+    bool defined() const {
+        return base != NULL;
+    }
+
+    // Evaluate an expression and store the result in compact form
+    template<typename S>
+    void set(const S expr_, const FloatExprType(S) *check = NULL) const {
+        FloatExprType(S) expr(expr_);
+        assert(defined(), "Can't set undefined image\n");
+        assert((expr.getSize(0) == 0 || width == expr.getSize(0)) &&
+               (expr.getSize(1) == 0 || height == expr.getSize(1)) &&
+               (expr.getSize(2) == 0 || frames == expr.getSize(2)) &&
+               (expr.getSize(3) == 0 || channels == expr.getSize(3)),
+               "Can only assign from source of matching size\n");
+
+        bool boundedVX = expr.boundedVecX();
+        int minVX = expr.minVecX();
+        int maxVX = expr.maxVecX();
+
+        Expr::Region r = {0, 0, 0, 0, width, height, frames, channels};
+        expr.prepare(r, 0);
+        expr.prepare(r, 1);
+        expr.prepare(r, 2);
+
+        const float invScale = 1.0f / scale;
+        Expr::forEachScanline(0, height, 0, frames, 0, channels, width,
+                              [&](int y, int t, int c) {
+            FloatExprType(S)::Iter iter = expr.scanline(0, y, t, c, width);
+            T *const dst = base + c*cstride + t*tstride + y*ystride;
+            int x = 0;
+            if (Vec::width > 1 && width >= Vec::width) {
+                while (boundedVX && x < std::min(minVX, width)) {
+                    dst[x] = Traits::fromFloat(iter[x] * invScale);
+                    x++;
+                }
+                int lastX = width - Vec::width;
+                if (boundedVX) lastX = std::min(lastX, maxVX);
+                const Vec::type vInvScale = Vec::broadcast(invScale);
+                if (x <= lastX) {
+                    // Finish with an overlapping vector, as Expr::setScanline does
+                    const Vec::type last = Vec::Mul::vec(iter.vec(lastX), vInvScale);
+                    while (x < lastX) {
+                        Traits::store(Vec::Mul::vec(iter.vec(x), vInvScale), dst + x);
+                        x += Vec::width;
+                    }
+                    Traits::store(last, dst + lastX);
+                    x = lastX + Vec::width;
+                }
+            }
+            while (x < width) {
+                dst[x] = Traits::fromFloat(iter[x] * invScale);
+                x++;
+            }
+        });
+
+        expr.prepare(r, 3);
+    }
+
+    // A packed image is an expression over its unpacked values
+    typedef PackedImage<T> FloatExpr;
+    const static bool dependsOnX = true;
+    int getSize(int i) const {
+        switch (i) {
+        case 0: return width;
+        case 1: return height;
+        case 2: return frames;
+        case 3: return channels;
+        }
+        return 0;
+    }
+
+    struct Iter {
+        const T *addr;
+        float scale;
+        Iter() : addr(NULL), scale(1) {}
+        Iter(const T *a, float s) : addr(a), scale(s) {}
+        float operator[](int x) const {
+            return Traits::toFloat(addr[x]) * scale;
+        }
+        Vec::type vec(int x) const {
+            return Vec::Mul::vec(Traits::load(addr + x), Vec::broadcast(scale));
+        }
+    };
+    Iter scanline(int x, int y, int t, int c, int w) const {
+        return Iter(base + y*ystride + t*tstride + c*cstride, scale);
+    }
+
+    bool boundedVecX() const {return false;}
+    int minVecX() const {return -Expr::HUGE_INT;}
+    int maxVecX() const {return Expr::HUGE_INT;}
+
+    void prepare(Expr::Region r, int phase) const {
+        assert(r.x >= 0 && r.x+r.width <= width &&
+               r.y >= 0 && r.y+r.height <= height &&
+               r.t >= 0 && r.t+r.frames <= frames &&
+               r.c >= 0 && r.c+r.channels <= channels,
+               "Expression would access image out of bounds: %d %d %d %d  %d %d %d %d\n",
+               r.x, r.y, r.t, r.c, r.width, r.height, r.frames, r.channels);
+    }
+
+    std::pair<float, float> bounds(Expr::Region r) const {
+        std::pair<float, float> b = Traits::range();
+        if (scale < 0) return make_pair(b.second * scale, b.first * scale);
+        return make_pair(b.first * scale, b.second * scale);
+    }
+
+private:
+
+    struct Payload {
+        Payload(size_t size, bool clear) :
+            data((T *)BufferPool::allocate(size * sizeof(T), clear)),
+            bytes(size * sizeof(T)) {
+        }
+        ~Payload() {
+            BufferPool::release(data, bytes);
+        }
+        T *data;
+        size_t bytes;
+    private:
+        Payload(const Payload &other) : data(NULL), bytes(0) {}
+        void operator=(const Payload &other) {data = NULL;}
+    };
+
+    std::shared_ptr<const Payload> data;
+    T *base;
+};
+
+#include "footer.h"
+#endif
@@ -73,6 +73,40 @@ bool Eval::test() {
         if (!nearlyEqual(a, b)) return false;
     }
 
+    // Test scanline evaluation against evaluating one pixel at a time
+    {
+        printf("Testing scanline evaluation\n");
+        const char *source = ("(x % 7 > 3 ? round(val*10) / mean(c) : [c+1]^1.5) + "
+                              "(y > height/2) * floor(x*0.3) - atan2(x - y, val) * stddev()");
+        Image in = im.toLayout(Image::INTERLEAVED);
+        Image a = Eval::apply(in, source);
+        Expression expression(source);
+        Expression::State state(in);
+        Image b(im.width, im.height, im.frames, im.channels);
+        for (state.c = 0; state.c < im.channels; state.c++) {
+            for (state.t = 0; state.t < im.frames; state.t++) {
+                for (state.y = 0; state.y < im.height; state.y++) {
+                    for (state.x = 0; state.x < im.width; state.x++) {
+                        b(state.x, state.y, state.t, state.c) = expression.eval(state);
+                    }
+                }
+            }
+        }
+        if (!nearlyEqual(a, b)) return false;
+    }
+
+    // Halves should round away from zero, wherever they land relative
+    // to the vector width
+    {
+        printf("Testing rounding\n");
+        Image a = Eval::apply(im, "round(x - 61.5) + round(y*0.5 - 58.5)");
+        for (int y = 0; y < im.height; y++) {
+            for (int x = 0; x < im.width; x++) {
+                if (a(x, y, 0, 0) != roundf(x - 61.5f) + roundf(y*0.5f - 58.5f)) return false;
+            }
+        }
+    }
+
     return true;
 }
 
@@ -83,21 +117,43 @@ void Eval::parse(vector<string> args) {
     push(im);
 }
 
+// Evaluate each expression over the corresponding channel of out,
+// a scanline at a time, in parallel.
+static void evalExpressions(Image im, const vector<Expression *> &expressions, Image out) {
+    Expression::State state(im);
+    for (size_t i = 0; i < expressions.size(); i++) {
+        if (i == 0 || expressions[i] != expressions[i-1]) {
+            expressions[i]->prepare(state);
+        }
+    }
+
+    int threads = 1;
+    #ifdef _OPENMP
+    threads = omp_get_max_threads();
+    #endif
+    vector<Expression::State> states(threads, state);
+
+    forEachScanline(0, out.height, 0, out.frames, 0, out.channels, out.width,
+                    [&](int y, int t, int c) {
+        int thread = 0;
+        #ifdef _OPENMP
+        thread = omp_get_thread_num();
+        #endif
+        Expression::State &s = states[thread];
+        s.x = 0;
+        s.y = y;
+        s.t = t;
+        s.c = c;
+        expressions[c]->evalScanline(s, &out(0, y, t, c), out.width);
+    });
+}
+
 Image Eval::apply(Image im, string expression_) {
     Expression expression(expression_);
-    Expression::State state(im);
+    vector<Expression *> expressions(im.channels, &expression);
 
     Image out(im.width, im.height, im.frames, im.channels);
-
-    for (state.c = 0; state.c < im.channels; state.c++) {
-        for (state.t = 0; state.t < im.frames; state.t++) {
-            for (state.y = 0; state.y < im.height; state.y++) {
-                for (state.x = 0; state.x < im.width; state.x++) {
-                    out(state.x, state.y, state.t, state.c) = expression.eval(state);
-                }
-            }
-        }
-    }
+    evalExpressions(im, expressions, out);
 
     return out;
 }
@@ -125,7 +181,26 @@ bool EvalChannels::test() {
     b.setChannels(im.channel(2)+1,
                   im.channel(0)/17,
                   im.channel(1) + Select(X() > 10, 50, 0));
-    return nearlyEqual(a, b);
+    if (!nearlyEqual(a, b)) return false;
+
+    // A deep expression followed by a shallow one needs the scratch
+    // space of the deep one
+    expressions.resize(2);
+    expressions[0] = "((val+1)*(x+2))*((y+3)*(val+4)) + ((val+5)*(x+6))*((y+7)*(val+8))";
+    expressions[1] = "val";
+    a = EvalChannels::apply(im, expressions);
+    for (int t = 0; t < im.frames; t++) {
+        for (int y = 0; y < im.height; y++) {
+            for (int x = 0; x < im.width; x++) {
+                float v = im(x, y, t, 0);
+                float deep = (((v+1)*(x+2))*((y+3)*(v+4)) +
+                              ((v+5)*(x+6))*((y+7)*(v+8)));
+                if (fabs(a(x, y, t, 0) - deep) > 1e-4f * deep) return false;
+                if (a(x, y, t, 1) != im(x, y, t, 1)) return false;
+            }
+        }
+    }
+    return true;
 }
 
 void EvalChannels::parse(vector<string> args) {
@@ -143,18 +218,7 @@ Image EvalChannels::apply(Image im, vector<string> expressions_) {
     int channels = (int)expressions_.size();
 
     Image out(im.width, im.height, im.frames, channels);
-
-    Expression::State state(im);
-
-    for (state.c = 0; state.c < channels; state.c++) {
-        for (state.t = 0; state.t < im.frames; state.t++) {
-            for (state.y = 0; state.y < im.height; state.y++) {
-                for (state.x = 0; state.x < im.width; state.x++) {
-                    out(state.x, state.y, state.t, state.c) = expressions[state.c]->eval(state);
-                }
-            }
-        }
-    }
+    evalExpressions(im, expressions, out);
 
     for (size_t i = 0; i < expressions.size(); i++) { delete expressions[i]; }
 
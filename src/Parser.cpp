@@ -315,6 +315,7 @@ Expression::Expression(string source_, bool varyingAllowed_) {
     varyingAllowed = varyingAllowed_;
     source = source_;
     sourceIndex = 0;
+    nodes = 0;
     root = parseIfThenElse();
     skipWhitespace();
     assert(sourceIndex == source.size(), "Portion of expression not parsed: %s\n", source.c_str() + sourceIndex);
@@ -328,6 +329,41 @@ float Expression::eval(State &state) {
     return root->eval(state);
 }
 
+Expression::Node *Expression::fold(Node *node, State &state) {
+    vector<Node **> children;
+    node->children(children);
+    for (size_t i = 0; i < children.size(); i++) {
+        *children[i] = fold(*children[i], state);
+    }
+    nodes++;
+    node->prepare(state);
+    node->variation = node->varies();
+    if (node->variation == 0 && !dynamic_cast<Float *>(node)) {
+        float value = node->eval(state);
+        delete node;
+        node = new Float(value);
+        node->variation = 0;
+    }
+    return node;
+}
+
+void Expression::prepare(State &state) {
+    nodes = 0;
+    root = fold(root, state);
+    // Each node being evaluated holds at most three scanlines of
+    // scratch space for its arguments. Other expressions may share
+    // the state, so the scratch only ever grows.
+    size_t size = nodes * 3 * (state.im.width + Expr::Vec::width);
+    if (state.scratch.size() < size) {
+        state.scratch.resize(size);
+    }
+    state.scratchUsed = 0;
+}
+
+void Expression::evalScanline(State &state, float *out, int width) {
+    root->scanline(state, out, width);
+}
+
 void Expression::help() {
     printf("Variables:\n"
            "  x   \t the x coordinate, measured from 0 to width - 1\n"
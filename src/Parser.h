@@ -5,8 +5,11 @@
 #include "Statistics.h"
 #include "header.h"
 
-#ifndef roundf
-#define roundf(x) floorf(x+0.5);
+#if defined(_MSC_VER) && _MSC_VER < 1800
+// Older versions of Visual Studio have no roundf
+inline float roundf(float x) {
+    return x < 0 ? ceilf(x - 0.5f) : floorf(x + 0.5f);
+}
 #endif
 
 class Expression {
@@ -34,253 +37,485 @@ class Expression {
 public:
 
     struct State {
-        State(Image im_) : x(0), y(0), t(0), c(0), im(im_), stats(im_) {}
+        State(Image im_) : x(0), y(0), t(0), c(0), im(im_), stats(im_), scratchUsed(0) {}
         int x, y, t, c;
         Image im;
         Stats stats;
+
+        // Round a value to a channel index, clamped to the channels
+        // that exist
+        int channel(float v) {
+            return clamp((int)(v + 0.5f), 0, im.channels - 1);
+        }
+
+        // Space for the results of Sample2D and Sample3D
+        vector<float> sample;
+
+        // Scanlines for the arguments of nodes being evaluated by
+        // evalScanline, allocated like a stack
+        vector<float> scratch;
+        size_t scratchUsed;
+        float *push(int width) {
+            size_t size = (width + Expr::Vec::width - 1) & ~(Expr::Vec::width - 1);
+            assert(scratchUsed + size <= scratch.size(), "Expression scratch space exhausted\n");
+            float *result = &scratch[scratchUsed];
+            scratchUsed += size;
+            return result;
+        }
+        void pop(int width) {
+            scratchUsed -= (width + Expr::Vec::width - 1) & ~(Expr::Vec::width - 1);
+        }
     };
 
+    // Bits of Node::variation
+    enum {VaryX = 1, VaryY = 2, VaryT = 4, VaryC = 8, VaryAll = 15};
+
     struct Node {
-        Node() {};
+        Node() : variation(VaryAll) {};
         virtual ~Node() {};
         virtual float eval(State &state) = 0;
+
+        // Evaluate at state.x, state.x + 1, ... state.x + width - 1,
+        // writing the results to out. The default calls eval once per
+        // pixel.
+        virtual void evalScanline(State &state, float *out, int width) {
+            const int x = state.x;
+            for (int i = 0; i < width; i++) {
+                state.x = x + i;
+                out[i] = eval(state);
+            }
+            state.x = x;
+        }
+
+        // Like evalScanline, but nodes that don't vary along the
+        // scanline are evaluated once.
+        void scanline(State &state, float *out, int width) {
+            if (variation & VaryX) {
+                evalScanline(state, out, width);
+            } else {
+                std::fill(out, out + width, eval(state));
+            }
+        }
+
+        // Which of x, y, t, and c this node depends on. The default
+        // is whatever the children depend on.
+        virtual int varies() {
+            vector<Node **> c;
+            children(c);
+            int v = 0;
+            for (size_t i = 0; i < c.size(); i++) v |= (*c[i])->variation;
+            return v;
+        }
+
+        // Computed by Expression::prepare
+        int variation;
+
+        virtual void children(vector<Node **> &c) {}
+
+        // Called by Expression::prepare before evaluation starts, to
+        // compute anything that is computed lazily.
+        virtual void prepare(State &state) {}
     };
 
     struct Unary : public Node {
         Unary(Node *arg_) : arg(arg_) {}
         ~Unary() {delete arg;}
+        void children(vector<Node **> &c) {c.push_back(&arg);}
         Node *arg;
     };
 
     struct Binary : public Node {
         Binary(Node *left_, Node *right_) : left(left_), right(right_) {}
         ~Binary() {delete left; delete right;}
+        void children(vector<Node **> &c) {c.push_back(&left); c.push_back(&right);}
         Node *left, *right;
     };
 
     struct Ternary : public Node {
         Ternary(Node *left_, Node *middle_, Node *right_) : left(left_), middle(middle_), right(right_) {}
         ~Ternary() {delete left; delete middle; delete right;}
+        void children(vector<Node **> &c) {c.push_back(&left); c.push_back(&middle); c.push_back(&right);}
         Node *left, *middle, *right;
     };
 
+    // Vector implementations of evalScanline. The argument is
+    // evaluated into out, and any others into scratch space.
+    template<float(*fn)(float)>
+    static void unaryScanline(State &state, Node *arg, float *out, int width) {
+        using namespace Expr;
+        arg->scanline(state, out, width);
+        int i = 0;
+        for (; i + Vec::width <= width; i += Vec::width) {
+            Vec::store(VecFn<fn>::vec(Vec::load(out + i)), out + i);
+        }
+        for (; i < width; i++) out[i] = fn(out[i]);
+    }
+
+    template<typename Op>
+    static void unaryOpScanline(State &state, Node *arg, float *out, int width) {
+        using namespace Expr;
+        arg->scanline(state, out, width);
+        int i = 0;
+        for (; i + Vec::width <= width; i += Vec::width) {
+            Vec::store(Op::vec(Vec::load(out + i)), out + i);
+        }
+        for (; i < width; i++) out[i] = Op::scalar_f(out[i]);
+    }
+
+    template<typename Op>
+    static void binaryScanline(State &state, Node *left, Node *right, float *out, int width) {
+        using namespace Expr;
+        left->scanline(state, out, width);
+        float *b = state.push(width);
+        right->scanline(state, b, width);
+        int i = 0;
+        for (; i + Vec::width <= width; i += Vec::width) {
+            Vec::store(Op::vec(Vec::load(out + i), Vec::load(b + i)), out + i);
+        }
+        for (; i < width; i++) out[i] = Op::scalar_f(out[i], b[i]);
+        state.pop(width);
+    }
+
+    template<float(*fn)(float, float)>
+    static void binaryScanline(State &state, Node *left, Node *right, float *out, int width) {
+        using namespace Expr;
+        left->scanline(state, out, width);
+        float *b = state.push(width);
+        right->scanline(state, b, width);
+        int i = 0;
+        for (; i + Vec::width <= width; i += Vec::width) {
+            Vec::store(VecFn2<fn>::vec(Vec::load(out + i), Vec::load(b + i)), out + i);
+        }
+        for (; i < width; i++) out[i] = fn(out[i], b[i]);
+        state.pop(width);
+    }
+
+    // Comparisons produce one or zero
+    template<typename Op>
+    static void compareScanline(State &state, Node *left, Node *right, float *out, int width) {
+        using namespace Expr;
+        left->scanline(state, out, width);
+        float *b = state.push(width);
+        right->scanline(state, b, width);
+        const Vec::type one = Vec::broadcast(1);
+        int i = 0;
+        for (; i + Vec::width <= width; i += Vec::width) {
+            Vec::store(Vec::andBits(Op::vec(Vec::load(out + i), Vec::load(b + i)), one), out + i);
+        }
+        for (; i < width; i++) out[i] = Op::scalar_f(out[i], b[i]) ? 1 : 0;
+        state.pop(width);
+    }
+
     struct Negation : public Unary {
         Negation(Node *a) : Unary(a) {}
         float eval(State &state) {return -arg->eval(state);}
+        void evalScanline(State &state, float *out, int width) {
+            arg->scanline(state, out, width);
+            for (int i = 0; i < width; i++) out[i] = -out[i];
+        }
     };
 
     struct IfThenElse : public Ternary {
         IfThenElse(Node *l, Node *m, Node *r) : Ternary(l, m, r) {}
         float eval(State &state) {return left->eval(state) ? middle->eval(state) : right->eval(state);}
+        void evalScanline(State &state, float *out, int width) {
+            using namespace Expr;
+            if (!(left->variation & VaryX)) {
+                // Only one side is needed
+                if (left->eval(state)) middle->scanline(state, out, width);
+                else right->scanline(state, out, width);
+                return;
+            }
+            // Evaluate both sides and select. Nothing an expression
+            // can compute has side effects, and everything that indexes
+            // into the image or its statistics is clamped to be in
+            // range, so evaluating the side not taken is harmless.
+            float *cond = state.push(width);
+            float *other = state.push(width);
+            left->scanline(state, cond, width);
+            middle->scanline(state, out, width);
+            right->scanline(state, other, width);
+            int i = 0;
+            for (; i + Vec::width <= width; i += Vec::width) {
+                Vec::type c = Vec::NEQ::vec(Vec::load(cond + i), Vec::zero());
+                Vec::store(Vec::blend(Vec::load(other + i), Vec::load(out + i), c), out + i);
+            }
+            for (; i < width; i++) {
+                if (!cond[i]) out[i] = other[i];
+            }
+            state.pop(width);
+            state.pop(width);
+        }
     };
 
     struct LTE : public Binary {
         LTE(Node *l, Node *r) : Binary(l, r) {}
         float eval(State &state) {return left->eval(state) <= right->eval(state) ? 1 : 0;}
+        void evalScanline(State &state, float *out, int width) {compareScanline<Expr::Vec::LE>(state, left, right, out, width);}
     };
 
     struct GTE : public Binary {
         GTE(Node *l, Node *r) : Binary(l, r) {}
         float eval(State &state) {return left->eval(state) >= right->eval(state) ? 1 : 0;}
+        void evalScanline(State &state, float *out, int width) {compareScanline<Expr::Vec::GE>(state, left, right, out, width);}
     };
 
     struct LT : public Binary {
         LT(Node *l, Node *r) : Binary(l, r) {}
         float eval(State &state) {return left->eval(state) < right->eval(state) ? 1 : 0;}
+        void evalScanline(State &state, float *out, int width) {compareScanline<Expr::Vec::LT>(state, left, right, out, width);}
     };
 
     struct GT : public Binary {
         GT(Node *l, Node *r) : Binary(l, r) {}
         float eval(State &state) {return left->eval(state) > right->eval(state) ? 1 : 0;}
+        void evalScanline(State &state, float *out, int width) {compareScanline<Expr::Vec::GT>(state, left, right, out, width);}
     };
 
     struct EQ : public Binary {
         EQ(Node *l, Node *r) : Binary(l, r) {}
         float eval(State &state) {return left->eval(state) == right->eval(state) ? 1 : 0;}
+        void evalScanline(State &state, float *out, int width) {compareScanline<Expr::Vec::EQ>(state, left, right, out, width);}
     };
 
     struct NEQ : public Binary {
         NEQ(Node *l, Node *r) : Binary(l, r) {}
         float eval(State &state) {return left->eval(state) != right->eval(state) ? 1 : 0;}
+        void evalScanline(State &state, float *out, int width) {compareScanline<Expr::Vec::NEQ>(state, left, right, out, width);}
     };
 
     struct Plus : public Binary {
         Plus(Node *l, Node *r) : Binary(l, r) {}
         float eval(State &state) {return left->eval(state) + right->eval(state);}
+        void evalScanline(State &state, float *out, int width) {binaryScanline<Expr::Vec::Add>(state, left, right, out, width);}
     };
 
     struct Minus : public Binary {
         Minus(Node *l, Node *r) : Binary(l, r) {}
         float eval(State &state) {return left->eval(state) - right->eval(state);}
+        void evalScanline(State &state, float *out, int width) {binaryScanline<Expr::Vec::Sub>(state, left, right, out, width);}
     };
 
     struct Mod : public Binary {
         Mod(Node *l, Node *r) : Binary(l, r) {}
         float eval(State &state) {return fmod(left->eval(state), right->eval(state));}
+        void evalScanline(State &state, float *out, int width) {binaryScanline<fmodf>(state, left, right, out, width);}
     };
 
     struct Times : public Binary {
         Times(Node *l, Node *r) : Binary(l, r) {}
         float eval(State &state) {return left->eval(state) * right->eval(state);}
+        void evalScanline(State &state, float *out, int width) {binaryScanline<Expr::Vec::Mul>(state, left, right, out, width);}
     };
 
     struct Divide : public Binary {
         Divide(Node *l, Node *r) : Binary(l, r) {}
         float eval(State &state) {return left->eval(state) / right->eval(state);}
+        void evalScanline(State &state, float *out, int width) {binaryScanline<Expr::Vec::Div>(state, left, right, out, width);}
     };
 
     struct Power : public Binary {
         Power(Node *l, Node *r) : Binary(l, r) {}
         float eval(State &state) {return powf(left->eval(state), right->eval(state));}
+        void evalScanline(State &state, float *out, int width) {binaryScanline<powf>(state, left, right, out, width);}
     };
 
     struct Funct_sin : public Unary {
         Funct_sin(Node *a) : Unary(a) {}
         float eval(State &state) {return sinf(arg->eval(state));}
+        void evalScanline(State &state, float *out, int width) {unaryScanline<sinf>(state, arg, out, width);}
     };
 
     struct Funct_cos : public Unary {
         Funct_cos(Node *a) : Unary(a) {}
         float eval(State &state) {return cosf(arg->eval(state));}
+        void evalScanline(State &state, float *out, int width) {unaryScanline<cosf>(state, arg, out, width);}
     };
 
     struct Funct_tan : public Unary {
         Funct_tan(Node *a) : Unary(a) {}
         float eval(State &state) {return tanf(arg->eval(state));}
+        void evalScanline(State &state, float *out, int width) {unaryScanline<tanf>(state, arg, out, width);}
     };
 
     struct Funct_atan : public Unary {
         Funct_atan(Node *a) : Unary(a) {}
         float eval(State &state) {return atanf(arg->eval(state));}
+        void evalScanline(State &state, float *out, int width) {unaryScanline<atanf>(state, arg, out, width);}
     };
 
     struct Funct_asin : public Unary {
         Funct_asin(Node *a) : Unary(a) {}
         float eval(State &state) {return asinf(arg->eval(state));}
+        void evalScanline(State &state, float *out, int width) {unaryScanline<asinf>(state, arg, out, width);}
     };
 
     struct Funct_acos : public Unary {
         Funct_acos(Node *a) : Unary(a) {}
         float eval(State &state) {return acosf(arg->eval(state));}
+        void evalScanline(State &state, float *out, int width) {unaryScanline<acosf>(state, arg, out, width);}
     };
 
     struct Funct_atan2 : public Binary {
         Funct_atan2(Node *l, Node *r) : Binary(l, r) {}
         float eval(State &state) {return atan2f(left->eval(state), right->eval(state));}
+        void evalScanline(State &state, float *out, int width) {binaryScanline<atan2f>(state, left, right, out, width);}
     };
 
     struct Funct_abs : public Unary {
         Funct_abs(Node *a) : Unary(a) {}
         float eval(State &state) {return fabsf(arg->eval(state));}
+        void evalScanline(State &state, float *out, int width) {unaryScanline<fabsf>(state, arg, out, width);}
     };
 
     struct Funct_floor : public Unary {
         Funct_floor(Node *a) : Unary(a) {}
         float eval(State &state) {return floorf(arg->eval(state));}
+        void evalScanline(State &state, float *out, int width) {unaryOpScanline<Expr::Vec::Floor>(state, arg, out, width);}
     };
 
     struct Funct_ceil : public Unary {
         Funct_ceil(Node *a) : Unary(a) {}
         float eval(State &state) {return ceilf(arg->eval(state));}
+        void evalScanline(State &state, float *out, int width) {unaryOpScanline<Expr::Vec::Ceil>(state, arg, out, width);}
     };
 
     struct Funct_round : public Unary {
         Funct_round(Node *a) : Unary(a) {}
         float eval(State &state) {return roundf(arg->eval(state));}
+        struct Round {
+            // Halves round away from zero, as roundf does
+            static Expr::Vec::type vec(Expr::Vec::type a) {
+                Expr::Vec::type half = Expr::Vec::broadcast(0.5f);
+                return Expr::Vec::blend(Expr::Vec::Floor::vec(Expr::Vec::Add::vec(a, half)),
+                                        Expr::Vec::Ceil::vec(Expr::Vec::Sub::vec(a, half)),
+                                        Expr::Vec::LT::vec(a, Expr::Vec::zero()));
+            }
+            static float scalar_f(float a) {return roundf(a);}
+        };
+        void evalScanline(State &state, float *out, int width) {unaryOpScanline<Round>(state, arg, out, width);}
     };
 
     struct Funct_log : public Unary {
         Funct_log(Node *a) : Unary(a) {}
         float eval(State &state) {return logf(arg->eval(state));}
+        void evalScanline(State &state, float *out, int width) {unaryScanline<logf>(state, arg, out, width);}
     };
 
     struct Funct_exp : public Unary {
         Funct_exp(Node *a) : Unary(a) {}
         float eval(State &state) {return expf(arg->eval(state));}
+        void evalScanline(State &state, float *out, int width) {unaryScanline<expf>(state, arg, out, width);}
     };
 
     struct Funct_mean0 : public Node {
         float eval(State &state) {return state.stats.mean();}
+        void prepare(State &state) {state.stats.mean();}
     };
 
     struct Funct_mean1 : public Unary {
         Funct_mean1(Node *a) : Unary(a) {}
-        float eval(State &state) {return state.stats.mean((int)(arg->eval(state) + 0.5));}
+        float eval(State &state) {return state.stats.mean(state.channel(arg->eval(state)));}
+        void prepare(State &state) {state.stats.mean();}
     };
 
     struct Funct_sum0 : public Node {
         float eval(State &state) {return state.stats.sum();}
+        void prepare(State &state) {state.stats.mean();}
     };
 
     struct Funct_sum1 : public Unary {
         Funct_sum1(Node *a) : Unary(a) {}
-        float eval(State &state) {return state.stats.sum((int)(arg->eval(state) + 0.5));}
+        float eval(State &state) {return state.stats.sum(state.channel(arg->eval(state)));}
+        void prepare(State &state) {state.stats.mean();}
     };
 
     struct Funct_max0 : public Node {
         float eval(State &state) {return state.stats.maximum();}
+        void prepare(State &state) {state.stats.mean();}
     };
 
     struct Funct_max1 : public Unary {
         Funct_max1(Node *a) : Unary(a) {}
-        float eval(State &state) {return state.stats.maximum((int)(arg->eval(state) + 0.5));}
+        float eval(State &state) {return state.stats.maximum(state.channel(arg->eval(state)));}
+        void prepare(State &state) {state.stats.mean();}
     };
 
     struct Funct_min0 : public Node {
         float eval(State &state) {return state.stats.minimum();}
+        void prepare(State &state) {state.stats.mean();}
     };
 
     struct Funct_min1 : public Unary {
         Funct_min1(Node *a) : Unary(a) {}
-        float eval(State &state) {return state.stats.minimum((int)(arg->eval(state) + 0.5));}
+        float eval(State &state) {return state.stats.minimum(state.channel(arg->eval(state)));}
+        void prepare(State &state) {state.stats.mean();}
     };
 
     struct Funct_variance0 : public Node {
         float eval(State &state) {return state.stats.variance();}
+        void prepare(State &state) {state.stats.variance();}
     };
 
     struct Funct_variance1 : public Unary {
         Funct_variance1(Node *a) : Unary(a) {}
-        float eval(State &state) {return state.stats.variance((int)(arg->eval(state) + 0.5));}
+        float eval(State &state) {return state.stats.variance(state.channel(arg->eval(state)));}
+        void prepare(State &state) {state.stats.variance();}
     };
 
     struct Funct_stddev0 : public Node {
         float eval(State &state) {return sqrtf(state.stats.variance());}
+        void prepare(State &state) {state.stats.variance();}
     };
 
     struct Funct_stddev1 : public Unary {
         Funct_stddev1(Node *a) : Unary(a) {}
-        float eval(State &state) {return sqrtf(state.stats.variance((int)(arg->eval(state) + 0.5)));}
+        float eval(State &state) {return sqrtf(state.stats.variance(state.channel(arg->eval(state))));}
+        void prepare(State &state) {state.stats.variance();}
     };
 
     struct Funct_skew0 : public Node {
         float eval(State &state) {return state.stats.skew();}
+        void prepare(State &state) {state.stats.variance();}
     };
 
     struct Funct_skew1 : public Unary {
         Funct_skew1(Node *a) : Unary(a) {}
-        float eval(State &state) {return state.stats.skew((int)(arg->eval(state) + 0.5));}
+        float eval(State &state) {return state.stats.skew(state.channel(arg->eval(state)));}
+        void prepare(State &state) {state.stats.variance();}
     };
 
     struct Funct_kurtosis0 : public Node {
         float eval(State &state) {return state.stats.kurtosis();}
+        void prepare(State &state) {state.stats.variance();}
     };
 
     struct Funct_kurtosis1 : public Unary {
         Funct_kurtosis1(Node *a) : Unary(a) {}
-        float eval(State &state) {return state.stats.kurtosis((int)(arg->eval(state) + 0.5));}
+        float eval(State &state) {return state.stats.kurtosis(state.channel(arg->eval(state)));}
+        void prepare(State &state) {state.stats.variance();}
     };
 
     struct Funct_covariance : public Binary {
         Funct_covariance(Node *left_, Node *right_) : Binary(left_, right_) {}
-        float eval(State &state) {return state.stats.covariance((int)(left->eval(state) + 0.5), (int)(right->eval(state) + 0.5));}
+        float eval(State &state) {return state.stats.covariance(state.channel(left->eval(state)), state.channel(right->eval(state)));}
+        void prepare(State &state) {state.stats.variance();}
     };
 
     struct SampleHere : public Unary {
         SampleHere(Node *a) : Unary(a) {}
         float eval(State &state) {
-            int c = (int)(arg->eval(state) + 0.5);
-            return state.im(state.x, state.y, state.t, c);
+            return state.im(state.x, state.y, state.t, state.channel(arg->eval(state)));
+        }
+        int varies() {return VaryX | VaryY | VaryT | arg->variation;}
+        void evalScanline(State &state, float *out, int width) {
+            if (arg->variation & VaryX) {
+                Node::evalScanline(state, out, width);
+                return;
+            }
+            const Image &im = state.im;
+            const float *in = &im(state.x, state.y, state.t, state.channel(arg->eval(state)));
+            for (int i = 0; i < width; i++) out[i] = in[i*im.xstride];
         }
     };
 
@@ -289,12 +524,26 @@ public:
         }
 
         float eval(State &state) {
-            if (sample.size() != (size_t)state.im.channels) sample.resize(state.im.channels);
-            state.im.sample2D(left->eval(state), right->eval(state), state.t, sample);
-            return sample[state.c];
+            if (state.sample.size() != (size_t)state.im.channels) state.sample.resize(state.im.channels);
+            state.im.sample2D(left->eval(state), right->eval(state), state.t, state.sample);
+            return state.sample[state.c];
         }
 
-        vector<float> sample;
+        int varies() {return VaryT | VaryC | left->variation | right->variation;}
+
+        void evalScanline(State &state, float *out, int width) {
+            if (state.sample.size() != (size_t)state.im.channels) state.sample.resize(state.im.channels);
+            float *sx = state.push(width);
+            float *sy = state.push(width);
+            left->scanline(state, sx, width);
+            right->scanline(state, sy, width);
+            for (int i = 0; i < width; i++) {
+                state.im.sample2D(sx[i], sy[i], state.t, state.sample);
+                out[i] = state.sample[state.c];
+            }
+            state.pop(width);
+            state.pop(width);
+        }
     };
 
     struct Sample3D : public Ternary {
@@ -302,34 +551,64 @@ public:
         }
 
         float eval(State &state) {
-            if (sample.size() != (size_t)state.im.channels) sample.resize(state.im.channels);
+            if (state.sample.size() != (size_t)state.im.channels) state.sample.resize(state.im.channels);
             state.im.sample3D(left->eval(state),
                               middle->eval(state),
-                              right->eval(state), sample);
-            return sample[state.c];
+                              right->eval(state), state.sample);
+            return state.sample[state.c];
         }
 
-        vector<float> sample;
+        int varies() {return VaryC | left->variation | middle->variation | right->variation;}
+
+        void evalScanline(State &state, float *out, int width) {
+            if (state.sample.size() != (size_t)state.im.channels) state.sample.resize(state.im.channels);
+            float *sx = state.push(width);
+            float *sy = state.push(width);
+            float *st = state.push(width);
+            left->scanline(state, sx, width);
+            middle->scanline(state, sy, width);
+            right->scanline(state, st, width);
+            for (int i = 0; i < width; i++) {
+                state.im.sample3D(sx[i], sy[i], st[i], state.sample);
+                out[i] = state.sample[state.c];
+            }
+            state.pop(width);
+            state.pop(width);
+            state.pop(width);
+        }
     };
 
     struct Var_x : public Node {
         float eval(State &state) {return state.x;}
+        int varies() {return VaryX;}
+        void evalScanline(State &state, float *out, int width) {
+            for (int i = 0; i < width; i++) out[i] = state.x + i;
+        }
     };
 
     struct Var_y : public Node {
         float eval(State &state) {return state.y;}
+        int varies() {return VaryY;}
     };
 
     struct Var_t : public Node {
         float eval(State &state) {return state.t;}
+        int varies() {return VaryT;}
     };
 
     struct Var_c : public Node {
         float eval(State &state) {return state.c;}
+        int varies() {return VaryC;}
     };
 
     struct Var_val : public Node {
         float eval(State &state) {return state.im(state.x, state.y, state.t, state.c);}
+        int varies() {return VaryAll;}
+        void evalScanline(State &state, float *out, int width) {
+            const Image &im = state.im;
+            const float *in = &im(state.x, state.y, state.t, state.c);
+            for (int i = 0; i < width; i++) out[i] = in[i*im.xstride];
+        }
     };
 
     struct Uniform_width : public Node {
@@ -378,7 +657,12 @@ private:
     // Term    -> Funct ( ) | Funct ( IfThenElse , IfThenElse ) | Funct ( IfThenElse ) | - Term | Var | ( IfThenElse ) | Float | Sample
     Node *parseTerm();
 
+    // Compute the variation of each node, and replace those that
+    // don't vary at all with their value
+    Node *fold(Node *node, State &state);
+
     Node *root;
+    int nodes;
     string source;
     size_t sourceIndex;
     bool varyingAllowed;
@@ -390,6 +674,17 @@ public:
 
     float eval(State &state);
 
+    // Get ready to evaluate over the image in the given state with
+    // evalScanline: compute the image statistics the expression uses,
+    // and evaluate the parts that are the same everywhere once. Call
+    // this once from a single thread, then give each thread its own
+    // copy of the state.
+    void prepare(State &state);
+
+    // Evaluate at state.x ... state.x + width - 1 on the row state.y,
+    // state.t, state.c, a vector at a time where possible.
+    void evalScanline(State &state, float *out, int width);
+
     static void help();
 
 };
@@ -1,8 +1,10 @@
 #ifndef IMAGESTACK_PERMUTOHEDRAL_H
+#define IMAGESTACK_PERMUTOHEDRAL_H
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
 
 #include "header.h"
 
@@ -21,12 +23,12 @@ public:
      *  vd_: the dimensionality of the value vectors
      */
     HashTablePermutohedral(int kd_, int vd_) : kd(kd_), vd(vd_) {
-        capacity = 1 << 15;
+        capacity = 0;
         filled = 0;
-        entries = new Entry[capacity];
-        keys = new short[kd*capacity/2];
-        values = new float[vd*capacity/2];
-        memset(values, 0, sizeof(float)*vd*capacity/2);
+        entries = NULL;
+        keys = NULL;
+        values = NULL;
+        resize(1 << 15);
     }
 
     ~HashTablePermutohedral() {
@@ -44,44 +46,68 @@ public:
     // Returns a pointer to the values array.
     float *getValues() { return values; }
 
-    /* Returns the index into the hash table for a given key.
+    // Makes room for at least n vectors in total. Not safe to call
+    // while other threads use the table.
+    void reserve(size_t n) {
+        size_t c = capacity;
+        while (c/2 < n) { c *= 2; }
+        if (c != capacity) { resize(c); }
+    }
+
+    // Doubles the room in the table. Not safe to call while other
+    // threads use the table.
+    void grow() {
+        resize(capacity*2);
+    }
+
+    /* Returns the index into the values array for a given key. Several
+     * threads may look up and create entries at once.
      *     key: a pointer to the position vector.
      *       h: hash of the position vector.
      *  create: a flag specifying whether an entry should be created,
      *          should an entry with the given key not found.
+     * Returns -1 if the key was not found and create is false, or if
+     * the table is too full to create it. The table never grows on
+     * its own, so that it is safe to share; callers should grow it and
+     * try again.
      */
-    int lookupOffset(short *key, size_t h, bool create = true) {
-
-        // Double hash table size if necessary
-        if (create && filled >= (capacity/2)-1) {
-            grow();
-            h = hash(key) % capacity;
-        }
+    int lookupOffset(const short *key, size_t h, bool create = true) {
 
         // Find the entry with the given key
         while (1) {
-            Entry e = entries[h];
+            int e = entries[h].load(std::memory_order_acquire);
             // check if the cell is empty
-            if (e.keyIdx == -1) {
+            if (e == Empty) {
                 if (!create) { return -1; } // Return not found.
-                // need to create an entry. Store the given key.
+
+                // Claim the cell, then a slot to store the given key
+                // in. Other threads looking at this cell wait until
+                // the key is stored.
+                if (!entries[h].compare_exchange_strong(e, Busy, std::memory_order_acquire)) {
+                    continue;
+                }
+                int idx = filled.fetch_add(1);
+                if (idx >= (int)(capacity/2)) {
+                    filled.fetch_sub(1);
+                    entries[h].store(Empty, std::memory_order_release);
+                    return -1;
+                }
                 for (int i = 0; i < kd; i++) {
-                    keys[filled *kd+i] = key[i];
+                    keys[idx*kd+i] = key[i];
                 }
-                e.keyIdx = filled*kd;
-                e.valueIdx = filled*vd;
-                entries[h] = e;
-                filled++;
-                return e.valueIdx;
+                entries[h].store(idx, std::memory_order_release);
+                return idx*vd;
             }
 
+            if (e == Busy) { continue; }
+
             // check if the cell has a matching key
             bool match = true;
             for (int i = 0; i < kd && match; i++) {
-                match = keys[e.keyIdx+i] == key[i];
+                match = keys[e*kd+i] == key[i];
             }
             if (match) {
-                return e.valueIdx;
+                return e*vd;
             }
 
             // increment the bucket with wraparound
@@ -93,9 +119,11 @@ public:
     /* Looks up the value vector associated with a given key vector.
      *        k : pointer to the key vector to be looked up.
      *   create : true if a non-existing key should be created.
+     * Returns NULL if the key is not found, or can't be created
+     * because the table is full.
      */
-    float *lookup(short *k, bool create = true) {
-        size_t h = hash(k) % capacity;
+    float *lookup(const short *k, bool create = true) {
+        size_t h = hash(k) & (capacity-1);
         int offset = lookupOffset(k, h, create);
         if (offset < 0) { return NULL; }
         else { return values + offset; }
@@ -112,53 +140,51 @@ public:
     }
 
 private:
-    /* Grows the size of the hash table */
-    void grow() {
+    // The contents of a cell that holds no key, or whose key is still
+    // being stored. Otherwise a cell holds the index of its key and
+    // value vectors.
+    enum {Empty = -1, Busy = -2};
+
+    /* Changes the number of cells in the table, which must be a power
+     * of two. The table holds at most half as many vectors. */
+    void resize(size_t newCapacity) {
         //printf("Resizing hash table\n");
 
-        size_t oldCapacity = capacity;
-        capacity *= 2;
-
         // Migrate the value vectors.
-        float *newValues = new float[vd*capacity/2];
-        memset(newValues, 0, sizeof(float)*vd*capacity/2);
-        memcpy(newValues, values, sizeof(float)*vd*filled);
+        float *newValues = new float[vd*newCapacity/2];
+        memset(newValues, 0, sizeof(float)*vd*newCapacity/2);
+        if (values) { memcpy(newValues, values, sizeof(float)*vd*filled); }
         delete[] values;
         values = newValues;
 
         // Migrate the key vectors.
-        short *newKeys = new short[kd*capacity/2];
-        memcpy(newKeys, keys, sizeof(short)*kd*filled);
+        short *newKeys = new short[kd*newCapacity/2];
+        if (keys) { memcpy(newKeys, keys, sizeof(short)*kd*filled); }
         delete[] keys;
         keys = newKeys;
 
-        Entry *newEntries = new Entry[capacity];
-
-        // Migrate the table of indices.
-        for (size_t i = 0; i < oldCapacity; i++) {
-            if (entries[i].keyIdx == -1) { continue; }
-            size_t h = hash(keys + entries[i].keyIdx) % capacity;
-            while (newEntries[h].keyIdx != -1) {
+        // Rebuild the table of indices.
+        delete[] entries;
+        capacity = newCapacity;
+        entries = new std::atomic<int>[capacity];
+        for (size_t i = 0; i < capacity; i++) {
+            entries[i].store(Empty, std::memory_order_relaxed);
+        }
+        for (int i = 0; i < filled; i++) {
+            size_t h = hash(keys + i*kd) & (capacity-1);
+            while (entries[h].load(std::memory_order_relaxed) != Empty) {
                 h++;
                 if (h == capacity) { h = 0; }
             }
-            newEntries[h] = entries[i];
+            entries[h].store(i, std::memory_order_relaxed);
         }
-        delete[] entries;
-        entries = newEntries;
     }
 
-    // Private struct for the hash table entries.
-    struct Entry {
-        Entry() : keyIdx(-1), valueIdx(-1) {}
-        int keyIdx;
-        int valueIdx;
-    };
-
     short *keys;
     float *values;
-    Entry *entries;
-    size_t capacity, filled;
+    std::atomic<int> *entries;
+    size_t capacity;
+    std::atomic<int> filled;
     int kd, vd;
 };
 
@@ -186,12 +212,16 @@ public:
 
           float *imPtr = im(0, 0, 0);
           float *refPtr = ref(0, 0, 0);
+          int index = 0;
           for (int t = 0; t < im.frames; t++) {
               for (int y = 0; y < im.height; y++) {
                   for (int x = 0; x < im.width; x++) {
-                      lattice.splat(refPtr, imPtr);
+                      while (!lattice.splat(refPtr, imPtr, index)) {
+                          lattice.grow();
+                      }
                       refPtr += ref.channels;
                       imPtr += im.channels;
+                      index++;
                   }
               }
           }
@@ -205,15 +235,10 @@ public:
 
           Image out(im.width, im.height, im.frames, im.channels);
 
-          lattice.beginSlice();
           float *outPtr = out(0, 0, 0);
-          for (int t = 0; t < im.frames; t++) {
-              for (int y = 0; y < im.height; y++) {
-                  for (int x = 0; x < im.width; x++) {
-                      lattice.slice(outPtr);
-                      outPtr += out.channels;
-                  }
-              }
+          for (int i = 0; i < im.width*im.height*im.frames; i++) {
+              lattice.slice(outPtr, i);
+              outPtr += out.channels;
           }
 
           return out;
@@ -221,24 +246,24 @@ public:
     */
 
     /* Constructor
-     *     d_ : dimensionality of key vectors
-     *    vd_ : dimensionality of value vectors
-     * nData_ : number of points in the input
+     *           d_ : dimensionality of key vectors
+     *          vd_ : dimensionality of value vectors
+     *       nData_ : number of points in the input
+     * deterministic_ : if true, values are summed into the lattice in
+     *                  the order of the inputs, so that the result
+     *                  doesn't depend on how splatting was divided
+     *                  between threads
      */
-    PermutohedralLattice(int d_, int vd_, int nData_) :
-        d(d_), vd(vd_), nData(nData_), hashTable(d_, vd_) {
+    PermutohedralLattice(int d_, int vd_, int nData_, bool deterministic_ = false) :
+        d(d_), vd(vd_), nData(nData_), deterministic(deterministic_), hashTable(d_, vd_) {
+        assert(d <= maxDimensions, "The permutohedral lattice can have at most %d dimensions\n", maxDimensions);
 
         // Allocate storage for various arrays
-        elevated = new float[d+1];
         scaleFactor = new float[d];
-
-        greedy = new short[d+1];
-        rank = new char[d+1];
-        barycentric = new float[d+2];
-        replay = new ReplayEntry[nData*(d+1)];
-        nReplay = 0;
+        replay = new ReplayEntry[(size_t)nData*(d+1)];
+        pending = deterministic ? new float[(size_t)nData*vd] : NULL;
         canonical = new short[(d+1)*(d+1)];
-        key = new short[d+1];
+        previewed = 0;
 
         // compute the coordinates of the canonical simplex, in which
         // the difference between a contained point and the zero
@@ -276,222 +301,175 @@ public:
 
     ~PermutohedralLattice() {
         delete[] scaleFactor;
-        delete[] elevated;
-        delete[] greedy;
-        delete[] rank;
-        delete[] barycentric;
         delete[] replay;
+        delete[] pending;
         delete[] canonical;
-        delete[] key;
     }
 
-
-    /* Performs splatting with given position and value vectors */
-    void splat(float *position, float *value) {
-
-        // first rotate position into the (d+1)-dimensional hyperplane
-        elevated[d] = -d*position[d-1]*scaleFactor[d-1];
-        for (int i = d-1; i > 0; i--)
-            elevated[i] = (elevated[i+1] -
-                           i*position[i-1]*scaleFactor[i-1] +
-                           (i+2)*position[i]*scaleFactor[i]);
-        elevated[0] = elevated[1] + 2*position[0]*scaleFactor[0];
-
-        // prepare to find the closest lattice points
-        float scale = 1.0f/(d+1);
-        char *myrank = rank;
-        short *mygreedy = greedy;
-
-        // greedily search for the closest zero-colored lattice point
-        int sum = 0;
-        for (int i = 0; i <= d; i++) {
-            float v = elevated[i]*scale;
-            float up = ceilf(v)*(d+1);
-            float down = floorf(v)*(d+1);
-
-            if (up - elevated[i] < elevated[i] - down) { mygreedy[i] = (short)up; }
-            else { mygreedy[i] = (short)down; }
-
-            sum += mygreedy[i];
+    /* Creates the lattice points around a position before splatting,
+     * to size the hash table. Call it with an evenly spread sample of
+     * the positions to be splatted, from one thread, and then call
+     * beginSplat.
+     */
+    void preview(float *position) {
+        Simplex s;
+        find(position, &s);
+        short key[maxDimensions+1];
+        for (int remainder = 0; remainder <= d; remainder++) {
+            s.key(remainder, canonical, key);
+            while (!hashTable.lookup(key, true)) {
+                hashTable.grow();
+            }
         }
-        sum /= d+1;
-
-        // rank differential to find the permutation between this simplex and the canonical one.
-        // (See pg. 3-4 in paper.)
-        for (int i = 0; i < d+1; i++) { myrank[i] = 0; }
-        for (int i = 0; i < d; i++)
-            for (int j = i+1; j <= d; j++)
-                if (elevated[i] - mygreedy[i] < elevated[j] - mygreedy[j]) { myrank[i]++; } else { myrank[j]++; }
 
-        if (sum > 0) {
-            // sum too large - the point is off the hyperplane.
-            // need to bring down the ones with the smallest differential
-            for (int i = 0; i <= d; i++) {
-                if (myrank[i] >= d + 1 - sum) {
-                    mygreedy[i] -= d+1;
-                    myrank[i] += sum - (d+1);
-                } else {
-                    myrank[i] += sum;
-                }
-            }
-        } else if (sum < 0) {
-            // sum too small - the point is off the hyperplane
-            // need to bring up the ones with largest differential
-            for (int i = 0; i <= d; i++) {
-                if (myrank[i] < -sum) {
-                    mygreedy[i] += d+1;
-                    myrank[i] += (d+1) + sum;
-                } else {
-                    myrank[i] += sum;
-                }
-            }
+        // Record how many points the sample had touched each time its
+        // size doubled
+        previewed++;
+        if ((previewed & (previewed - 1)) == 0) {
+            previewSizes.push_back(hashTable.size());
         }
+    }
 
-        // Compute barycentric coordinates (See pg.10 of paper.)
-        for (int i = 0; i < d+2; i++) { barycentric[i] = 0.0f; }
-        for (int i = 0; i <= d; i++) {
-            barycentric[d-myrank[i]] += (elevated[i] - mygreedy[i]) * scale;
-            barycentric[d+1-myrank[i]] -= (elevated[i] - mygreedy[i]) * scale;
+    /* Sizes the hash table for all nData inputs. The number of
+     * distinct lattice points grows more slowly than the number of
+     * inputs, as inputs start to share points. It is extrapolated
+     * from the last doubling of the previewed sample, assuming it
+     * follows a power law.
+     */
+    void beginSplat() {
+        size_t expected = hashTable.size();
+        int n = (int)previewSizes.size();
+        if (n >= 2 && previewSizes[n-2] > 0) {
+            double growth = (double)previewSizes[n-1] / previewSizes[n-2];
+            double exponent = std::min(1.0, std::max(0.0, log(growth) / log(2.0)));
+            double sample = (double)(1 << (n-1));
+            expected = (size_t)(previewSizes[n-1] * pow(nData / sample, exponent) * 1.25);
         }
-        barycentric[0] += 1.0f + barycentric[d+1];
+        expected = std::min(expected, (size_t)nData*(d+1));
+        hashTable.reserve(std::max(expected, (size_t)hashTable.size()));
+    }
 
-        // Splat the value into each vertex of the simplex, with barycentric weights.
+    /* Performs splatting with given position and value vectors, for
+     * the input with the given index. Several threads may splat at
+     * once. Returns false, having splatted nothing, if the hash table
+     * is full. Call grow() from one thread and then try again.
+     */
+    bool splat(float *position, float *value, int index) {
+        Simplex s;
+        find(position, &s);
+
+        // Find or create the vertices of the simplex before touching
+        // any values, so that a full table leaves nothing half done
+        float *vals[maxDimensions+1];
+        short key[maxDimensions+1];
         for (int remainder = 0; remainder <= d; remainder++) {
-            // Compute the location of the lattice point explicitly (all but the last coordinate - it's redundant because they sum to zero)
-            for (int i = 0; i < d; i++) {
-                key[i] = mygreedy[i] + canonical[remainder*(d+1) + myrank[i]];
-            }
-
-            // Retrieve pointer to the value at this vertex.
-            float *val = hashTable.lookup(key, true);
-
-            // Accumulate values with barycentric weight.
-            for (int i = 0; i < vd; i++) {
-                val[i] += barycentric[remainder]*value[i];
-            }
+            s.key(remainder, canonical, key);
+            vals[remainder] = hashTable.lookup(key, true);
+            if (!vals[remainder]) { return false; }
+        }
 
+        ReplayEntry *r = replay + (size_t)index*(d+1);
+        for (int remainder = 0; remainder <= d; remainder++) {
             // Record this interaction to use later when slicing
-            replay[nReplay].offset = val - hashTable.getValues();
-            replay[nReplay].weight = barycentric[remainder];
-            nReplay++;
-
+            r[remainder].offset = vals[remainder] - hashTable.getValues();
+            r[remainder].weight = s.barycentric[remainder];
         }
-    }
-
-    /* Performs splicing with given position and value vectors. If
-     * slicing using the same vectors used to splat, call the other
-     * version of slice instead. */
-    void slice(float *position, float *value) {
-
-        // first rotate position into the (d+1)-dimensional hyperplane
-        elevated[d] = -d*position[d-1]*scaleFactor[d-1];
-        for (int i = d-1; i > 0; i--)
-            elevated[i] = (elevated[i+1] -
-                           i*position[i-1]*scaleFactor[i-1] +
-                           (i+2)*position[i]*scaleFactor[i]);
-        elevated[0] = elevated[1] + 2*position[0]*scaleFactor[0];
-
-        // prepare to find the closest lattice points
-        float scale = 1.0f/(d+1);
-        char *myrank = rank;
-        short *mygreedy = greedy;
-
-        // greedily search for the closest zero-colored lattice point
-        int sum = 0;
-        for (int i = 0; i <= d; i++) {
-            float v = elevated[i]*scale;
-            float up = ceilf(v)*(d+1);
-            float down = floorf(v)*(d+1);
 
-            if (up - elevated[i] < elevated[i] - down) { mygreedy[i] = (short)up; }
-            else { mygreedy[i] = (short)down; }
-
-            sum += mygreedy[i];
+        if (deterministic) {
+            // Summed in order by blur
+            memcpy(pending + (size_t)index*vd, value, sizeof(float)*vd);
+            return true;
         }
-        sum /= d+1;
-
-        // rank differential to find the permutation between this simplex and the canonical one.
-        // (See pg. 3-4 in paper.)
-        memset(myrank, 0, sizeof(char)*(d+1));
-        for (int i = 0; i < d; i++)
-            for (int j = i+1; j <= d; j++)
-                if (elevated[i] - mygreedy[i] < elevated[j] - mygreedy[j]) { myrank[i]++; } else { myrank[j]++; }
 
-        if (sum > 0) {
-            // sum too large - the point is off the hyperplane.
-            // need to bring down the ones with the smallest differential
-            for (int i = 0; i <= d; i++) {
-                if (myrank[i] >= d + 1 - sum) {
-                    mygreedy[i] -= d+1;
-                    myrank[i] += sum - (d+1);
-                } else {
-                    myrank[i] += sum;
+        // Splat the value into each vertex of the simplex, with barycentric weights.
+        bool shared = false;
+        #ifdef _OPENMP
+        shared = omp_in_parallel();
+        #endif
+        for (int remainder = 0; remainder <= d; remainder++) {
+            float *val = vals[remainder];
+            float w = s.barycentric[remainder];
+            if (shared) {
+                for (int i = 0; i < vd; i++) {
+                    #ifdef _OPENMP
+                    #pragma omp atomic
+                    #endif
+                    val[i] += w*value[i];
                 }
-            }
-        } else if (sum < 0) {
-            // sum too small - the point is off the hyperplane
-            // need to bring up the ones with largest differential
-            for (int i = 0; i <= d; i++) {
-                if (myrank[i] < -sum) {
-                    mygreedy[i] += d+1;
-                    myrank[i] += (d+1) + sum;
-                } else {
-                    myrank[i] += sum;
+            } else {
+                for (int i = 0; i < vd; i++) {
+                    val[i] += w*value[i];
                 }
             }
         }
+        return true;
+    }
 
-        // Compute barycentric coordinates (See pg.10 of paper.)
-        memset(barycentric, 0, sizeof(float)*(d+2));
-        for (int i = 0; i <= d; i++) {
-            barycentric[d-myrank[i]] += (elevated[i] - mygreedy[i]) * scale;
-            barycentric[d+1-myrank[i]] -= (elevated[i] - mygreedy[i]) * scale;
-        }
-        barycentric[0] += 1.0f + barycentric[d+1];
+    // Makes room for more lattice points after splat fails
+    void grow() {
+        hashTable.grow();
+    }
 
-        // Splat the value into each vertex of the simplex, with barycentric weights.
-        for (int remainder = 0; remainder <= d; remainder++) {
-            // Compute the location of the lattice point explicitly (all but the last coordinate - it's redundant because they sum to zero)
-            for (int i = 0; i < d; i++) {
-                key[i] = mygreedy[i] + canonical[remainder*(d+1) + myrank[i]];
-            }
+    /* Performs splicing with given position and value vectors. If
+     * slicing using the same vectors used to splat, call the other
+     * version of slice instead. Several threads may slice at once.
+     */
+    void slice(float *position, float *value) {
+        Simplex s;
+        find(position, &s);
 
-            // Retrieve pointer to the value at this vertex.
-            float *val = hashTable.lookup(key, true);
+        for (int i = 0; i < vd; i++) { value[i] = 0; }
 
-            // Accumulate values with barycentric weight.
+        // Gather from each vertex of the simplex, with barycentric
+        // weights. Vertices that weren't splatted to are zero.
+        short key[maxDimensions+1];
+        for (int remainder = 0; remainder <= d; remainder++) {
+            s.key(remainder, canonical, key);
+            float *val = hashTable.lookup(key, false);
+            if (!val) { continue; }
             for (int i = 0; i < vd; i++) {
-                value[i] += barycentric[remainder]*val[i];
+                value[i] += s.barycentric[remainder]*val[i];
             }
         }
     }
 
-    // Prepare for slicing
-    void beginSlice() {
-        nReplay = 0;
-    }
-
-    /* Performs slicing out of position vectors. Note that the barycentric weights and the simplex
+    /* Performs slicing out of position vectors, for the input with the
+     * given index. Note that the barycentric weights and the simplex
      * containing each position vector were calculated and stored in the splatting step.
      * We may reuse this to accelerate the algorithm. (See pg. 6 in paper.)
+     * Several threads may slice at once.
      */
-    void slice(float *col) {
+    void slice(float *col, int index) {
         float *base = hashTable.getValues();
+        const ReplayEntry *r = replay + (size_t)index*(d+1);
         for (int j = 0; j < vd; j++) { col[j] = 0; }
         for (int i = 0; i <= d; i++) {
-            ReplayEntry r = replay[nReplay++];
             for (int j = 0; j < vd; j++) {
-                col[j] += r.weight*base[r.offset + j];
+                col[j] += r[i].weight*base[r[i].offset + j];
             }
         }
     }
 
-    /* Performs a Gaussian blur along each projected axis in the hyperplane. */
+    /* Performs a Gaussian blur along each projected axis in the
+     * hyperplane, in parallel over the lattice points. */
     void blur() {
+        if (deterministic) {
+            // Sum the values into the lattice in the order of the inputs
+            float *base = hashTable.getValues();
+            for (int n = 0; n < nData; n++) {
+                const ReplayEntry *r = replay + (size_t)n*(d+1);
+                const float *value = pending + (size_t)n*vd;
+                for (int i = 0; i <= d; i++) {
+                    for (int k = 0; k < vd; k++) {
+                        base[r[i].offset + k] += r[i].weight*value[k];
+                    }
+                }
+            }
+        }
+
         // Prepare arrays
-        short *neighbor1 = new short[d+1];
-        short *neighbor2 = new short[d+1];
-        float *newValue = new float[vd*hashTable.size()];
+        const int points = hashTable.size();
+        float *newValue = new float[(size_t)vd*points];
         float *oldValue = hashTable.getValues();
         float *hashTableBase = oldValue;
 
@@ -501,7 +479,11 @@ public:
         // For each of d+1 axes,
         for (int j = 0; j <= d; j++) {
             // For each vertex in the lattice,
-            for (int i = 0; i < hashTable.size(); i++) { // blur point i in dimension j
+            #ifdef _OPENMP
+            #pragma omp parallel for schedule(dynamic, 1024)
+            #endif
+            for (int i = 0; i < points; i++) { // blur point i in dimension j
+                short neighbor1[maxDimensions+1], neighbor2[maxDimensions+1];
                 short *currentKey = hashTable.getKeys() + i*(d); // keys to current vertex
                 for (int k = 0; k < d; k++) {
                     neighbor1[k] = currentKey[k] + 1;
@@ -510,8 +492,8 @@ public:
                 neighbor1[j] = currentKey[j] - d;
                 neighbor2[j] = currentKey[j] + d; // keys to the neighbors along the given axis.
 
-                float *oldVal = oldValue + i*vd;
-                float *newVal = newValue + i*vd;
+                float *oldVal = oldValue + (size_t)i*vd;
+                float *newVal = newValue + (size_t)i*vd;
 
                 float *vm1, *vp1;
 
@@ -536,34 +518,128 @@ public:
 
         // depending where we ended up, we may have to copy data
         if (oldValue != hashTableBase) {
-            memcpy(hashTableBase, oldValue, hashTable.size()*vd*sizeof(float));
+            memcpy(hashTableBase, oldValue, (size_t)points*vd*sizeof(float));
             delete[] oldValue;
         } else {
             delete[] newValue;
         }
 
         delete[] zero;
-        delete[] neighbor1;
-        delete[] neighbor2;
     }
 
 private:
 
+    static const int maxDimensions = 63;
+
+    // The simplex of the lattice enclosing a position, and the
+    // barycentric coordinates of the position within it
+    struct Simplex {
+        short greedy[maxDimensions+1];
+        char rank[maxDimensions+1];
+        float barycentric[maxDimensions+2];
+        int d;
+
+        // Compute the location of the lattice point explicitly (all
+        // but the last coordinate - it's redundant because they sum
+        // to zero)
+        void key(int remainder, const short *canonical, short *k) const {
+            for (int i = 0; i < d; i++) {
+                k[i] = greedy[i] + canonical[remainder*(d+1) + rank[i]];
+            }
+        }
+    };
+
+    void find(float *position, Simplex *s) const {
+        float elevated[maxDimensions+1];
+        s->d = d;
+
+        // first rotate position into the (d+1)-dimensional hyperplane
+        elevated[d] = -d*position[d-1]*scaleFactor[d-1];
+        for (int i = d-1; i > 0; i--)
+            elevated[i] = (elevated[i+1] -
+                           i*position[i-1]*scaleFactor[i-1] +
+                           (i+2)*position[i]*scaleFactor[i]);
+        elevated[0] = elevated[1] + 2*position[0]*scaleFactor[0];
+
+        // prepare to find the closest lattice points
+        float scale = 1.0f/(d+1);
+        char *myrank = s->rank;
+        short *mygreedy = s->greedy;
+
+        // greedily search for the closest zero-colored lattice point
+        int sum = 0;
+        for (int i = 0; i <= d; i++) {
+            float v = elevated[i]*scale;
+            float up = ceilf(v)*(d+1);
+            float down = floorf(v)*(d+1);
+
+            if (up - elevated[i] < elevated[i] - down) { mygreedy[i] = (short)up; }
+            else { mygreedy[i] = (short)down; }
+
+            sum += mygreedy[i];
+        }
+        sum /= d+1;
+
+        // rank differential to find the permutation between this simplex and the canonical one.
+        // (See pg. 3-4 in paper.)
+        for (int i = 0; i < d+1; i++) { myrank[i] = 0; }
+        for (int i = 0; i < d; i++)
+            for (int j = i+1; j <= d; j++)
+                if (elevated[i] - mygreedy[i] < elevated[j] - mygreedy[j]) { myrank[i]++; } else { myrank[j]++; }
+
+        if (sum > 0) {
+            // sum too large - the point is off the hyperplane.
+            // need to bring down the ones with the smallest differential
+            for (int i = 0; i <= d; i++) {
+                if (myrank[i] >= d + 1 - sum) {
+                    mygreedy[i] -= d+1;
+                    myrank[i] += sum - (d+1);
+                } else {
+                    myrank[i] += sum;
+                }
+            }
+        } else if (sum < 0) {
+            // sum too small - the point is off the hyperplane
+            // need to bring up the ones with largest differential
+            for (int i = 0; i <= d; i++) {
+                if (myrank[i] < -sum) {
+                    mygreedy[i] += d+1;
+                    myrank[i] += (d+1) + sum;
+                } else {
+                    myrank[i] += sum;
+                }
+            }
+        }
+
+        // Compute barycentric coordinates (See pg.10 of paper.)
+        float *barycentric = s->barycentric;
+        for (int i = 0; i < d+2; i++) { barycentric[i] = 0.0f; }
+        for (int i = 0; i <= d; i++) {
+            barycentric[d-myrank[i]] += (elevated[i] - mygreedy[i]) * scale;
+            barycentric[d+1-myrank[i]] -= (elevated[i] - mygreedy[i]) * scale;
+        }
+        barycentric[0] += 1.0f + barycentric[d+1];
+    }
+
     int d, vd, nData;
-    float *elevated, *scaleFactor, *barycentric;
+    bool deterministic;
+    float *scaleFactor;
     short *canonical;
-    short *key;
 
     // slicing is done by replaying splatting (ie storing the sparse matrix)
     struct ReplayEntry {
         int offset;
         float weight;
     } *replay;
-    int nReplay;
 
-public:
-    char  *rank;
-    short *greedy;
+    // The values splatted in deterministic mode, until blur sums them
+    float *pending;
+
+    // The number of positions previewed, and the size of the hash
+    // table each time that number reached a power of two
+    int previewed;
+    vector<int> previewSizes;
+
     HashTablePermutohedral hashTable;
 };
 
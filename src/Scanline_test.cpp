@@ -0,0 +1,98 @@
+#include "ImageStack.h"
+
+using namespace ImageStack;
+using namespace ImageStack::Expr;
+
+// Benchmarks setScanline, which finishes each scanline with a vector
+// that overlaps the previous one, against the old version, which
+// walked with scalar code up to an aligned store address and finished
+// with scalar code. Scanlines are taken from region views of a larger
+// image that start at every offset within a vector, like the strips
+// FastBlur and Image::region produce. Prints the nanoseconds per pixel
+// of each for every width, single threaded.
+//
+// Usage: Scanline_test [max width]
+// Every width up to max width (default 64) is tried, then a few large
+// ones.
+
+template<typename T>
+void setScanlineOld(const T src, float *const dst,
+                    int x, const int maxX,
+                    const bool boundedVX, const int minVX, const int maxVX) {
+    if (Vec::width > 1 && (maxX - x) > Vec::width*2) {
+        while (x < maxX &&
+               ((boundedVX && x < minVX) ||
+                ((size_t)(dst+x) & (Vec::width*sizeof(float) - 1)))) {
+            dst[x] = src[x];
+            x++;
+        }
+        int lastX = maxX - Vec::width;
+        if (boundedVX) lastX = std::min(lastX, maxVX);
+        while (x <= lastX) {
+            Vec::store(src.vec(x), dst+x);
+            x += Vec::width;
+        }
+    }
+    while (x < maxX) {
+        dst[x] = src[x];
+        x++;
+    }
+}
+
+template<bool old, typename S>
+double timeRegions(Image out, const S &expr_) {
+    FloatExprType(S) expr(expr_);
+    const int rows = out.height, width = out.width - Vec::width;
+    double best = 1e10;
+    for (int iter = 0; iter < 10; iter++) {
+        double t1 = currentTime();
+        for (int offset = 0; offset < Vec::width; offset++) {
+            for (int y = 0; y < rows; y++) {
+                FloatExprType(S)::Iter it = expr.scanline(0, y, 0, 0, out.width);
+                if (old) {
+                    setScanlineOld(it, &out(0, y, 0, 0), offset, offset + width, false, 0, 0);
+                } else {
+                    setScanline(it, &out(0, y, 0, 0), offset, offset + width, false, 0, 0);
+                }
+            }
+        }
+        best = std::min(best, currentTime() - t1);
+    }
+    return best * 1e9 / ((double)rows * width * Vec::width);
+}
+
+int main(int argc, char **argv) {
+    start();
+
+    int maxWidth = argc > 1 ? atoi(argv[1]) : 64;
+
+    printf("%6s %14s %14s %14s %14s\n", "width",
+           "old a*2+1", "new a*2+1", "old sqrt", "new sqrt");
+
+    try {
+        vector<int> widths;
+        for (int w = 1; w <= maxWidth; w++) {
+            widths.push_back(w);
+        }
+        widths.push_back(256);
+        widths.push_back(1024);
+        widths.push_back(4096);
+        for (size_t i = 0; i < widths.size(); i++) {
+            const int w = widths[i];
+            const int rows = std::max(16, 32768 / w);
+            Image in(w + Vec::width, rows, 1, 1);
+            Noise::apply(in, 0, 1);
+            Image out(w + Vec::width, rows, 1, 1);
+
+            double t1 = timeRegions<true>(out, in*2 + 1);
+            double t2 = timeRegions<false>(out, in*2 + 1);
+            double t3 = timeRegions<true>(out, sqrt(in)*in + 1);
+            double t4 = timeRegions<false>(out, sqrt(in)*in + 1);
+            printf("%6d %14.3f %14.3f %14.3f %14.3f\n", w, t1, t2, t3, t4);
+        }
+    } catch (Exception &e) {
+        printf("Failure: %s\n", e.message);
+    }
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "ImageStack.h"
+#include <omp.h>
+
+using namespace ImageStack;
+using namespace ImageStack::Expr;
+
+// Benchmarks Image::set, which hands out chunks of the flattened
+// (c, t, y) space to threads dynamically, against the old schedule of
+// one parallel loop over y per channel and frame. Prints the best
+// time in milliseconds of each for every combination of image size
+// and thread count.
+//
+// Usage: Schedule_test [max size]
+// The largest image tried is max size squared (default 16384).
+
+#define work(X) ((X+X*X*X)/(sqrt(X)+X*X))
+
+template<typename T>
+void set_per_scanline(Image out, const T &expr) {
+    for (int c = 0; c < out.channels; c++) {
+        for (int t = 0; t < out.frames; t++) {
+            #pragma omp parallel for
+            for (int y = 0; y < out.height; y++) {
+                typename T::Iter iter = expr.scanline(0, y, t, c, out.width);
+                setScanline(iter, &out(0, y, t, c), 0, out.width, false, 0, 0);
+            }
+        }
+    }
+}
+
+template<typename F>
+double bestOf(int iterations, const F &f) {
+    double best = 1e10;
+    for (int i = 0; i < iterations; i++) {
+        double t1 = currentTime();
+        f();
+        best = std::min(best, currentTime() - t1);
+    }
+    return best * 1000;
+}
+
+int main(int argc, char **argv) {
+    start();
+
+    int maxSize = argc > 1 ? atoi(argv[1]) : 16384;
+    const int threadCounts[] = {1, 2, 4, 8, 16, 32, 64};
+
+    printf("%8s %8s %4s %8s %12s %12s\n",
+           "width", "height", "c", "threads", "per y (ms)", "chunked (ms)");
+
+    try {
+        for (int size = 1; size <= maxSize; size *= 4) {
+            // A square image, and a short wide one with four channels
+            // that the old schedule handles badly.
+            int shapes[2][3] = {{size, size, 1}, {size*4, std::max(size/16, 1), 4}};
+            for (int s = 0; s < 2; s++) {
+                int w = shapes[s][0], h = shapes[s][1], c = shapes[s][2];
+                Image in(w, h, 1, c);
+                Noise::apply(in, 0, 1);
+                Image out(w, h, 1, c);
+                int iterations = std::max(3, std::min(100, (1 << 24) / (w*h*c)));
+
+                for (int i = 0; i < 7; i++) {
+                    omp_set_num_threads(threadCounts[i]);
+                    double t1 = bestOf(iterations, [&]() {set_per_scanline(out, work(in));});
+                    double t2 = bestOf(iterations, [&]() {out.set(work(in));});
+                    printf("%8d %8d %4d %8d %12.4f %12.4f\n", w, h, c, threadCounts[i], t1, t2);
+                }
+            }
+        }
+    } catch (Exception &e) {
+        printf("Failure: %s\n", e.message);
+    }
+
+    return 0;
+}
@@ -37,6 +37,11 @@ void Push::parse(vector<string> args) {
     }
 }
 
+int Push::footprint(vector<string> args) {
+    // Pushing a fixed size image depends on the number of frames
+    return args.size() == 0 ? PER_FRAME : WHOLE_VOLUME;
+}
+
 void Pull::help() {
     pprintf("-pull brings a buried stack element to the top. -pull 0 does nothing. -pull 1"
             " brings up the second stack element, and so on. -pull can also be given"
@@ -64,6 +69,12 @@ void Pull::parse(vector<string> args) {
     }
 }
 
+int Pull::footprint(vector<string> args) {
+    // Stashed images hold whole volumes
+    if (args.size() == 1 && '1' <= args[0][0] && args[0][0] <= '9') { return PER_FRAME; }
+    return WHOLE_VOLUME;
+}
+
 void Dup::help() {
     pprintf("-dup duplicates an image and pushes it on the stack. Given no argument"
             " it duplicates the top image in the stack. Given a numeric argument it"
@@ -94,6 +105,11 @@ void Dup::parse(vector<string> args) {
     }
 }
 
+int Dup::footprint(vector<string> args) {
+    if (args.size() == 0 || ('0' <= args[0][0] && args[0][0] <= '9')) { return PER_FRAME; }
+    return WHOLE_VOLUME;
+}
+
 map<string, Image> Stash::stash;
 
 void Stash::help() {
@@ -11,6 +11,7 @@ public:
     void help();
     bool test() {return true;}
     void parse(vector<string> args);
+    int footprint(vector<string>) {return PER_FRAME;}
 };
 
 class Push : public Operation {
@@ -18,6 +19,7 @@ public:
     void help();
     bool test() {return true;}
     void parse(vector<string> args);
+    int footprint(vector<string> args);
 };
 
 class Pull : public Operation {
@@ -25,6 +27,7 @@ public:
     void help();
     bool test() {return true;}
     void parse(vector<string> args);
+    int footprint(vector<string> args);
 };
 
 class Dup : public Operation {
@@ -32,6 +35,7 @@ public:
     void help();
     bool test() {return true;}
     void parse(vector<string> args);
+    int footprint(vector<string> args);
 };
 
 class Stash : public Operation {
@@ -833,6 +833,10 @@ void KMeans::apply(Image im, int clusters) {
         }
     }
 
+    // Every pass below touches all the channels of each pixel, so
+    // work from a copy with the channels interleaved
+    Image pixels = im.toLayout(Image::INTERLEAVED);
+
     for (int iter = 0;; iter++) {
 
         // print the clusters
@@ -863,7 +867,7 @@ void KMeans::apply(Image im, int clusters) {
                     for (int i = 0; i < clusters; i++) {
                         float dist = 0;
                         for (int c = 0; c < im.channels; c++) {
-                            float d = cluster[c][i] - im(x, y, t, c);
+                            float d = cluster[c][i] - pixels(x, y, t, c);
                             dist += d*d;
                         }
                         if (dist < bestDistance) {
@@ -873,7 +877,7 @@ void KMeans::apply(Image im, int clusters) {
                     }
 
                     for (int c = 0; c < im.channels; c++) {
-                        newCluster[c][bestCluster] += im(x, y, t, c);
+                        newCluster[c][bestCluster] += pixels(x, y, t, c);
                     }
                     newClusterMembers[bestCluster]++;
                 }
@@ -913,7 +917,7 @@ void KMeans::apply(Image im, int clusters) {
                 for (int i = 0; i < clusters; i++) {
                     float dist = 0;
                     for (int c = 0; c < im.channels; c++) {
-                        float d = cluster[c][i] - im(x, y, t, c);
+                        float d = cluster[c][i] - pixels(x, y, t, c);
                         dist += d*d;
                     }
                     if (dist < bestDistance) {
@@ -1820,10 +1824,14 @@ Image PatchPCA3D::apply(Image im, float sigma, int newChannels) {
             for (int dy = -patchSize/2; dy <= patchSize/2; dy++) {
                 for (int dx = -patchSize/2; dx <= patchSize/2; dx++) {
                     for (int c = 0; c < im.channels; c++) {
+                        // Volumes with fewer frames than the patch
+                        // size still need to stay in bounds
                         vec[j] = (mask[dx+patchSize/2]*
                                   mask[dy+patchSize/2]*
                                   mask[dt+patchSize/2]*
-                                  im(x+dx, y+dy, t+dy, c));
+                                  im(clamp(x+dx, 0, im.width-1),
+                                     clamp(y+dy, 0, im.height-1),
+                                     clamp(t+dt, 0, im.frames-1), c));
                         j++;
                     }
                 }
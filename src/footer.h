@@ -1,6 +1,10 @@
 #ifdef IMAGESTACK_HEADER_1_H
 #ifndef IMAGESTACK_HEADER_2_H
 // Close the imagestack namespace if we're in it
+#ifdef IMAGESTACK_ARCH
+}
+#pragma GCC pop_options
+#endif
 }
 #undef IMAGESTACK_HEADER_1_H
 #endif
@@ -42,5 +42,23 @@
 // Included for the first time
 namespace ImageStack {
 
+#ifdef IMAGESTACK_ARCH
+// A multi-architecture build compiles every file once for each x86-64
+// microarchitecture level, each copy in a namespace of its own (see
+// Dispatch.cpp). The target pragma, unlike -march, leaves the static
+// initializers at the baseline, so only the copy that is picked at
+// startup runs newer instructions.
+#pragma GCC push_options
+#if IMAGESTACK_ARCH == 4
+#pragma GCC target("arch=x86-64-v4")
+inline namespace x86_64_v4 {
+#elif IMAGESTACK_ARCH == 3
+#pragma GCC target("arch=x86-64-v3")
+inline namespace x86_64_v3 {
+#else
+inline namespace x86_64 {
+#endif
+#endif
+
 #endif
 
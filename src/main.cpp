@@ -34,6 +34,10 @@ void pull(size_t n) {
     }
 }
 
+void swapStack(vector<Image> &other) {
+    stack_.swap(other);
+}
+
 int randomInt(int min, int max) {
     return (int)(((double)rand()/(RAND_MAX+1.0)) * (max - min + 1) + min);
 }
@@ -64,6 +68,39 @@ float currentTime() {
 
 map<string, Operation *> operationMap;
 
+// The expression code in Expr.h is compiled for the widest vector
+// instruction set enabled at build time (see ARCH_CCFLAGS in the
+// makefiles). Make a binary built for a newer machine fail with a
+// message, rather than an illegal instruction somewhere later. This
+// runs before other static initializers, and is itself compiled for
+// the baseline instruction set, so that it gets the chance to. A
+// multi-architecture build instead picks a copy of ImageStack that
+// the processor supports when it starts (see Dispatch.cpp).
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(IMAGESTACK_ARCH)
+__attribute__((constructor(101), target("arch=x86-64")))
+static void checkInstructionSet() {
+    __builtin_cpu_init();
+    const char *missing = NULL;
+#ifdef __AVX__
+    if (!__builtin_cpu_supports("avx")) { missing = "AVX"; }
+#endif
+#ifdef __FMA__
+    if (!__builtin_cpu_supports("fma")) { missing = "FMA"; }
+#endif
+#ifdef __AVX2__
+    if (!__builtin_cpu_supports("avx2")) { missing = "AVX2"; }
+#endif
+#ifdef __AVX512F__
+    if (!__builtin_cpu_supports("avx512f")) { missing = "AVX-512"; }
+#endif
+    if (missing) {
+        fprintf(stderr, "This build of ImageStack uses %s instructions, which this processor "
+                "does not support. Rebuild it with a lower ARCH_CCFLAGS.\n", missing);
+        exit(1);
+    }
+}
+#endif
+
 void start() {
     // get the starting time
 #ifdef WIN32
@@ -81,6 +118,19 @@ void end() {
     unloadOperations();
 }
 
+// The number of arguments, including the operation name, of the
+// operation at args[arg]. Arguments run until the next -[a-zA-Z].
+size_t countArgs(const vector<string> &args, size_t arg) {
+    size_t opArgs;
+    for (opArgs = 1; opArgs + arg < args.size(); opArgs++) {
+        char first = args[arg + opArgs][0];
+        assert(first != '\0', "Empty argument!");
+        if (first != '-') { continue; }
+        if (isalpha(args[arg + opArgs][1])) { break; }
+    }
+    return opArgs;
+}
+
 void parseCommands(vector<string> args) {
     size_t arg = 0, opArgs;
     OperationMapIterator op;
@@ -105,25 +155,27 @@ void parseCommands(vector<string> args) {
                   "Try -help for a list of operations.", args[arg].c_str());
         }
 
-        // find the arguments, look ahead till we see -[a-zA-Z]
-        for (opArgs = 1; opArgs + arg < args.size(); opArgs++) {
-            char first = args[arg + opArgs][0];
-            assert(first != '\0', "Empty argument!");
-            if (first != '-') { continue; }
-            if (isalpha(args[arg + opArgs][1])) { break; }
+        // find the arguments
+        opArgs = countArgs(args, arg);
+
+        vector<string> operationArgs;
+        for (size_t i = arg + 1; i < arg + opArgs; i++) { operationArgs.push_back(args[i]); }
+
+        // see if the operation can take over the next one
+        if (arg + opArgs < args.size()) {
+            size_t nextArgs = countArgs(args, arg + opArgs);
+            vector<string> next(args.begin() + arg + opArgs, args.begin() + arg + opArgs + nextArgs);
+            if ((op->second)->fuse(operationArgs, next)) { opArgs += nextArgs; }
         }
 
         printf("Performing operation %s ", op->first.c_str()); fflush(stdout);
-        if (opArgs < 8) {
-            for (size_t i = arg+1; i < arg + opArgs; i++) {
-                printf("%s ", args[i].c_str());
+        if (operationArgs.size() < 7) {
+            for (size_t i = 0; i < operationArgs.size(); i++) {
+                printf("%s ", operationArgs[i].c_str());
             }
         }
         printf("...\n");
 
-        vector<string> operationArgs;
-        for (size_t i = arg + 1; i < arg + opArgs; i++) { operationArgs.push_back(args[i]); }
-
         // call the operation
         (op->second)->parse(operationArgs);
 
@@ -203,23 +255,11 @@ void pprintf(const char *str) {
         }
     }
 }
-#include "footer.h"
-
 #ifndef NO_MAIN
-
-// We need to make sure main gets replaced with SDL_main on OS X, or
-// display won't work properly. On other platforms it's not necessary,
-// and might slow down non-display using ImageStack command lines, so
-// we don't do it.
-#ifdef __APPLE_CC__
-#ifndef NO_SDL
-#include <SDL.h>
-#endif
-#endif
-
-using namespace ImageStack;
-
-int main(int argc, char **argv) {
+// Run a command line. main calls this, or in a multi-architecture
+// build, picks the copy of it compiled for this processor (see
+// Dispatch.cpp).
+int run(int argc, char **argv) {
 
     start();
 
@@ -246,5 +286,23 @@ int main(int argc, char **argv) {
     return 0;
 
 }
+#endif
+#include "footer.h"
+
+#if !defined(NO_MAIN) && !defined(IMAGESTACK_ARCH)
+
+// We need to make sure main gets replaced with SDL_main on OS X, or
+// display won't work properly. On other platforms it's not necessary,
+// and might slow down non-display using ImageStack command lines, so
+// we don't do it.
+#ifdef __APPLE_CC__
+#ifndef NO_SDL
+#include <SDL.h>
+#endif
+#endif
+
+int main(int argc, char **argv) {
+    return ImageStack::run(argc, argv);
+}
 
 #endif
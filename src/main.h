@@ -50,10 +50,10 @@ using ::std::isnan;
 #include "Exception.h"
 #include "Operation.h"
 
-namespace ImageStack {
+#include "header.h"
 // time since program start in seconds (if using from a library, time since ImageStack::begin)
 float currentTime();
-}
+#include "footer.h"
 
 #include "Image.h"
 #include "header.h"
@@ -66,6 +66,8 @@ void push(Image);
 void pop();
 void dup();
 void pull(size_t);
+// Exchange the whole stack for another, to run commands on a fresh one
+void swapStack(vector<Image> &);
 
 // Parse ints, floats, chars, and ImageStack commands
 int readInt(string);